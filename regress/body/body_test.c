@@ -0,0 +1,225 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that the block encoder produces the same DATA transfer from a
+ * spooled message as the MTA used to, one getline(3) and printf per
+ * line.  With -b, compare how fast both are as well.  Messages are
+ * taken from the command line, or generated if none is given.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+#include "iobuf.h"
+#include "bench.h"
+
+#define	HIWAT		65535
+#define	BLOCK		32768
+
+struct smtpd	*env;
+
+static void
+drain(struct iobuf *iob, int fd)
+{
+	while (iobuf_queued(iob))
+		if (iobuf_write(iob, fd) < 0)
+			errx(1, "iobuf_write");
+}
+
+static void
+encode_lines(FILE *fp, struct iobuf *iob, int fd)
+{
+	char	*ln = NULL;
+	size_t	 sz = 0;
+	ssize_t	 len;
+
+	while ((len = getline(&ln, &sz, fp)) != -1) {
+		if (ln[len - 1] == '\n')
+			ln[len - 1] = '\0';
+		if (iobuf_fqueue(iob, "%s%s\r\n", *ln == '.' ? "." : "",
+		    ln) == -1)
+			errx(1, "iobuf_fqueue");
+		if (iobuf_queued(iob) >= HIWAT)
+			drain(iob, fd);
+	}
+	free(ln);
+	drain(iob, fd);
+}
+
+static void
+encode_blocks(FILE *fp, struct iobuf *iob, int fd)
+{
+	static char	 buf[BLOCK];
+	char		*p;
+	size_t		 len, n;
+	int		 bol = 1;
+
+	while ((len = fread(buf, 1, sizeof buf, fp)) != 0) {
+		n = smtp_body_encoded_len(buf, len, 1, bol);
+		if ((p = iobuf_reserve(iob, n)) == NULL)
+			errx(1, "iobuf_reserve");
+		smtp_body_encode(p, buf, len, 1, &bol);
+		if (iobuf_queued(iob) >= HIWAT)
+			drain(iob, fd);
+	}
+	if (!bol && iobuf_queue(iob, "\r\n", 2) == -1)
+		errx(1, "iobuf_queue");
+	drain(iob, fd);
+}
+
+static double
+run(FILE *fp, void (*encode)(FILE *, struct iobuf *, int), int fd,
+    int rounds)
+{
+	struct iobuf	 iob;
+	struct timespec	 t0;
+	double		 t;
+	int		 i;
+
+	if (iobuf_init(&iob, 0, 0) == -1)
+		errx(1, "iobuf_init");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < rounds; i++) {
+		rewind(fp);
+		encode(fp, &iob, fd);
+	}
+	t = bench_elapsed(&t0);
+	iobuf_clear(&iob);
+
+	return t;
+}
+
+static void
+test(const char *name, FILE *fp, int bflag)
+{
+	struct iobuf	 iob;
+	FILE		*ref, *res;
+	char		*a, *b;
+	size_t		 alen, blen, size;
+	double		 tlines, tblocks;
+	int		 null, rounds;
+
+	if ((ref = tmpfile()) == NULL || (res = tmpfile()) == NULL)
+		err(1, "tmpfile");
+
+	if (iobuf_init(&iob, 0, 0) == -1)
+		errx(1, "iobuf_init");
+	rewind(fp);
+	encode_lines(fp, &iob, fileno(ref));
+	rewind(fp);
+	encode_blocks(fp, &iob, fileno(res));
+	iobuf_clear(&iob);
+
+	a = bench_slurp(fileno(ref), &alen);
+	b = bench_slurp(fileno(res), &blen);
+	if (alen != blen || memcmp(a, b, alen))
+		errx(1, "%s: encodings differ", name);
+	free(a);
+	free(b);
+	fclose(ref);
+	fclose(res);
+
+	if (!bflag)
+		return;
+
+	if (fseeko(fp, 0, SEEK_END) == -1)
+		err(1, "fseeko");
+	size = ftello(fp);
+	rounds = bench_rounds(size);
+
+	if ((null = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "/dev/null");
+	tlines = run(fp, encode_lines, null, rounds);
+	tblocks = run(fp, encode_blocks, null, rounds);
+	close(null);
+
+	printf("%-24s %10zu bytes  lines %8.1f MB/s  blocks %8.1f MB/s\n",
+	    name, size, bench_rate(size, rounds, tlines),
+	    bench_rate(size, rounds, tblocks));
+}
+
+static FILE *
+generate(size_t size, int width, int dots)
+{
+	FILE	*fp;
+	char	*msg;
+	size_t	 len;
+
+	msg = bench_message(size, width, dots, &len);
+	if ((fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	if (fwrite(msg, 1, len, fp) != len)
+		err(1, "fwrite");
+	free(msg);
+
+	return fp;
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE	*fp;
+	int	 i, bflag;
+
+	log_init(1, LOG_MAIL);
+
+	bflag = bench_flag(argc, argv, "[file ...]");
+	argc -= optind;
+	argv += optind;
+
+	if (argc) {
+		for (i = 0; i < argc; i++) {
+			if ((fp = fopen(argv[i], "r")) == NULL)
+				err(1, "%s", argv[i]);
+			test(argv[i], fp, bflag);
+			fclose(fp);
+		}
+		return (0);
+	}
+
+	fp = generate(2 * 1024, 72, 10);
+	test("text 2k", fp, bflag);
+	fclose(fp);
+
+	fp = generate(256 * 1024, 72, 10);
+	test("text 256k", fp, bflag);
+	fclose(fp);
+
+	fp = generate(8 * 1024 * 1024, 76, 0);
+	test("base64 8M", fp, bflag);
+	fclose(fp);
+
+	return (0);
+}
@@ -0,0 +1,143 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/*
+ * Parse the command line, which is "[-b] args".  Returns 1 if -b was
+ * given, and leaves optind on the first argument.
+ */
+int
+bench_flag(int argc, char *argv[], const char *args)
+{
+	extern char	*__progname;
+	int		 ch, bflag = 0;
+
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			bflag = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b]%s%s\n", __progname,
+			    args ? " " : "", args ? args : "");
+			exit(1);
+		}
+	}
+
+	return bflag;
+}
+
+/* enough rounds over size bytes to time BENCH_MINBYTES */
+int
+bench_rounds(size_t size)
+{
+	size_t	rounds;
+
+	rounds = BENCH_MINBYTES / (size ? size : 1) + 1;
+	if (rounds > BENCH_MAXROUNDS)
+		rounds = BENCH_MAXROUNDS;
+
+	return rounds;
+}
+
+/* seconds since t0 */
+double
+bench_elapsed(const struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* MB/s for rounds over size bytes in secs seconds */
+double
+bench_rate(size_t size, int rounds, double secs)
+{
+	return size * (double)rounds / secs / 1e6;
+}
+
+/*
+ * Generate a message of about size bytes of random base64 text in lines
+ * of width characters, one line in dots starting with a '.' unless dots
+ * is 0, with LF line endings.
+ */
+char *
+bench_message(size_t size, int width, int dots, size_t *len)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char hdr[] =
+	    "From: alice@example.com\n"
+	    "To: bob@example.org\n"
+	    "Subject: benchmark\n"
+	    "\n";
+	char	*msg, *p;
+	size_t	 n;
+	int	 i, col;
+
+	if ((msg = malloc(sizeof(hdr) + size + size / width + 2)) == NULL)
+		err(1, "malloc");
+	memcpy(msg, hdr, sizeof(hdr) - 1);
+	p = msg + sizeof(hdr) - 1;
+	for (n = 0, col = 0, i = 0; n < size; n++) {
+		if (col == width) {
+			*p++ = '\n';
+			col = 0;
+			if (dots && ++i % dots == 0) {
+				*p++ = '.';
+				col++;
+			}
+			continue;
+		}
+		*p++ = b64[arc4random_uniform(sizeof(b64) - 1)];
+		col++;
+	}
+	*p++ = '\n';
+	*len = p - msg;
+
+	return msg;
+}
+
+/* read the whole file behind fd */
+char *
+bench_slurp(int fd, size_t *len)
+{
+	char	*buf;
+	off_t	 sz;
+
+	if ((sz = lseek(fd, 0, SEEK_END)) == -1)
+		err(1, "lseek");
+	if ((buf = malloc(sz + 1)) == NULL)
+		err(1, "malloc");
+	if (pread(fd, buf, sz, 0) != sz)
+		err(1, "pread");
+	*len = sz;
+
+	return buf;
+}
@@ -0,0 +1,32 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Helpers shared by the regress programs for their -b mode, which
+ * reports throughput instead of only checking results.
+ */
+
+#define	BENCH_MINBYTES	(256 * 1024 * 1024)
+#define	BENCH_MAXROUNDS	100000
+
+int	 bench_flag(int, char *[], const char *);
+int	 bench_rounds(size_t);
+double	 bench_elapsed(const struct timespec *);
+double	 bench_rate(size_t, int, double);
+char	*bench_message(size_t, int, int, size_t *);
+char	*bench_slurp(int, size_t *);
@@ -0,0 +1,237 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check smtp_body_iov(), which smtp_tx_body() uses to spool the body of
+ * a DATA transfer straight from the input buffer: a message encoded
+ * with smtp_body_encode() and fed to it in reads of various sizes, the
+ * way smtp_tx_body() does, must come back unchanged, and the lines it
+ * must leave to the caller are left alone.  With -b, measure how fast
+ * it decodes as well.  Messages are taken from the command line, or
+ * generated if none is given.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+#include "iobuf.h"
+#include "bench.h"
+
+#define	SMTP_LINE_MAX	65535
+#define	SEGMENT		16384
+
+struct smtpd	*env;
+
+static const size_t segments[] = { 1, 7, 1448, SEGMENT };
+
+/*
+ * Turn a message into what a client sends after DATA: CRLF line ends,
+ * dot-stuffing and the final ".".
+ */
+static char *
+wire(const char *msg, size_t len, size_t *size)
+{
+	char	*data;
+	size_t	 n;
+	int	 bol = 1;
+
+	n = smtp_body_encoded_len(msg, len, 1, 1);
+	data = xmalloc(n + 5);
+	n = smtp_body_encode(data, msg, len, 1, &bol);
+	if (!bol) {
+		memcpy(data + n, "\r\n", 2);
+		n += 2;
+	}
+	memcpy(data + n, ".\r\n", 3);
+	*size = n + 3;
+
+	return data;
+}
+
+/*
+ * Receive a DATA transfer as the session would, reads of seg octets at
+ * a time, and return the length of the decoded body copied to out, if
+ * not NULL.
+ */
+static size_t
+receive(const char *data, size_t size, size_t seg, char *out)
+{
+	struct iovec	 iov[IOV_MAX];
+	struct iobuf	 iob;
+	size_t		 off, n, len, olen = 0;
+	char		*line;
+	int		 i, iovcnt, eom = 0;
+
+	if (iobuf_init(&iob, 0, 0) == -1)
+		errx(1, "iobuf_init");
+
+	for (off = 0; off < size && !eom; off += n) {
+		n = size - off < seg ? size - off : seg;
+		if (n > iobuf_left(&iob))
+			errx(1, "line too long");
+		memcpy(iob.buf + iob.wpos, data + off, n);
+		iob.wpos += n;
+
+		/* what smtp_tx_body() does */
+		while ((len = smtp_body_iov(iov, &iovcnt, IOV_MAX,
+		    iobuf_data(&iob), iobuf_len(&iob), SMTP_LINE_MAX,
+		    &len)) != 0) {
+			for (i = 0; i < iovcnt; i++) {
+				if (out)
+					memcpy(out + olen, iov[i].iov_base,
+					    iov[i].iov_len);
+				olen += iov[i].iov_len;
+			}
+			iobuf_drop(&iob, len);
+		}
+
+		/* only the final "." is left for the per-line code */
+		if ((line = iobuf_getline(&iob, &len)) != NULL) {
+			if (strcmp(line, "."))
+				errx(1, "unexpected line \"%s\"", line);
+			eom = 1;
+		}
+		iobuf_normalize(&iob);
+	}
+	if (!eom)
+		errx(1, "no end of message");
+
+	iobuf_clear(&iob);
+
+	return olen;
+}
+
+static void
+test(const char *name, const char *msg, size_t len, int bflag)
+{
+	struct timespec	 t0;
+	char		*data, *out;
+	size_t		 size, i;
+	double		 t;
+	int		 r, rounds;
+
+	data = wire(msg, len, &size);
+	out = xmalloc(len);
+	for (i = 0; i < sizeof(segments) / sizeof(segments[0]); i++) {
+		if (receive(data, size, segments[i], out) != len ||
+		    memcmp(out, msg, len))
+			errx(1, "%s: body differs with %zu octet reads",
+			    name, segments[i]);
+	}
+	free(out);
+
+	if (bflag) {
+		rounds = bench_rounds(size);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r = 0; r < rounds; r++)
+			(void)receive(data, size, SEGMENT, NULL);
+		t = bench_elapsed(&t0);
+		printf("%-24s %10zu bytes  %8.1f MB/s\n", name, size,
+		    bench_rate(size, rounds, t));
+	}
+
+	free(data);
+}
+
+/* decode buf once, and check what is consumed and what comes out */
+static void
+check(const char *buf, size_t linemax, size_t consumed, const char *want)
+{
+	struct iovec	 iov[IOV_MAX];
+	char		 in[128], out[128];
+	size_t		 n, olen, off;
+	int		 i, iovcnt;
+
+	(void)strlcpy(in, buf, sizeof in);
+	n = smtp_body_iov(iov, &iovcnt, IOV_MAX, in, strlen(in), linemax,
+	    &olen);
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		memcpy(out + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	out[off] = '\0';
+	if (n != consumed || off != olen || strcmp(out, want))
+		errx(1, "\"%s\": consumed %zu, decoded \"%s\"", buf, n, out);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE	*fp;
+	char	*msg;
+	size_t	 len;
+	int	 i, bflag;
+
+	log_init(1, LOG_MAIL);
+
+	bflag = bench_flag(argc, argv, "[file ...]");
+	argc -= optind;
+	argv += optind;
+
+	if (argc) {
+		for (i = 0; i < argc; i++) {
+			if ((fp = fopen(argv[i], "r")) == NULL)
+				err(1, "%s", argv[i]);
+			msg = bench_slurp(fileno(fp), &len);
+			test(argv[i], msg, len, bflag);
+			free(msg);
+			fclose(fp);
+		}
+		return (0);
+	}
+
+	check("a\r\nb\r\n", SMTP_LINE_MAX, 6, "a\nb\n");
+	check("a\nb\n", SMTP_LINE_MAX, 4, "a\nb\n");
+	check("a\rb\r\n", SMTP_LINE_MAX, 5, "a\rb\n");
+	check(".a\r\n..\r\n", SMTP_LINE_MAX, 8, "a\n.\n");
+	check("a\r\n.\r\nb\r\n", SMTP_LINE_MAX, 3, "a\n");
+	check("a\r\nbc", SMTP_LINE_MAX, 3, "a\n");
+	check("a\r\nb\r", SMTP_LINE_MAX, 3, "a\n");
+	check("ab\r\nabcd\r\n", 4, 4, "ab\n");
+	check(".\r\n", SMTP_LINE_MAX, 0, "");
+
+	msg = bench_message(2 * 1024, 72, 10, &len);
+	test("text 2k", msg, len, bflag);
+	free(msg);
+
+	msg = bench_message(256 * 1024, 72, 10, &len);
+	test("text 256k", msg, len, bflag);
+	free(msg);
+
+	msg = bench_message(8 * 1024 * 1024, 76, 0, &len);
+	test("base64 8M", msg, len, bflag);
+	free(msg);
+
+	return (0);
+}
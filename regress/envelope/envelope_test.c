@@ -0,0 +1,159 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that envelopes dumped in the ASCII and binary formats load back
+ * to the same envelope.  Both an MTA and a bounce envelope are used,
+ * since they do not store the same fields, and an IPv6 source address
+ * as well as an IPv4 one.  With -b, compare the cost of dumping and
+ * loading in both formats as well.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd.h"
+#include "log.h"
+#include "bench.h"
+
+struct smtpd	*env;
+
+static void
+envelope_fill(struct envelope *evp)
+{
+	struct sockaddr_in	*sin = (struct sockaddr_in *)&evp->ss;
+
+	memset(evp, 0, sizeof *evp);
+	evp->version = SMTPD_ENVELOPE_VERSION;
+	evp->type = D_MTA;
+	evp->flags = EF_AUTHENTICATED;
+	(void)strlcpy(evp->dispatcher, "relay", sizeof evp->dispatcher);
+	(void)strlcpy(evp->tag, "submission", sizeof evp->tag);
+	(void)strlcpy(evp->smtpname, "mx.example.org", sizeof evp->smtpname);
+	(void)strlcpy(evp->helo, "client.example.com", sizeof evp->helo);
+	(void)strlcpy(evp->hostname, "client.example.com",
+	    sizeof evp->hostname);
+	(void)strlcpy(evp->errorline, "421 Service temporarily unavailable",
+	    sizeof evp->errorline);
+	sin->sin_family = AF_INET;
+	(void)inet_pton(AF_INET, "192.0.2.1", &sin->sin_addr);
+	(void)strlcpy(evp->sender.user, "alice", sizeof evp->sender.user);
+	(void)strlcpy(evp->sender.domain, "example.com",
+	    sizeof evp->sender.domain);
+	evp->rcpt = evp->sender;
+	(void)strlcpy(evp->rcpt.user, "bob", sizeof evp->rcpt.user);
+	evp->dest = evp->rcpt;
+	evp->creation = time(NULL);
+	evp->ttl = 4 * 24 * 60 * 60;
+	evp->lasttry = evp->creation + 600;
+	evp->retry = 3;
+	evp->dsn_notify = DSN_FAILURE;
+	evp->dsn_ret = DSN_RETHDRS;
+	(void)strlcpy(evp->dsn_envid, "QQ314159", sizeof evp->dsn_envid);
+}
+
+static void
+test(const char *name, int (*dump)(const struct envelope *, char *, size_t),
+    const struct envelope *evp, int bflag)
+{
+	struct envelope	 out;
+	struct timespec	 t0;
+	char		 buf[sizeof(struct envelope)];
+	char		 ref[sizeof(struct envelope)];
+	char		 res[sizeof(struct envelope)];
+	double		 tdump, tload;
+	int		 i, len;
+
+	if ((len = dump(evp, buf, sizeof buf)) == 0)
+		errx(1, "%s: dump failed", name);
+	if (!envelope_load_buffer(&out, buf, len))
+		errx(1, "%s: load failed", name);
+
+	/* compare the text forms, they only contain what is stored */
+	memset(ref, 0, sizeof ref);
+	memset(res, 0, sizeof res);
+	if (envelope_dump_buffer(evp, ref, sizeof ref) == 0 ||
+	    envelope_dump_buffer(&out, res, sizeof res) == 0 ||
+	    strcmp(ref, res))
+		errx(1, "%s: envelope differs after load", name);
+
+	if (!bflag)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_MAXROUNDS; i++)
+		if (dump(evp, buf, sizeof buf) == 0)
+			errx(1, "%s: dump failed", name);
+	tdump = bench_elapsed(&t0) * 1e9 / BENCH_MAXROUNDS;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < BENCH_MAXROUNDS; i++)
+		if (!envelope_load_buffer(&out, buf, len))
+			errx(1, "%s: load failed", name);
+	tload = bench_elapsed(&t0) * 1e9 / BENCH_MAXROUNDS;
+
+	printf("%-8s %5d bytes  dump %8.1f ns  load %8.1f ns\n",
+	    name, len, tdump, tload);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in6	*sin6;
+	struct envelope		 evp;
+	int			 bflag;
+
+	log_init(1, LOG_MAIL);
+
+	bflag = bench_flag(argc, argv, NULL);
+
+	envelope_fill(&evp);
+	test("ascii", envelope_dump_buffer, &evp, bflag);
+	test("binary", envelope_dump_binary, &evp, bflag);
+
+	evp.type = D_BOUNCE;
+	evp.agent.bounce.type = B_DELAYED;
+	evp.agent.bounce.delay = 4 * 60 * 60;
+	evp.agent.bounce.ttl = 24 * 60 * 60;
+	test("ascii", envelope_dump_buffer, &evp, bflag);
+	test("binary", envelope_dump_binary, &evp, bflag);
+
+	sin6 = (struct sockaddr_in6 *)&evp.ss;
+	memset(&evp.ss, 0, sizeof evp.ss);
+	sin6->sin6_family = AF_INET6;
+	(void)inet_pton(AF_INET6, "2001:db8::1", &sin6->sin6_addr);
+	test("ascii", envelope_dump_buffer, &evp, bflag);
+	test("binary", envelope_dump_binary, &evp, bflag);
+
+	return (0);
+}
@@ -0,0 +1,252 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Feed inputs to iobuf_getline() cut in segments of every size, as reads
+ * from a socket would, and check the lines against a plain split of the
+ * whole input: a CR is only removed right before the LF, whatever read
+ * each of them came in, and an unterminated line stays buffered.
+ * With -b, measure how fast lines are split instead.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iobuf.h"
+#include "bench.h"
+
+#define	SEGMENT		1448
+
+static const char *tests[] = {
+	"",
+	"\n",
+	"\r\n",
+	"\n\n\r\n",
+	"a\n",
+	"a\r\n",
+	"a\rb\r\n",
+	"a\r\r\n",
+	"\r\r\n\r",
+	"no final newline",
+	"a\r\nb",
+	"a\r\nb\r",
+	"EHLO example.org\r\nMAIL FROM:<a@example.org>\r\nDATA\r\n",
+};
+
+/*
+ * Append the lines of the input to out, each followed by a LF, and
+ * return how much of the input is left after the last one.
+ */
+static size_t
+split(struct iobuf *iob, const char *data, size_t size, size_t segment,
+    char *out, size_t *outlen)
+{
+	size_t	 off, n, len;
+	char	*line;
+
+	*outlen = 0;
+	for (off = 0; off < size; off += n) {
+		n = size - off < segment ? size - off : segment;
+		if (n > iobuf_left(iob))
+			errx(1, "line too long");
+		memcpy(iob->buf + iob->wpos, data + off, n);
+		iob->wpos += n;
+		while ((line = iobuf_getline(iob, &len)) != NULL) {
+			if (out) {
+				memcpy(out + *outlen, line, len);
+				out[*outlen + len] = '\n';
+			}
+			*outlen += len + 1;
+		}
+		iobuf_normalize(iob);
+	}
+
+	return (iobuf_len(iob));
+}
+
+static size_t
+reference(const char *data, size_t size, char *out, size_t *outlen)
+{
+	const char	*p, *end, *lf;
+	size_t		 n;
+
+	*outlen = 0;
+	end = data + size;
+	for (p = data; (lf = memchr(p, '\n', end - p)) != NULL; p = lf + 1) {
+		n = lf - p;
+		if (n && lf[-1] == '\r')
+			n--;
+		memcpy(out + *outlen, p, n);
+		out[*outlen + n] = '\n';
+		*outlen += n + 1;
+	}
+
+	return (end - p);
+}
+
+static void
+check(const char *name, const char *data, size_t size)
+{
+	struct iobuf	 iob;
+	char		*ref, *res;
+	size_t		 reflen, reslen, refrest, resrest, segment;
+
+	if ((ref = malloc(2 * size + 1)) == NULL ||
+	    (res = malloc(2 * size + 1)) == NULL)
+		err(1, "malloc");
+	refrest = reference(data, size, ref, &reflen);
+
+	for (segment = 1; segment <= size; segment++) {
+		if (iobuf_init(&iob, 0, 0) == -1)
+			errx(1, "iobuf_init");
+		resrest = split(&iob, data, size, segment, res, &reslen);
+		if (reslen != reflen || memcmp(ref, res, reflen))
+			errx(1, "%s: wrong lines with %zu byte reads",
+			    name, segment);
+		if (resrest != refrest ||
+		    memcmp(iobuf_data(&iob), data + size - refrest, refrest))
+			errx(1, "%s: wrong remainder with %zu byte reads",
+			    name, segment);
+		iobuf_clear(&iob);
+	}
+
+	free(ref);
+	free(res);
+}
+
+static void
+feed(struct iobuf *iob, const char *s)
+{
+	size_t	n = strlen(s);
+
+	if (n > iobuf_left(iob))
+		errx(1, "feed: no space left");
+	memcpy(iob->buf + iob->wpos, s, n);
+	iob->wpos += n;
+}
+
+/* the scan offset must follow data dropped before the end of line */
+static void
+check_drop(void)
+{
+	struct iobuf	 iob;
+	size_t		 len;
+	char		*line;
+
+	if (iobuf_init(&iob, 0, 0) == -1)
+		errx(1, "iobuf_init");
+
+	feed(&iob, "abcdef");
+	if (iobuf_getline(&iob, &len) != NULL)
+		errx(1, "drop: line without newline");
+	iobuf_drop(&iob, 2);
+	feed(&iob, "\r\nxy");
+	if ((line = iobuf_getline(&iob, &len)) == NULL ||
+	    len != 4 || strcmp(line, "cdef"))
+		errx(1, "drop: wrong line after partial drop");
+
+	iobuf_drop(&iob, iobuf_len(&iob));
+	feed(&iob, "z\n");
+	if ((line = iobuf_getline(&iob, &len)) == NULL ||
+	    len != 1 || strcmp(line, "z"))
+		errx(1, "drop: wrong line after full drop");
+
+	iobuf_clear(&iob);
+}
+
+static char *
+generate(size_t size, size_t width)
+{
+	char	*data;
+	size_t	 i;
+
+	if ((data = malloc(size)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < size; i++) {
+		if (i % width == width - 2)
+			data[i] = '\r';
+		else if (i % width == width - 1)
+			data[i] = '\n';
+		else
+			data[i] = 'a' + arc4random_uniform(26);
+	}
+	data[size - 1] = '\n';
+
+	return data;
+}
+
+static void
+bench(const char *name, size_t size, size_t width)
+{
+	struct iobuf	 iob;
+	struct timespec	 t0;
+	double		 t;
+	size_t		 len;
+	char		*data;
+	int		 i, rounds;
+
+	data = generate(size, width);
+	rounds = bench_rounds(size);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < rounds; i++) {
+		if (iobuf_init(&iob, 0, 0) == -1)
+			errx(1, "iobuf_init");
+		(void)split(&iob, data, size, SEGMENT, NULL, &len);
+		iobuf_clear(&iob);
+	}
+	t = bench_elapsed(&t0);
+
+	printf("%-20s %8zu bytes  %8.1f MB/s\n", name, size,
+	    bench_rate(size, rounds, t));
+	free(data);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char	*data;
+	size_t	 i;
+
+	if (bench_flag(argc, argv, NULL)) {
+		/* pipelined commands, DATA lines, lines spanning many reads */
+		bench("commands", 4096, 32);
+		bench("body", 1024 * 1024, 78);
+		bench("long lines", 1024 * 1024, 32 * 1024);
+		return (0);
+	}
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+		check(tests[i], tests[i], strlen(tests[i]));
+
+	data = generate(4 * 1024, 1000);
+	check("long lines", data, 4 * 1024);
+	free(data);
+
+	check_drop();
+
+	return (0);
+}
@@ -0,0 +1,397 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Crash the log queue backend in the middle of an append, by cutting
+ * its segment inside the last record, and check that it comes back
+ * with that record dropped and everything before it intact.  Each run
+ * of the backend happens in its own process, as it would across a
+ * restart.
+ *
+ * Then abort a message and queue another one under the same msgid if
+ * the backend lets it, and check that the envelopes of the aborted
+ * message do not come back with it.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	NENVELOPES	10
+
+struct smtpd	*env;
+
+extern struct queue_backend	queue_backend_log;
+
+static int (*message_create)(uint32_t *);
+static int (*message_commit)(uint32_t, const char *);
+static int (*message_delete)(uint32_t);
+static int (*envelope_create)(uint32_t, const char *, size_t, uint64_t *);
+static int (*envelope_update)(uint64_t, const char *, size_t);
+static int (*envelope_load)(uint64_t, char *, size_t);
+static int (*envelope_walk)(uint64_t *, char *, size_t);
+
+static char	 segment[PATH_MAX];
+static uint64_t	 evpids[NENVELOPES];
+static off_t	 expected;
+static uint32_t	 reuse;
+
+/* what the backend needs from queue_backend.c, mproc.c and stat */
+
+void
+queue_api_on_close(int (*cb)(void))
+{
+}
+
+void
+queue_api_on_message_fd_r(int (*cb)(uint32_t))
+{
+}
+
+void
+queue_api_on_envelope_delete(int (*cb)(uint64_t))
+{
+}
+
+void
+queue_api_on_message_walk(int (*cb)(uint64_t *, char *, size_t, uint32_t,
+    int *, void **))
+{
+}
+
+void
+stat_increment(const char *name, size_t count)
+{
+}
+
+void
+stat_decrement(const char *name, size_t count)
+{
+}
+
+void
+mproc_hold(void)
+{
+}
+
+void
+mproc_release(void)
+{
+}
+
+void
+queue_api_on_message_create(int (*cb)(uint32_t *))
+{
+	message_create = cb;
+}
+
+void
+queue_api_on_message_commit(int (*cb)(uint32_t, const char *))
+{
+	message_commit = cb;
+}
+
+void
+queue_api_on_message_delete(int (*cb)(uint32_t))
+{
+	message_delete = cb;
+}
+
+void
+queue_api_on_envelope_create(int (*cb)(uint32_t, const char *, size_t,
+    uint64_t *))
+{
+	envelope_create = cb;
+}
+
+void
+queue_api_on_envelope_update(int (*cb)(uint64_t, const char *, size_t))
+{
+	envelope_update = cb;
+}
+
+void
+queue_api_on_envelope_load(int (*cb)(uint64_t, char *, size_t))
+{
+	envelope_load = cb;
+}
+
+void
+queue_api_on_envelope_walk(int (*cb)(uint64_t *, char *, size_t))
+{
+	envelope_walk = cb;
+}
+
+uint32_t
+queue_generate_msgid(void)
+{
+	uint32_t	msgid;
+
+	/* offer the msgid of the aborted message once */
+	if (reuse) {
+		msgid = reuse;
+		reuse = 0;
+		return (msgid);
+	}
+	while ((msgid = arc4random()) == 0)
+		;
+	return (msgid);
+}
+
+uint64_t
+queue_generate_evpid(uint32_t msgid)
+{
+	uint32_t	rnd;
+
+	while ((rnd = arc4random()) == 0)
+		;
+	return ((uint64_t)msgid << 32 | rnd);
+}
+
+static void
+backend_init(void)
+{
+	struct passwd	*pw;
+
+	if ((pw = getpwuid(getuid())) == NULL)
+		err(1, "getpwuid");
+	event_init();
+	if (!queue_backend_log.init(pw, 1, NULL))
+		errx(1, "queue_log_init");
+}
+
+static off_t
+segment_size(void)
+{
+	struct stat	sb;
+
+	if (stat(segment, &sb) == -1)
+		err(1, "stat: %s", segment);
+	return (sb.st_size);
+}
+
+static void
+commit(uint32_t msgid)
+{
+	char	path[PATH_MAX];
+	int	fd;
+
+	(void)snprintf(path, sizeof path, "%s/message.tmp",
+	    env->sc_queue_directory);
+	if ((fd = open(path, O_CREAT | O_WRONLY, 0600)) == -1)
+		err(1, "open: %s", path);
+	close(fd);
+	if (!message_commit(msgid, path))
+		errx(1, "message_commit");
+}
+
+/* queue one message, then update its last envelope */
+static void
+fill(int fd)
+{
+	char		 buf[LINE_MAX];
+	uint32_t	 msgid;
+	off_t		 size;
+	int		 i;
+
+	backend_init();
+
+	if (!message_create(&msgid))
+		errx(1, "message_create");
+	for (i = 0; i < NENVELOPES; i++) {
+		(void)snprintf(buf, sizeof buf, "envelope %d", i);
+		if (!envelope_create(msgid, buf, strlen(buf), &evpids[i]))
+			errx(1, "envelope_create");
+	}
+	commit(msgid);
+
+	size = segment_size();
+	(void)snprintf(buf, sizeof buf, "envelope %d, updated", i - 1);
+	if (!envelope_update(evpids[i - 1], buf, strlen(buf)))
+		errx(1, "envelope_update");
+
+	if (write(fd, evpids, sizeof evpids) != sizeof evpids ||
+	    write(fd, &size, sizeof size) != sizeof size)
+		err(1, "write");
+}
+
+/* everything but the torn update must be back */
+static void
+check(void)
+{
+	char		 buf[LINE_MAX], want[LINE_MAX];
+	uint64_t	 evpid;
+	int		 i, n;
+
+	backend_init();
+
+	if (segment_size() != expected)
+		errx(1, "segment is %lld bytes, expected %lld",
+		    (long long)segment_size(), (long long)expected);
+
+	for (n = 0; envelope_walk(&evpid, buf, sizeof buf) != -1; n++)
+		;
+	if (n != NENVELOPES)
+		errx(1, "%d envelope(s) found, expected %d", n, NENVELOPES);
+
+	for (i = 0; i < NENVELOPES; i++) {
+		(void)snprintf(want, sizeof want, "envelope %d", i);
+		if (envelope_load(evpids[i], buf, sizeof buf) == 0)
+			errx(1, "envelope %d is gone", i);
+		if (strcmp(buf, want))
+			errx(1, "envelope %d reads \"%s\"", i, buf);
+	}
+}
+
+static void
+abort_fill(void)
+{
+	uint64_t	evpid;
+	uint32_t	msgid;
+
+	backend_init();
+
+	if (!message_create(&msgid))
+		errx(1, "message_create");
+	if (!envelope_create(msgid, "aborted", 7, &evpid))
+		errx(1, "envelope_create");
+	if (!message_delete(msgid))
+		errx(1, "message_delete");
+
+	reuse = msgid;
+	if (!message_create(&msgid))
+		errx(1, "message_create");
+	if (!envelope_create(msgid, "queued", 6, &evpid))
+		errx(1, "envelope_create");
+	commit(msgid);
+}
+
+/* only the envelope of the queued message is there */
+static void
+abort_check(void)
+{
+	char		 buf[LINE_MAX];
+	uint64_t	 evpid;
+	int		 n;
+
+	backend_init();
+
+	for (n = 0; envelope_walk(&evpid, buf, sizeof buf) != -1; n++)
+		if (strcmp(buf, "queued"))
+			errx(1, "envelope reads \"%s\"", buf);
+	if (n != 1)
+		errx(1, "%d envelope(s) found, expected 1", n);
+}
+
+static void
+run(void (*fn)(void))
+{
+	pid_t	pid;
+	int	status;
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		fn();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(1, "backend run failed");
+}
+
+int
+main(int argc, char *argv[])
+{
+	char	 dir[] = "/tmp/queue_log_test.XXXXXX";
+	char	 dir2[] = "/tmp/queue_log_test.XXXXXX";
+	char	 cmd[PATH_MAX + 16];
+	off_t	 size;
+	pid_t	 pid;
+	int	 fds[2], status;
+
+	log_init(1, LOG_MAIL);
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	env = xcalloc(1, sizeof *env);
+	env->sc_queue_directory = dir;
+	(void)snprintf(segment, sizeof segment, "%s/log/segment.00000001", dir);
+
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(fds[0]);
+		fill(fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(1, "backend run failed");
+	if (read(fds[0], evpids, sizeof evpids) != sizeof evpids ||
+	    read(fds[0], &expected, sizeof expected) != sizeof expected)
+		errx(1, "short read");
+	close(fds[0]);
+
+	/* cut the update record in two, as a crash during pwritev would */
+	size = segment_size();
+	if (truncate(segment, expected + (size - expected) / 2) == -1)
+		err(1, "truncate");
+
+	/* the torn record goes away, and stays away on the next restart */
+	run(check);
+	run(check);
+
+	(void)snprintf(cmd, sizeof cmd, "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		errx(1, "could not remove %s", dir);
+
+	if (mkdtemp(dir2) == NULL)
+		err(1, "mkdtemp");
+	env->sc_queue_directory = dir2;
+	run(abort_fill);
+	run(abort_check);
+
+	(void)snprintf(cmd, sizeof cmd, "rm -rf %s", dir2);
+	if (system(cmd) != 0)
+		errx(1, "could not remove %s", dir2);
+
+	return (0);
+}
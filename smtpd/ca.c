@@ -28,16 +28,19 @@
 #include <err.h>
 #include <imsg.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <openssl/ssl.h>
 #include <openssl/pem.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
+#include <openssl/ecdsa.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
 
@@ -46,6 +49,8 @@
 #include "ssl.h"
 
 static int	 ca_verify_cb(int, X509_STORE_CTX *);
+static int	 ca_send_imsg(unsigned int, const char *, const void *, size_t,
+		    void *, size_t, int);
 
 static int	 rsae_send_imsg(int, const unsigned char *, unsigned char *,
 		    RSA *, int, unsigned int);
@@ -63,8 +68,29 @@ static int	 rsae_bn_mod_exp(BIGNUM *, const BIGNUM *, const BIGNUM *,
 static int	 rsae_init(RSA *);
 static int	 rsae_finish(RSA *);
 static int	 rsae_keygen(RSA *, int, BIGNUM *, BN_GENCB *);
+static void	 rsae_engine_init(void);
+
+#ifdef HAVE_ECDSA_SET_EX_DATA
+static ECDSA_SIG *ecdsae_send_imsg(const unsigned char *, int, EC_KEY *);
+static ECDSA_SIG *ecdsae_do_sign(const unsigned char *, int, const BIGNUM *,
+		    const BIGNUM *, EC_KEY *);
+static int	 ecdsae_sign_setup(EC_KEY *, BN_CTX *, BIGNUM **, BIGNUM **);
+static int	 ecdsae_do_verify(const unsigned char *, int, const ECDSA_SIG *,
+		    EC_KEY *);
+static void	 ecdsae_engine_init(void);
+#endif
+
+static uint64_t	 ca_reqid = 0;
+
+static size_t
+elapsed_usec(const struct timespec *t0)
+{
+	struct timespec	 t1, dt;
 
-static uint64_t	 rsae_reqid = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespecsub(&t1, t0, &dt);
+	return (dt.tv_sec * 1000000 + dt.tv_nsec / 1000);
+}
 
 static void
 ca_shutdown(void)
@@ -77,6 +103,7 @@ int
 ca(void)
 {
 	struct passwd	*pw;
+	size_t		 i;
 
 	purge_config(PURGE_LISTENERS|PURGE_TABLES|PURGE_RULES|PURGE_DISPATCHERS);
 
@@ -108,7 +135,8 @@ ca(void)
 	config_peer(PROC_PONY);
 
 	/* Ignore them until we get our config */
-	mproc_disable(p_pony);
+	for (i = 0; i < pony_nworkers; i++)
+		mproc_disable(p_ponies[i]);
 
 	if (pledge("stdio", NULL) == -1)
 		err(1, "pledge");
@@ -215,12 +243,15 @@ end:
 void
 ca_imsg(struct mproc *p, struct imsg *imsg)
 {
-	RSA			*rsa;
+	RSA			*rsa = NULL;
+	EC_KEY			*eckey = NULL;
+	ECDSA_SIG		*sig;
+	struct timespec		 t0;
 	const void		*from = NULL;
-	unsigned char		*to = NULL;
+	unsigned char		*to = NULL, *end;
 	struct msg		 m;
 	const char		*pkiname;
-	size_t			 flen, tlen, padding;
+	size_t			 flen, tlen, padding, i;
 	struct pki		*pki;
 	int			 ret = 0;
 	uint64_t		 id;
@@ -236,7 +267,8 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 		ca_init();
 
 		/* Start fulfilling requests */
-		mproc_enable(p_pony);
+		for (i = 0; i < pony_nworkers; i++)
+			mproc_enable(p_ponies[i]);
 		return;
 
 	case IMSG_CTL_VERBOSE:
@@ -255,6 +287,7 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_CA_PRIVENC:
 	case IMSG_CA_PRIVDEC:
+	case IMSG_CA_ECDSA_SIGN:
 		m_msg(&m, imsg);
 		m_get_id(&m, &id);
 		m_get_string(&m, &pkiname);
@@ -264,13 +297,18 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 
 		pki = dict_get(env->sc_pki_dict, pkiname);
-		if (pki == NULL || pki->pki_pkey == NULL ||
-		    (rsa = EVP_PKEY_get1_RSA(pki->pki_pkey)) == NULL)
+		if (pki == NULL || pki->pki_pkey == NULL)
+			fatalx("ca_imsg: invalid pki");
+		if (imsg->hdr.type == IMSG_CA_ECDSA_SIGN) {
+			if ((eckey = EVP_PKEY_get1_EC_KEY(pki->pki_pkey)) == NULL)
+				fatalx("ca_imsg: invalid pki");
+		} else if ((rsa = EVP_PKEY_get1_RSA(pki->pki_pkey)) == NULL)
 			fatalx("ca_imsg: invalid pki");
 
 		if ((to = calloc(1, tlen)) == NULL)
 			fatalx("ca_imsg: calloc");
 
+		clock_gettime(CLOCK_MONOTONIC, &t0);
 		switch (imsg->hdr.type) {
 		case IMSG_CA_PRIVENC:
 			ret = RSA_private_encrypt(flen, from, to, rsa,
@@ -280,7 +318,19 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 			ret = RSA_private_decrypt(flen, from, to, rsa,
 			    padding);
 			break;
+		case IMSG_CA_ECDSA_SIGN:
+			/* the signature goes back DER-encoded */
+			if ((sig = ECDSA_do_sign(from, flen, eckey)) == NULL)
+				break;
+			if ((size_t)i2d_ECDSA_SIG(sig, NULL) <= tlen) {
+				end = to;
+				ret = i2d_ECDSA_SIG(sig, &end);
+			}
+			ECDSA_SIG_free(sig);
+			break;
 		}
+		stat_increment("ca.keyop", 1);
+		stat_increment("ca.keyop.usec", elapsed_usec(&t0));
 
 		m_create(p, imsg->hdr.type, 0, 0, -1);
 		m_add_id(p, id);
@@ -291,6 +341,7 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 
 		free(to);
 		RSA_free(rsa);
+		EC_KEY_free(eckey);
 
 		return;
 	}
@@ -321,39 +372,59 @@ static RSA_METHOD rsae_method = {
 	rsae_keygen
 };
 
+/*
+ * Have a ca worker perform a private key operation on behalf of an
+ * unprivileged process.  The answer, if any, is copied to "to", which
+ * holds "tlen" bytes.
+ */
 static int
-rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
-    RSA *rsa, int padding, unsigned int cmd)
+ca_send_imsg(unsigned int cmd, const char *pkiname, const void *from,
+    size_t flen, void *to, size_t tlen, int padding)
 {
 	int		 ret = 0;
+	struct mproc	*p;
 	struct imsgbuf	*ibuf;
 	struct imsg	 imsg;
+	struct timespec	 t0;
+	struct pollfd	 pfd;
 	int		 n, done = 0;
 	const void	*toptr;
-	char		*pkiname;
-	size_t		 tlen;
+	size_t		 len;
 	struct msg	 m;
 	uint64_t	 id;
 
-	if ((pkiname = RSA_get_ex_data(rsa, 0)) == NULL)
-		return (0);
-
 	/*
 	 * Send a synchronous imsg because we cannot defer the RSA
-	 * operation in OpenSSL's engine layer.
+	 * operation in OpenSSL's engine layer.  The channel is
+	 * non-blocking, so sleep in poll(2) until the answer is there
+	 * rather than spinning and stealing the cpu from the ca process.
+	 * Every session of this process stalls until then, outgoing ones
+	 * included since they all run in the first worker.
+	 *
+	 * Requests are spread over the ca workers in turn.
 	 */
-	m_create(p_ca, cmd, 0, 0, -1);
-	rsae_reqid++;
-	m_add_id(p_ca, rsae_reqid);
-	m_add_string(p_ca, pkiname);
-	m_add_data(p_ca, (const void *)from, (size_t)flen);
-	m_add_size(p_ca, (size_t)RSA_size(rsa));
-	m_add_size(p_ca, (size_t)padding);
-	m_flush(p_ca);
-
-	ibuf = &p_ca->imsgbuf;
+	ca_reqid++;
+	p = p_cas[ca_reqid % ca_nworkers];
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	m_create(p, cmd, 0, 0, -1);
+	m_add_id(p, ca_reqid);
+	m_add_string(p, pkiname);
+	m_add_data(p, from, flen);
+	m_add_size(p, tlen);
+	m_add_size(p, (size_t)padding);
+	m_flush(p);
+
+	ibuf = &p->imsgbuf;
+	pfd.fd = ibuf->fd;
+	pfd.events = POLLIN;
 
 	while (!done) {
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll");
+		}
 		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
 			fatalx("imsg_read");
 		if (n == 0)
@@ -370,35 +441,55 @@ rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
 			switch (imsg.hdr.type) {
 			case IMSG_CA_PRIVENC:
 			case IMSG_CA_PRIVDEC:
+			case IMSG_CA_ECDSA_SIGN:
 				break;
 			default:
 				/* Another imsg is queued up in the buffer */
-				pony_imsg(p_ca, &imsg);
+				pony_imsg(p, &imsg);
 				imsg_free(&imsg);
 				continue;
 			}
 
 			m_msg(&m, &imsg);
 			m_get_id(&m, &id);
-			if (id != rsae_reqid)
+			if (id != ca_reqid)
 				fatalx("invalid response id");
 			m_get_int(&m, &ret);
 			if (ret > 0)
-				m_get_data(&m, &toptr, &tlen);
+				m_get_data(&m, &toptr, &len);
 			m_end(&m);
 
-			if (ret > 0)
-				memcpy(to, toptr, tlen);
+			if (ret > 0) {
+				if (len > tlen)
+					fatalx("invalid response size");
+				memcpy(to, toptr, len);
+			}
 			done = 1;
 
 			imsg_free(&imsg);
 		}
 	}
-	mproc_event_add(p_ca);
+	mproc_event_add(p);
+
+	stat_increment("ca.request", 1);
+	stat_increment("ca.request.usec", elapsed_usec(&t0));
 
 	return (ret);
 }
 
+static int
+rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding, unsigned int cmd)
+{
+	char	*pkiname;
+
+	if ((pkiname = RSA_get_ex_data(rsa, 0)) == NULL)
+		return (0);
+
+	return (ca_send_imsg(cmd, pkiname, from, (size_t)flen, to,
+	    (size_t)RSA_size(rsa), padding));
+}
+
 static int
 rsae_pub_enc(int flen,const unsigned char *from, unsigned char *to, RSA *rsa,
     int padding)
@@ -479,8 +570,8 @@ rsae_keygen(RSA *rsa, int bits, BIGNUM *e, BN_GENCB *cb)
 	return (rsa_default->rsa_keygen(rsa, bits, e, cb));
 }
 
-void
-ca_engine_init(void)
+static void
+rsae_engine_init(void)
 {
 	ENGINE		*e;
 	const char	*errstr, *name;
@@ -536,3 +627,128 @@ ca_engine_init(void)
 	ssl_error(errstr);
 	fatalx("%s", errstr);
 }
+
+#ifdef HAVE_ECDSA_SET_EX_DATA
+/*
+ * ECDSA privsep engine (called from unprivileged processes)
+ */
+
+const ECDSA_METHOD *ecdsa_default = NULL;
+
+static ECDSA_METHOD ecdsae_method = {
+	"ECDSA privsep engine",
+	ecdsae_do_sign,
+	ecdsae_sign_setup,
+	ecdsae_do_verify,
+	0,
+	NULL
+};
+
+static ECDSA_SIG *
+ecdsae_send_imsg(const unsigned char *dgst, int dgst_len, EC_KEY *eckey)
+{
+	ECDSA_SIG		*sig = NULL;
+	unsigned char		*buf;
+	const unsigned char	*der;
+	char			*pkiname;
+	int			 len;
+
+	if ((pkiname = ECDSA_get_ex_data(eckey, 0)) == NULL)
+		return (NULL);
+
+	if ((buf = calloc(1, ECDSA_size(eckey))) == NULL)
+		return (NULL);
+
+	len = ca_send_imsg(IMSG_CA_ECDSA_SIGN, pkiname, dgst, (size_t)dgst_len,
+	    buf, (size_t)ECDSA_size(eckey), 0);
+	if (len > 0) {
+		der = buf;
+		sig = d2i_ECDSA_SIG(NULL, &der, len);
+	}
+	free(buf);
+
+	return (sig);
+}
+
+static ECDSA_SIG *
+ecdsae_do_sign(const unsigned char *dgst, int dgst_len, const BIGNUM *inv,
+    const BIGNUM *rp, EC_KEY *eckey)
+{
+	log_debug("debug: %s: %s", proc_name(smtpd_process), __func__);
+	if (ECDSA_get_ex_data(eckey, 0) != NULL)
+		return (ecdsae_send_imsg(dgst, dgst_len, eckey));
+	return (ecdsa_default->ecdsa_do_sign(dgst, dgst_len, inv, rp, eckey));
+}
+
+static int
+ecdsae_sign_setup(EC_KEY *eckey, BN_CTX *ctx, BIGNUM **kinv, BIGNUM **r)
+{
+	log_debug("debug: %s: %s", proc_name(smtpd_process), __func__);
+	return (ecdsa_default->ecdsa_sign_setup(eckey, ctx, kinv, r));
+}
+
+static int
+ecdsae_do_verify(const unsigned char *dgst, int dgst_len,
+    const ECDSA_SIG *sig, EC_KEY *eckey)
+{
+	log_debug("debug: %s: %s", proc_name(smtpd_process), __func__);
+	return (ecdsa_default->ecdsa_do_verify(dgst, dgst_len, sig, eckey));
+}
+
+static void
+ecdsae_engine_init(void)
+{
+	ENGINE		*e;
+	const char	*errstr, *name;
+
+	if ((e = ENGINE_get_default_ECDSA()) == NULL) {
+		if ((e = ENGINE_new()) == NULL) {
+			errstr = "ENGINE_new";
+			goto fail;
+		}
+		if (!ENGINE_set_name(e, ecdsae_method.name)) {
+			errstr = "ENGINE_set_name";
+			goto fail;
+		}
+		if ((ecdsa_default = ECDSA_get_default_method()) == NULL) {
+			errstr = "ECDSA_get_default_method";
+			goto fail;
+		}
+	} else if ((ecdsa_default = ENGINE_get_ECDSA(e)) == NULL) {
+		errstr = "ENGINE_get_ECDSA";
+		goto fail;
+	}
+
+	if ((name = ENGINE_get_name(e)) == NULL)
+		name = "unknown ECDSA engine";
+
+	log_debug("debug: %s: using %s", __func__, name);
+
+	ecdsae_method.flags = ecdsa_default->flags;
+	ecdsae_method.app_data = ecdsa_default->app_data;
+
+	if (!ENGINE_set_ECDSA(e, &ecdsae_method)) {
+		errstr = "ENGINE_set_ECDSA";
+		goto fail;
+	}
+	if (!ENGINE_set_default_ECDSA(e)) {
+		errstr = "ENGINE_set_default_ECDSA";
+		goto fail;
+	}
+
+	return;
+
+ fail:
+	ssl_error(errstr);
+	fatalx("%s", errstr);
+}
+#endif
+
+void
+ca_engine_init(void)
+{
+	rsae_engine_init();
+#ifdef HAVE_ECDSA_SET_EX_DATA
+	ecdsae_engine_init();
+#endif
+}
@@ -70,3 +70,33 @@ uncompress_file(FILE *ifile, FILE *ofile)
 {
 	return (env->sc_comp->uncompress_file(ifile, ofile));
 }
+
+void *
+compress_stream_open(int (*sink)(void *, const void *, size_t), void *arg)
+{
+	return (env->sc_comp->stream_open(1, sink, arg));
+}
+
+void *
+uncompress_stream_open(int (*sink)(void *, const void *, size_t), void *arg)
+{
+	return (env->sc_comp->stream_open(0, sink, arg));
+}
+
+int
+compress_stream_write(void *hdl, const void *buf, size_t len)
+{
+	return (env->sc_comp->stream_write(hdl, buf, len));
+}
+
+int
+compress_stream_close(void *hdl)
+{
+	return (env->sc_comp->stream_close(hdl));
+}
+
+int
+uncompress_stream_size(const void *tail, size_t len, size_t *sz)
+{
+	return (env->sc_comp->stream_size(tail, len, sz));
+}
@@ -49,7 +49,21 @@ static size_t	compress_gzip_chunk(void *, size_t, void *, size_t);
 static size_t	uncompress_gzip_chunk(void *, size_t, void *, size_t);
 static int	compress_gzip_file(FILE *, FILE *);
 static int	uncompress_gzip_file(FILE *, FILE *);
-
+static void    *gzip_stream_open(int, int (*)(void *, const void *, size_t),
+    void *);
+static int	gzip_stream_write(void *, const void *, size_t);
+static int	gzip_stream_close(void *);
+static int	gzip_stream_size(const void *, size_t, size_t *);
+
+
+struct gzip_stream {
+	z_stream	  strm;
+	int		  compress;
+	int		  done;
+	int		(*sink)(void *, const void *, size_t);
+	void		 *arg;
+	unsigned char	  obuf[GZIP_BUFFER_SIZE];
+};
 
 struct compress_backend	compress_gzip = {
 	compress_gzip_chunk,
@@ -57,6 +71,11 @@ struct compress_backend	compress_gzip = {
 
 	compress_gzip_file,
 	uncompress_gzip_file,
+
+	gzip_stream_open,
+	gzip_stream_write,
+	gzip_stream_close,
+	gzip_stream_size,
 };
 
 static size_t
@@ -184,3 +203,130 @@ end:
 	gzclose(gzf);
 	return (ret);
 }
+
+
+static void *
+gzip_stream_open(int compress, int (*sink)(void *, const void *, size_t),
+    void *arg)
+{
+	struct gzip_stream     *s;
+	int			r;
+
+	if ((s = calloc(1, sizeof *s)) == NULL)
+		return NULL;
+
+	s->compress = compress;
+	s->sink = sink;
+	s->arg = arg;
+	s->strm.zalloc = Z_NULL;
+	s->strm.zfree = Z_NULL;
+	s->strm.opaque = Z_NULL;
+
+	if (compress)
+		r = deflateInit2(&s->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    (15+16), 8, Z_DEFAULT_STRATEGY);
+	else
+		r = inflateInit2(&s->strm, (15+16));
+	if (r != Z_OK) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/*
+ * Feed a chunk through the stream, handing every block of output
+ * to the sink as soon as zlib produces it.
+ */
+static int
+gzip_stream_write(void *hdl, const void *buf, size_t len)
+{
+	struct gzip_stream     *s = hdl;
+	size_t			n;
+	int			r;
+
+	s->strm.next_in = (unsigned char *)buf;
+	s->strm.avail_in = len;
+
+	while (!s->done && (s->strm.avail_in || s->strm.avail_out == 0)) {
+		s->strm.next_out = s->obuf;
+		s->strm.avail_out = sizeof s->obuf;
+
+		if (s->compress)
+			r = deflate(&s->strm, Z_NO_FLUSH);
+		else
+			r = inflate(&s->strm, Z_NO_FLUSH);
+		if (r == Z_STREAM_END)
+			s->done = 1;
+		else if (r == Z_BUF_ERROR)
+			break;
+		else if (r != Z_OK)
+			return 0;
+
+		n = sizeof s->obuf - s->strm.avail_out;
+		if (n && !s->sink(s->arg, s->obuf, n))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Flush the trailer when compressing, check that the whole gzip
+ * member was seen when uncompressing, and release the stream.
+ */
+static int
+gzip_stream_close(void *hdl)
+{
+	struct gzip_stream     *s = hdl;
+	size_t			n;
+	int			r;
+	int			ret = 0;
+
+	if (!s->compress) {
+		ret = s->done;
+		inflateEnd(&s->strm);
+		free(s);
+		return ret;
+	}
+
+	s->strm.next_in = Z_NULL;
+	s->strm.avail_in = 0;
+	do {
+		s->strm.next_out = s->obuf;
+		s->strm.avail_out = sizeof s->obuf;
+		r = deflate(&s->strm, Z_FINISH);
+		if (r != Z_OK && r != Z_STREAM_END)
+			goto end;
+		n = sizeof s->obuf - s->strm.avail_out;
+		if (n && !s->sink(s->arg, s->obuf, n))
+			goto end;
+	} while (r != Z_STREAM_END);
+
+	ret = 1;
+
+end:
+	deflateEnd(&s->strm);
+	free(s);
+	return ret;
+}
+
+/*
+ * A gzip member ends with the CRC32 and the uncompressed size modulo
+ * 2^32, both little-endian.  The size is only right if the caller knows
+ * the data to be smaller than 4GB.
+ */
+static int
+gzip_stream_size(const void *tail, size_t len, size_t *sz)
+{
+	const uint8_t	*p = tail;
+
+	if (len < 8)
+		return 0;
+	p += len - 4;
+	*sz = (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 |
+	    (size_t)p[3] << 24;
+
+	return 1;
+}
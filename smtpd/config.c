@@ -73,6 +73,8 @@ config_default(void)
 
 	conf->sc_session_max_rcpt = 1000;
 	conf->sc_session_max_mails = 100;
+	conf->sc_smtp_workers = 1;
+	conf->sc_ca_workers = 1;
 
 	conf->sc_mda_max_session = 50;
 	conf->sc_mda_max_user_session = 7;
@@ -95,6 +97,8 @@ config_default(void)
 	conf->sc_processors_dict = calloc(1, sizeof(*conf->sc_processors_dict));
 	conf->sc_dispatcher_bounce = calloc(1, sizeof(*conf->sc_dispatcher_bounce));
 	conf->sc_filters_dict = calloc(1, sizeof(*conf->sc_filters_dict));
+	conf->sc_scheduler_weights = calloc(1,
+	    sizeof(*conf->sc_scheduler_weights));
 	limits = calloc(1, sizeof(*limits));
 
 	if (conf->sc_tables_dict == NULL	||
@@ -109,6 +113,7 @@ config_default(void)
 	    conf->sc_processors_dict == NULL	||
 	    conf->sc_dispatcher_bounce == NULL	||
 	    conf->sc_filters_dict == NULL	||
+	    conf->sc_scheduler_weights == NULL	||
 	    limits == NULL)
 		goto error;
 
@@ -120,6 +125,7 @@ config_default(void)
 	dict_init(conf->sc_tables_dict);
 	dict_init(conf->sc_limits_dict);
 	dict_init(conf->sc_processors_dict);
+	dict_init(conf->sc_scheduler_weights);
 
 	limit_mta_set_defaults(limits);
 
@@ -161,6 +167,7 @@ error:
 	free(conf->sc_processors_dict);
 	free(conf->sc_dispatcher_bounce);
 	free(conf->sc_filters_dict);
+	free(conf->sc_scheduler_weights);
 	free(limits);
 	free(conf);
 	return NULL;
@@ -319,10 +326,23 @@ void
 config_peer(enum smtp_proc_type proc)
 {
 	struct mproc	*p;
+	size_t		 i;
 
 	if (proc == smtpd_process)
 		fatal("config_peers: cannot peer with oneself");
 
+	if (proc == PROC_PONY) {
+		for (i = 0; i < pony_nworkers; i++)
+			mproc_enable(p_ponies[i]);
+		return;
+	}
+
+	if (proc == PROC_CA) {
+		for (i = 0; i < ca_nworkers; i++)
+			mproc_enable(p_cas[i]);
+		return;
+	}
+
 	if (proc == PROC_CONTROL)
 		p = p_control;
 	else if (proc == PROC_LKA)
@@ -333,10 +353,6 @@ config_peer(enum smtp_proc_type proc)
 		p = p_queue;
 	else if (proc == PROC_SCHEDULER)
 		p = p_scheduler;
-	else if (proc == PROC_PONY)
-		p = p_pony;
-	else if (proc == PROC_CA)
-		p = p_ca;
 	else
 		fatalx("bad peer");
 
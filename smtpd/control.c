@@ -431,7 +431,7 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 	struct stat_kv		*kvp;
 	char			*key;
 	struct stat_value	 val;
-	size_t			 len;
+	size_t			 len, i;
 	uint64_t		 evpid;
 	uint32_t		 msgid;
 
@@ -600,7 +600,9 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp paused");
 		env->sc_flags |= SMTPD_SMTP_PAUSED;
-		m_compose(p_pony, IMSG_CTL_PAUSE_SMTP, 0, 0, -1, NULL, 0);
+		for (i = 0; i < pony_nworkers; i++)
+			m_compose(p_ponies[i], IMSG_CTL_PAUSE_SMTP, 0, 0, -1,
+			    NULL, 0);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -650,7 +652,8 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp resumed");
 		env->sc_flags &= ~SMTPD_SMTP_PAUSED;
-		m_forward(p_pony, imsg);
+		for (i = 0; i < pony_nworkers; i++)
+			m_forward(p_ponies[i], imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -779,21 +782,27 @@ invalid:
 static void
 control_broadcast_verbose(int msg, int v)
 {
+	size_t	i;
+
 	m_create(p_lka, msg, 0, 0, -1);
 	m_add_int(p_lka, v);
 	m_close(p_lka);
 
-	m_create(p_pony, msg, 0, 0, -1);
-	m_add_int(p_pony, v);
-	m_close(p_pony);
+	for (i = 0; i < pony_nworkers; i++) {
+		m_create(p_ponies[i], msg, 0, 0, -1);
+		m_add_int(p_ponies[i], v);
+		m_close(p_ponies[i]);
+	}
 
 	m_create(p_queue, msg, 0, 0, -1);
 	m_add_int(p_queue, v);
 	m_close(p_queue);
 
-	m_create(p_ca, msg, 0, 0, -1);
-	m_add_int(p_ca, v);
-	m_close(p_ca);
+	for (i = 0; i < ca_nworkers; i++) {
+		m_create(p_cas[i], msg, 0, 0, -1);
+		m_add_int(p_cas[i], v);
+		m_close(p_cas[i]);
+	}
 
 	m_create(p_scheduler, msg, 0, 0, -1);
 	m_add_int(p_scheduler, v);
@@ -23,6 +23,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <openssl/evp.h>
 
@@ -42,6 +43,32 @@ int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
+void   *crypto_stream_open(int, int (*)(void *, const void *, size_t), void *);
+int	crypto_stream_write(void *, const void *, size_t);
+int	crypto_stream_close(void *);
+off_t	crypto_decrypted_size(off_t);
+int	crypto_decrypt_at(int, off_t, void *, size_t);
+
+/*
+ * Incremental variant of crypto_{en,de}crypt_file(), producing and
+ * consuming the same on-disk format but pushing output to a sink so
+ * it can be chained with other stream stages.
+ */
+struct crypto_stream {
+	EVP_CIPHER_CTX	 *ctx;
+	int		  encrypt;
+	int		(*sink)(void *, const void *, size_t);
+	void		 *arg;
+	off_t		  len;
+
+	/* decryption: version + IV, then the trailing bytes held back */
+	uint8_t		  hdr[1 + IV_SIZE];
+	size_t		  hdrlen;
+	uint8_t		  tag[GCM_TAG_SIZE];
+	size_t		  taglen;
+
+	uint8_t		  obuf[CRYPTO_BUFFER_SIZE];
+};
 
 static struct crypto_ctx {
 	unsigned char  		key[KEY_SIZE];
@@ -313,6 +340,235 @@ end:
 	return ret;
 }
 
+void *
+crypto_stream_open(int encrypt, int (*sink)(void *, const void *, size_t),
+    void *arg)
+{
+	struct crypto_stream	*s;
+	uint8_t			 iv[IV_SIZE];
+	uint8_t			 version = API_VERSION;
+
+	if ((s = calloc(1, sizeof *s)) == NULL)
+		return NULL;
+	if ((s->ctx = EVP_CIPHER_CTX_new()) == NULL) {
+		free(s);
+		return NULL;
+	}
+	s->encrypt = encrypt;
+	s->sink = sink;
+	s->arg = arg;
+
+	if (!encrypt)
+		return s;
+
+	/* prepend version byte and IV */
+	memset(iv, 0, sizeof iv);
+	arc4random_buf(iv, sizeof iv);
+	if (!sink(arg, &version, sizeof version) ||
+	    !sink(arg, iv, sizeof iv) ||
+	    !EVP_EncryptInit_ex(s->ctx, EVP_aes_256_gcm(), NULL, cp.key, iv)) {
+		EVP_CIPHER_CTX_free(s->ctx);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+static int
+crypto_stream_update(struct crypto_stream *s, const uint8_t *buf, size_t len)
+{
+	size_t	n;
+	int	olen;
+
+	/* XXX - Do NOT encrypt files bigger than 64GB */
+	s->len += len;
+	if (s->len >= 0x1000000000LL)
+		return 0;
+
+	while (len) {
+		n = len > CRYPTO_BUFFER_SIZE ? CRYPTO_BUFFER_SIZE : len;
+		if (s->encrypt) {
+			if (!EVP_EncryptUpdate(s->ctx, s->obuf, &olen, buf, n))
+				return 0;
+		}
+		else {
+			if (!EVP_DecryptUpdate(s->ctx, s->obuf, &olen, buf, n))
+				return 0;
+		}
+		if (olen && !s->sink(s->arg, s->obuf, olen))
+			return 0;
+		buf += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+int
+crypto_stream_write(void *hdl, const void *data, size_t len)
+{
+	struct crypto_stream	*s = hdl;
+	const uint8_t		*buf = data;
+	size_t			 n;
+
+	if (s->encrypt)
+		return crypto_stream_update(s, buf, len);
+
+	/* collect version and IV before anything can be decrypted */
+	if (s->hdrlen < sizeof s->hdr) {
+		n = sizeof s->hdr - s->hdrlen;
+		if (n > len)
+			n = len;
+		memcpy(s->hdr + s->hdrlen, buf, n);
+		s->hdrlen += n;
+		buf += n;
+		len -= n;
+		if (s->hdrlen < sizeof s->hdr)
+			return 1;
+		if (s->hdr[0] != API_VERSION)
+			return 0;
+		if (!EVP_DecryptInit_ex(s->ctx, EVP_aes_256_gcm(), NULL,
+		    cp.key, s->hdr + 1))
+			return 0;
+	}
+
+	/* the last GCM_TAG_SIZE bytes of the input are the tag, hold them */
+	if (s->taglen + len <= sizeof s->tag) {
+		memcpy(s->tag + s->taglen, buf, len);
+		s->taglen += len;
+		return 1;
+	}
+
+	n = s->taglen + len - sizeof s->tag;
+	if (n <= s->taglen) {
+		if (!crypto_stream_update(s, s->tag, n))
+			return 0;
+		memmove(s->tag, s->tag + n, s->taglen - n);
+		memcpy(s->tag + s->taglen - n, buf, len);
+	}
+	else {
+		if (!crypto_stream_update(s, s->tag, s->taglen))
+			return 0;
+		if (!crypto_stream_update(s, buf, n - s->taglen))
+			return 0;
+		memcpy(s->tag, buf + len - sizeof s->tag, sizeof s->tag);
+	}
+	s->taglen = sizeof s->tag;
+
+	return 1;
+}
+
+/*
+ * Finalize the stream: append the tag when encrypting, perform the
+ * authentication check when decrypting. The stream is always freed.
+ */
+int
+crypto_stream_close(void *hdl)
+{
+	struct crypto_stream	*s = hdl;
+	int			 len;
+	int			 ret = 0;
+
+	if (s->encrypt) {
+		if (!EVP_EncryptFinal_ex(s->ctx, s->obuf, &len))
+			goto end;
+		if (len && !s->sink(s->arg, s->obuf, len))
+			goto end;
+		EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_GCM_GET_TAG,
+		    sizeof s->tag, s->tag);
+		if (!s->sink(s->arg, s->tag, sizeof s->tag))
+			goto end;
+	}
+	else {
+		/* input too small to be an encrypted file */
+		if (s->hdrlen != sizeof s->hdr || s->taglen != sizeof s->tag)
+			goto end;
+		EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_GCM_SET_TAG,
+		    sizeof s->tag, s->tag);
+		if (!EVP_DecryptFinal_ex(s->ctx, s->obuf, &len))
+			goto end;
+		if (len && !s->sink(s->arg, s->obuf, len))
+			goto end;
+	}
+	ret = 1;
+
+end:
+	EVP_CIPHER_CTX_free(s->ctx);
+	explicit_bzero(s, sizeof *s);
+	free(s);
+	return ret;
+}
+
+/*
+ * Size of the plaintext of an encrypted file of the given size, or -1
+ * if it is too small to be one.
+ */
+off_t
+crypto_decrypted_size(off_t len)
+{
+	len -= 1 + IV_SIZE + GCM_TAG_SIZE;
+	if (len < 0)
+		return -1;
+	return len;
+}
+
+/*
+ * Decrypt up to one block of plaintext at offset off of an encrypted
+ * file, without authenticating it.  GCM encrypts in CTR mode and, with
+ * a 96-bit IV, the counter of block i is the IV followed by i + 2, so
+ * any block can be decrypted on its own.
+ */
+int
+crypto_decrypt_at(int fd, off_t off, void *buf, size_t len)
+{
+	EVP_CIPHER_CTX	*ctx;
+	uint8_t		 hdr[1 + IV_SIZE];
+	uint8_t		 ctr[16];
+	uint8_t		 ibuf[32];
+	uint8_t		 obuf[32];
+	uint32_t	 block;
+	size_t		 skip;
+	int		 olen;
+	int		 ret = 0;
+
+	if (len > 16 || off < 0)
+		return 0;
+	block = off / 16;
+	skip = off % 16;
+
+	if (pread(fd, hdr, sizeof hdr, 0) != sizeof hdr)
+		return 0;
+	if (hdr[0] != API_VERSION)
+		return 0;
+	if (pread(fd, ibuf, skip + len, sizeof hdr + (off - skip)) !=
+	    (ssize_t)(skip + len))
+		return 0;
+
+	memcpy(ctr, hdr + 1, IV_SIZE);
+	block += 2;
+	ctr[12] = block >> 24;
+	ctr[13] = block >> 16;
+	ctr[14] = block >> 8;
+	ctr[15] = block;
+
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+		return 0;
+	if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, cp.key, ctr))
+		goto end;
+	if (!EVP_DecryptUpdate(ctx, obuf, &olen, ibuf, skip + len))
+		goto end;
+	if ((size_t)olen != skip + len)
+		goto end;
+	memcpy(buf, obuf + skip, len);
+	ret = 1;
+
+end:
+	EVP_CIPHER_CTX_free(ctx);
+	explicit_bzero(obuf, sizeof obuf);
+	return ret;
+}
+
 #if 0
 int
 main(int argc, char *argv[])
@@ -49,6 +49,22 @@
 static int envelope_ascii_load(struct envelope *, struct dict *);
 static void envelope_ascii_dump(const struct envelope *, char **, size_t *,
     const char *);
+static int envelope_binary_load(struct envelope *, const char *, size_t);
+
+/*
+ * Binary envelopes start with a NUL byte, which never begins an ASCII
+ * envelope, followed by a tag and the version of the binary layout.
+ * Integers are stored in network byte order and strings are prefixed
+ * with their length as a 16-bit integer.
+ */
+#define	ENVELOPE_BINARY_TAG	'E'
+#define	ENVELOPE_BINARY_VERSION	1
+#define	ENVELOPE_BINARY_HDRLEN	4
+
+/* address families on disk, AF_* values differ between systems */
+#define	ENVELOPE_BINARY_LOCAL	0
+#define	ENVELOPE_BINARY_INET	4
+#define	ENVELOPE_BINARY_INET6	6
 
 void
 envelope_set_errormsg(struct envelope *e, char *fmt, ...)
@@ -135,6 +151,9 @@ envelope_load_buffer(struct envelope *ep, const char *ibuf, size_t buflen)
 	long long	 version;
 	int		 ret = 0;
 
+	if (envelope_is_binary(ibuf, buflen))
+		return (envelope_binary_load(ep, ibuf, buflen));
+
 	dict_init(&d);
 	if (!envelope_buffer_to_dict(&d, ibuf, buflen)) {
 		log_debug("debug: cannot parse envelope to dict");
@@ -220,6 +239,375 @@ envelope_dump_buffer(const struct envelope *ep, char *dest, size_t len)
 	return (dest - p);
 }
 
+int
+envelope_is_binary(const char *buf, size_t len)
+{
+	return (len >= ENVELOPE_BINARY_HDRLEN &&
+	    buf[0] == '\0' && buf[1] == ENVELOPE_BINARY_TAG);
+}
+
+static void
+binary_dump(char **dest, size_t *len, const void *src, size_t n)
+{
+	if (*dest == NULL)
+		return;
+	if (n > *len) {
+		*dest = NULL;
+		return;
+	}
+	memcpy(*dest, src, n);
+	*dest += n;
+	*len -= n;
+}
+
+static void
+binary_dump_uint8(char **dest, size_t *len, uint8_t v)
+{
+	binary_dump(dest, len, &v, sizeof v);
+}
+
+static void
+binary_dump_uint16(char **dest, size_t *len, uint16_t v)
+{
+	uint8_t	b[2];
+
+	b[0] = v >> 8;
+	b[1] = v;
+	binary_dump(dest, len, b, sizeof b);
+}
+
+static void
+binary_dump_uint32(char **dest, size_t *len, uint32_t v)
+{
+	uint8_t	b[4];
+	int	i;
+
+	for (i = 3; i >= 0; i--, v >>= 8)
+		b[i] = v;
+	binary_dump(dest, len, b, sizeof b);
+}
+
+static void
+binary_dump_time(char **dest, size_t *len, time_t t)
+{
+	uint64_t	v = (uint64_t)(int64_t)t;
+	uint8_t		b[8];
+	int		i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		b[i] = v;
+	binary_dump(dest, len, b, sizeof b);
+}
+
+static void
+binary_dump_string(char **dest, size_t *len, const char *str)
+{
+	size_t	n;
+
+	n = strlen(str);
+	if (n > UINT16_MAX) {
+		*dest = NULL;
+		return;
+	}
+	binary_dump_uint16(dest, len, n);
+	binary_dump(dest, len, str, n);
+}
+
+static void
+binary_dump_mailaddr(char **dest, size_t *len, const struct mailaddr *addr)
+{
+	binary_dump_string(dest, len, addr->user);
+	binary_dump_string(dest, len, addr->domain);
+}
+
+static void
+binary_dump_sockaddr(char **dest, size_t *len,
+    const struct sockaddr_storage *ss)
+{
+	switch (ss->ss_family) {
+	case AF_INET:
+		binary_dump_uint8(dest, len, ENVELOPE_BINARY_INET);
+		binary_dump(dest, len,
+		    &((const struct sockaddr_in *)ss)->sin_addr,
+		    sizeof(struct in_addr));
+		break;
+	case AF_INET6:
+		binary_dump_uint8(dest, len, ENVELOPE_BINARY_INET6);
+		binary_dump(dest, len,
+		    &((const struct sockaddr_in6 *)ss)->sin6_addr,
+		    sizeof(struct in6_addr));
+		break;
+	default:
+		binary_dump_uint8(dest, len, ENVELOPE_BINARY_LOCAL);
+		break;
+	}
+}
+
+/*
+ * Fields are dumped under the same conditions as in the ASCII format,
+ * so that both formats load back to the same envelope.
+ */
+int
+envelope_dump_binary(const struct envelope *ep, char *dest, size_t len)
+{
+	char	*p = dest;
+	int	 delayed;
+
+	switch (ep->type) {
+	case D_MDA:
+	case D_MTA:
+	case D_BOUNCE:
+		break;
+	default:
+		return (0);
+	}
+	delayed = ep->agent.bounce.type == B_DELAYED;
+
+	binary_dump_uint8(&dest, &len, '\0');
+	binary_dump_uint8(&dest, &len, ENVELOPE_BINARY_TAG);
+	binary_dump_uint16(&dest, &len, ENVELOPE_BINARY_VERSION);
+	binary_dump_uint32(&dest, &len, SMTPD_ENVELOPE_VERSION);
+
+	binary_dump_uint8(&dest, &len, ep->type);
+	binary_dump_uint32(&dest, &len,
+	    ep->flags & (EF_AUTHENTICATED | EF_BOUNCE | EF_INTERNAL));
+	binary_dump_uint16(&dest, &len, ep->retry);
+	binary_dump_time(&dest, &len, ep->creation);
+	binary_dump_time(&dest, &len, ep->ttl);
+	binary_dump_time(&dest, &len, ep->lasttry);
+	binary_dump_time(&dest, &len, ep->lastbounce);
+	binary_dump_uint8(&dest, &len, ep->dsn_notify);
+	binary_dump_uint8(&dest, &len, ep->dsn_ret);
+	binary_dump_uint8(&dest, &len, ep->esc_class);
+	binary_dump_uint8(&dest, &len, ep->esc_class ? ep->esc_code : 0);
+	binary_dump_sockaddr(&dest, &len, &ep->ss);
+
+	binary_dump_string(&dest, &len, ep->dispatcher);
+	binary_dump_string(&dest, &len, ep->tag);
+	binary_dump_string(&dest, &len, ep->smtpname);
+	binary_dump_string(&dest, &len, ep->helo);
+	binary_dump_string(&dest, &len, ep->hostname);
+	binary_dump_string(&dest, &len, ep->errorline);
+	binary_dump_mailaddr(&dest, &len, &ep->sender);
+	binary_dump_mailaddr(&dest, &len, &ep->rcpt);
+	binary_dump_mailaddr(&dest, &len, &ep->dest);
+	if (ep->dsn_orcpt.user[0] && ep->dsn_orcpt.domain[0])
+		binary_dump_mailaddr(&dest, &len, &ep->dsn_orcpt);
+	else {
+		binary_dump_string(&dest, &len, "");
+		binary_dump_string(&dest, &len, "");
+	}
+	binary_dump_string(&dest, &len, ep->dsn_envid);
+
+	switch (ep->type) {
+	case D_MDA:
+		binary_dump_string(&dest, &len, ep->mda_exec);
+		binary_dump_string(&dest, &len, ep->mda_subaddress);
+		binary_dump_string(&dest, &len, ep->mda_user);
+		break;
+	case D_MTA:
+		break;
+	case D_BOUNCE:
+		binary_dump_uint8(&dest, &len, ep->agent.bounce.type);
+		binary_dump_time(&dest, &len,
+		    delayed ? ep->agent.bounce.ttl : 0);
+		binary_dump_time(&dest, &len,
+		    delayed ? ep->agent.bounce.delay : 0);
+		break;
+	}
+
+	if (dest == NULL)
+		return (0);
+
+	return (dest - p);
+}
+
+static void
+binary_load(const char **src, size_t *len, void *dest, size_t n)
+{
+	if (*src == NULL)
+		return;
+	if (n > *len) {
+		*src = NULL;
+		return;
+	}
+	memcpy(dest, *src, n);
+	*src += n;
+	*len -= n;
+}
+
+static uint8_t
+binary_load_uint8(const char **src, size_t *len)
+{
+	uint8_t	v = 0;
+
+	binary_load(src, len, &v, sizeof v);
+	return (v);
+}
+
+static uint16_t
+binary_load_uint16(const char **src, size_t *len)
+{
+	uint8_t	b[2] = { 0, 0 };
+
+	binary_load(src, len, b, sizeof b);
+	return ((b[0] << 8) | b[1]);
+}
+
+static uint32_t
+binary_load_uint32(const char **src, size_t *len)
+{
+	uint8_t		b[4] = { 0, 0, 0, 0 };
+	uint32_t	v = 0;
+	int		i;
+
+	binary_load(src, len, b, sizeof b);
+	for (i = 0; i < 4; i++)
+		v = (v << 8) | b[i];
+	return (v);
+}
+
+static time_t
+binary_load_time(const char **src, size_t *len)
+{
+	uint8_t		b[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	uint64_t	v = 0;
+	int		i;
+
+	binary_load(src, len, b, sizeof b);
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | b[i];
+	return ((time_t)(int64_t)v);
+}
+
+static void
+binary_load_string(const char **src, size_t *len, char *dest, size_t size)
+{
+	size_t	n;
+
+	n = binary_load_uint16(src, len);
+	if (*src == NULL)
+		return;
+	if (n >= size || memchr(*src, '\0', n < *len ? n : *len)) {
+		*src = NULL;
+		return;
+	}
+	binary_load(src, len, dest, n);
+	dest[n] = '\0';
+}
+
+static void
+binary_load_mailaddr(const char **src, size_t *len, struct mailaddr *addr)
+{
+	binary_load_string(src, len, addr->user, sizeof addr->user);
+	binary_load_string(src, len, addr->domain, sizeof addr->domain);
+}
+
+static void
+binary_load_sockaddr(const char **src, size_t *len,
+    struct sockaddr_storage *ss)
+{
+	struct sockaddr_in6	*sin6;
+	struct sockaddr_in	*sin;
+
+	switch (binary_load_uint8(src, len)) {
+	case ENVELOPE_BINARY_INET:
+		sin = (struct sockaddr_in *)ss;
+		binary_load(src, len, &sin->sin_addr, sizeof sin->sin_addr);
+		sin->sin_family = AF_INET;
+#ifdef HAVE_STRUCT_SOCKADDR_STORAGE_SS_LEN
+		ss->ss_len = sizeof(struct sockaddr_in);
+#endif
+		break;
+	case ENVELOPE_BINARY_INET6:
+		sin6 = (struct sockaddr_in6 *)ss;
+		binary_load(src, len, &sin6->sin6_addr, sizeof sin6->sin6_addr);
+		sin6->sin6_family = AF_INET6;
+#ifdef HAVE_STRUCT_SOCKADDR_STORAGE_SS_LEN
+		ss->ss_len = sizeof(struct sockaddr_in6);
+#endif
+		break;
+	default:
+		ss->ss_family = AF_LOCAL;
+		break;
+	}
+}
+
+static int
+envelope_binary_load(struct envelope *ep, const char *src, size_t len)
+{
+	uint32_t	version;
+
+	src += 2;
+	len -= 2;
+	if (binary_load_uint16(&src, &len) != ENVELOPE_BINARY_VERSION) {
+		log_debug("debug: bad binary envelope layout");
+		return (0);
+	}
+	version = binary_load_uint32(&src, &len);
+	if (src == NULL || version != SMTPD_ENVELOPE_VERSION) {
+		log_debug("debug: bad envelope version %"PRIu32, version);
+		return (0);
+	}
+
+	memset(ep, 0, sizeof *ep);
+	ep->type = binary_load_uint8(&src, &len);
+	ep->flags = binary_load_uint32(&src, &len);
+	ep->retry = binary_load_uint16(&src, &len);
+	ep->creation = binary_load_time(&src, &len);
+	ep->ttl = binary_load_time(&src, &len);
+	ep->lasttry = binary_load_time(&src, &len);
+	ep->lastbounce = binary_load_time(&src, &len);
+	ep->dsn_notify = binary_load_uint8(&src, &len);
+	ep->dsn_ret = binary_load_uint8(&src, &len);
+	ep->esc_class = binary_load_uint8(&src, &len);
+	ep->esc_code = binary_load_uint8(&src, &len);
+	binary_load_sockaddr(&src, &len, &ep->ss);
+
+	binary_load_string(&src, &len, ep->dispatcher, sizeof ep->dispatcher);
+	binary_load_string(&src, &len, ep->tag, sizeof ep->tag);
+	binary_load_string(&src, &len, ep->smtpname, sizeof ep->smtpname);
+	binary_load_string(&src, &len, ep->helo, sizeof ep->helo);
+	binary_load_string(&src, &len, ep->hostname, sizeof ep->hostname);
+	binary_load_string(&src, &len, ep->errorline, sizeof ep->errorline);
+	binary_load_mailaddr(&src, &len, &ep->sender);
+	binary_load_mailaddr(&src, &len, &ep->rcpt);
+	binary_load_mailaddr(&src, &len, &ep->dest);
+	binary_load_mailaddr(&src, &len, &ep->dsn_orcpt);
+	binary_load_string(&src, &len, ep->dsn_envid, sizeof ep->dsn_envid);
+
+	switch (ep->type) {
+	case D_MDA:
+		binary_load_string(&src, &len, ep->mda_exec,
+		    sizeof ep->mda_exec);
+		binary_load_string(&src, &len, ep->mda_subaddress,
+		    sizeof ep->mda_subaddress);
+		binary_load_string(&src, &len, ep->mda_user,
+		    sizeof ep->mda_user);
+		break;
+	case D_MTA:
+		break;
+	case D_BOUNCE:
+		ep->agent.bounce.type = binary_load_uint8(&src, &len);
+		ep->agent.bounce.ttl = binary_load_time(&src, &len);
+		ep->agent.bounce.delay = binary_load_time(&src, &len);
+		if (ep->agent.bounce.type > B_DELIVERED)
+			src = NULL;
+		break;
+	default:
+		src = NULL;
+		break;
+	}
+
+	if (src == NULL || len != 0) {
+		log_debug("debug: cannot parse binary envelope");
+		return (0);
+	}
+
+	ep->version = SMTPD_ENVELOPE_VERSION;
+	return (1);
+}
+
 static int
 ascii_load_uint8(uint8_t *dest, char *buf)
 {
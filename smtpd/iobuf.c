@@ -150,40 +150,48 @@ void
 iobuf_drop(struct iobuf *io, size_t n)
 {
 	if (n >= iobuf_len(io)) {
-		io->rpos = io->wpos = 0;
+		io->rpos = io->wpos = io->scanned = 0;
 		return;
 	}
 
 	io->rpos += n;
+	io->scanned = (io->scanned > n) ? io->scanned - n : 0;
 }
 
+/*
+ * The part of the buffer already searched for a newline is remembered,
+ * so that a long line arriving in several reads is not scanned again
+ * from the start each time.
+ */
 char *
 iobuf_getline(struct iobuf *iobuf, size_t *rlen)
 {
-	char	*buf;
+	char	*buf, *lf;
 	size_t	 len, i;
 
 	buf = iobuf_data(iobuf);
 	len = iobuf_len(iobuf);
 
-	for (i = 0; i + 1 <= len; i++)
-		if (buf[i] == '\n') {
-			/* Note: the returned address points into the iobuf
-			 * buffer.  We NUL-end it for convenience, and discard
-			 * the data from the iobuf, so that the caller doesn't
-			 * have to do it.  The data remains "valid" as long
-			 * as the iobuf does not overwrite it, that is until
-			 * the next call to iobuf_normalize() or iobuf_extend().
-			 */
-			iobuf_drop(iobuf, i + 1);
-			len = (i && buf[i - 1] == '\r') ? i - 1 : i;
-			buf[len] = '\0';
-			if (rlen)
-				*rlen = len;
-			return (buf);
-		}
+	lf = memchr(buf + iobuf->scanned, '\n', len - iobuf->scanned);
+	if (lf == NULL) {
+		iobuf->scanned = len;
+		return (NULL);
+	}
 
-	return (NULL);
+	/* Note: the returned address points into the iobuf
+	 * buffer.  We NUL-end it for convenience, and discard
+	 * the data from the iobuf, so that the caller doesn't
+	 * have to do it.  The data remains "valid" as long
+	 * as the iobuf does not overwrite it, that is until
+	 * the next call to iobuf_normalize() or iobuf_extend().
+	 */
+	i = lf - buf;
+	iobuf_drop(iobuf, i + 1);
+	len = (i && buf[i - 1] == '\r') ? i - 1 : i;
+	buf[len] = '\0';
+	if (rlen)
+		*rlen = len;
+	return (buf);
 }
 
 void
@@ -193,7 +201,7 @@ iobuf_normalize(struct iobuf *io)
 		return;
 
 	if (io->rpos == io->wpos) {
-		io->rpos = io->wpos = 0;
+		io->rpos = io->wpos = io->scanned = 0;
 		return;
 	}
 
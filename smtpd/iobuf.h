@@ -29,6 +29,7 @@ struct iobuf {
 	size_t		 size;
 	size_t		 wpos;
 	size_t		 rpos;
+	size_t		 scanned;	/* bytes from rpos without a newline */
 
 	size_t		 queued;
 	struct ioqbuf	*outq;
@@ -445,6 +445,22 @@ io_writev(struct io *io, const struct iovec *iov, int iovcount)
 	return r;
 }
 
+/*
+ * Queue len bytes of output and return where to store them.  The caller
+ * must fill the whole area before returning to the event loop.
+ */
+void *
+io_reserve(struct io *io, size_t len)
+{
+	void	*r;
+
+	r = iobuf_reserve(&io->iobuf, len);
+
+	io_reload(io);
+
+	return r;
+}
+
 int
 io_print(struct io *io, const char *s)
 {
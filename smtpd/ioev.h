@@ -57,6 +57,7 @@ int io_paused(struct io *, int);
 /* Buffered output functions */
 int io_write(struct io *, const void *, size_t);
 int io_writev(struct io *, const struct iovec *, int);
+void* io_reserve(struct io *, size_t);
 int io_print(struct io *, const char *);
 int io_printf(struct io *, const char *, ...);
 int io_vprintf(struct io *, const char *, va_list);
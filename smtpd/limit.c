@@ -58,6 +58,7 @@ limit_mta_set_defaults(struct mta_limits *limits)
 	limits->max_mail_per_session = 100;
 	limits->sessdelay_transaction = 0;
 	limits->sessdelay_keepalive = 10;
+	limits->maxidle_per_relay = 5;
 
 	limits->max_failures_per_session = 25;
 
@@ -106,6 +107,8 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 		limits->sessdelay_transaction = value;
 	else if (!strcmp(key, "session-keepalive"))
 		limits->sessdelay_keepalive = value;
+	else if (!strcmp(key, "max-idle-per-relay"))
+		limits->maxidle_per_relay = value;
 
 	else if (!strcmp(key, "max-failures-per-session"))
 		limits->max_failures_per_session = value;
@@ -326,8 +326,11 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 		return;
 
 	case IMSG_LKA_AUTHENTICATE:
+		if (imsg->hdr.len - IMSG_HEADER_SIZE < sizeof(reqid))
+			fatalx("lka_imsg: bad authenticate reply");
+		memmove(&reqid, imsg->data, sizeof(reqid));
 		imsg->hdr.type = IMSG_SMTP_AUTHENTICATE;
-		m_forward(p_pony, imsg);
+		m_forward(pony_peer(reqid), imsg);
 		return;
 
 	case IMSG_CTL_VERBOSE:
@@ -624,6 +627,7 @@ lka(void)
 {
 	struct passwd	*pw;
 	struct event	 ev_sigchld;
+	size_t		 i;
 
 	purge_config(PURGE_LISTENERS);
 
@@ -653,7 +657,8 @@ lka(void)
 	config_peer(PROC_PONY);
 
 	/* Ignore them until we get our config */
-	mproc_disable(p_pony);
+	for (i = 0; i < pony_nworkers; i++)
+		mproc_disable(p_ponies[i]);
 
 	lka_report_init();
 	lka_filter_init();
@@ -673,12 +678,14 @@ proc_timeout(int fd, short event, void *p)
 {
 	struct event	*ev = p;
 	struct timeval	 tv;
+	size_t		 i;
 
 	if (!lka_proc_ready())
 		goto reset;
 
 	lka_filter_ready();
-	mproc_enable(p_pony);
+	for (i = 0; i < pony_nworkers; i++)
+		mproc_enable(p_ponies[i]);
 	return;
 
 reset:
@@ -347,6 +347,7 @@ void
 lka_filter_data_begin(uint64_t reqid)
 {
 	struct filter_session  *fs;
+	struct mproc	       *p;
 	int	sp[2];
 	int	fd = -1;
 
@@ -362,10 +363,11 @@ lka_filter_data_begin(uint64_t reqid)
 	io_set_callback(fs->io, filter_session_io, fs);
 
 end:
-	m_create(p_pony, IMSG_FILTER_SMTP_DATA_BEGIN, 0, 0, fd);
-	m_add_id(p_pony, reqid);
-	m_add_int(p_pony, fd != -1 ? 1 : 0);
-	m_close(p_pony);
+	p = pony_peer(reqid);
+	m_create(p, IMSG_FILTER_SMTP_DATA_BEGIN, 0, 0, fd);
+	m_add_id(p, reqid);
+	m_add_int(p, fd != -1 ? 1 : 0);
+	m_close(p);
 	log_trace(TRACE_FILTERS, "%016"PRIx64" filters data-begin fd=%d", reqid, fd);
 }
 
@@ -761,40 +763,52 @@ filter_data_query(struct filter *filter, uint64_t token, uint64_t reqid, const c
 static void
 filter_result_proceed(uint64_t reqid)
 {
-	m_create(p_pony, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_pony, reqid);
-	m_add_int(p_pony, FILTER_PROCEED);
-	m_close(p_pony);
+	struct mproc	*p;
+
+	p = pony_peer(reqid);
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_PROCEED);
+	m_close(p);
 }
 
 static void
 filter_result_rewrite(uint64_t reqid, const char *param)
 {
-	m_create(p_pony, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_pony, reqid);
-	m_add_int(p_pony, FILTER_REWRITE);
-	m_add_string(p_pony, param);
-	m_close(p_pony);
+	struct mproc	*p;
+
+	p = pony_peer(reqid);
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_REWRITE);
+	m_add_string(p, param);
+	m_close(p);
 }
 
 static void
 filter_result_reject(uint64_t reqid, const char *message)
 {
-	m_create(p_pony, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_pony, reqid);
-	m_add_int(p_pony, FILTER_REJECT);
-	m_add_string(p_pony, message);
-	m_close(p_pony);
+	struct mproc	*p;
+
+	p = pony_peer(reqid);
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_REJECT);
+	m_add_string(p, message);
+	m_close(p);
 }
 
 static void
 filter_result_disconnect(uint64_t reqid, const char *message)
 {
-	m_create(p_pony, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
-	m_add_id(p_pony, reqid);
-	m_add_int(p_pony, FILTER_DISCONNECT);
-	m_add_string(p_pony, message);
-	m_close(p_pony);
+	struct mproc	*p;
+
+	p = pony_peer(reqid);
+	m_create(p, IMSG_FILTER_SMTP_PROTOCOL, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, FILTER_DISCONNECT);
+	m_add_string(p, message);
+	m_close(p);
 }
 
 
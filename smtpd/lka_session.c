@@ -194,6 +194,7 @@ lka_resume(struct lka_session *lks)
 {
 	struct envelope		*ep;
 	struct expandnode	*xn;
+	struct mproc		*p;
 
 	if (lks->error)
 		goto error;
@@ -217,20 +218,21 @@ lka_resume(struct lka_session *lks)
 	}
     error:
 	if (lks->error) {
-		m_create(p_pony, IMSG_SMTP_EXPAND_RCPT, 0, 0, -1);
-		m_add_id(p_pony, lks->id);
-		m_add_int(p_pony, lks->error);
+		p = pony_peer(lks->id);
+		m_create(p, IMSG_SMTP_EXPAND_RCPT, 0, 0, -1);
+		m_add_id(p, lks->id);
+		m_add_int(p, lks->error);
 
 		if (lks->errormsg)
-			m_add_string(p_pony, lks->errormsg);
+			m_add_string(p, lks->errormsg);
 		else {
 			if (lks->error == LKA_PERMFAIL)
-				m_add_string(p_pony, "550 Invalid recipient");
+				m_add_string(p, "550 Invalid recipient");
 			else if (lks->error == LKA_TEMPFAIL)
-				m_add_string(p_pony, "451 Temporary failure");
+				m_add_string(p, "451 Temporary failure");
 		}
 
-		m_close(p_pony);
+		m_close(p);
 		while ((ep = TAILQ_FIRST(&lks->deliverylist)) != NULL) {
 			TAILQ_REMOVE(&lks->deliverylist, ep, entry);
 			free(ep);
@@ -45,6 +45,14 @@ static void mproc_dispatch(int, short, void *);
 
 static ssize_t imsg_read_nofd(struct imsgbuf *);
 
+/*
+ * While output is held, imsgs are queued but not written.  The queue
+ * holds it during a group commit, so that no other process hears about
+ * an update before it is on disk.
+ */
+static int		mproc_held;
+static struct tree	mproc_heldprocs;
+
 int
 mproc_fork(struct mproc *p, const char *path, char *argv[])
 {
@@ -94,6 +102,7 @@ mproc_clear(struct mproc *p)
 	event_del(&p->ev);
 	close(p->imsgbuf.fd);
 	imsg_clear(&p->imsgbuf);
+	tree_pop(&mproc_heldprocs, (uint64_t)(uintptr_t)p);
 }
 
 void
@@ -130,8 +139,12 @@ mproc_event_add(struct mproc *p)
 	else
 		events = 0;
 
-	if (p->imsgbuf.w.queued)
-		events |= EV_WRITE;
+	if (p->imsgbuf.w.queued) {
+		if (mproc_held)
+			tree_set(&mproc_heldprocs, (uint64_t)(uintptr_t)p, p);
+		else
+			events |= EV_WRITE;
+	}
 
 	if (p->events)
 		event_del(&p->ev);
@@ -143,6 +156,22 @@ mproc_event_add(struct mproc *p)
 	}
 }
 
+void
+mproc_hold(void)
+{
+	mproc_held = 1;
+}
+
+void
+mproc_release(void)
+{
+	struct mproc	*p;
+
+	mproc_held = 0;
+	while (tree_poproot(&mproc_heldprocs, NULL, (void **)&p))
+		mproc_event_add(p);
+}
+
 static void
 mproc_dispatch(int fd, short event, void *arg)
 {
@@ -178,7 +207,7 @@ mproc_dispatch(int fd, short event, void *arg)
 		}
 	}
 
-	if (event & EV_WRITE) {
+	if ((event & EV_WRITE) && !mproc_held) {
 		n = msgbuf_write(&p->imsgbuf.w);
 		if (n == 0 || (n == -1 && errno != EAGAIN)) {
 			/* this pipe is dead, so remove the event handler */
@@ -499,10 +528,12 @@ void
 m_add_envelope(struct mproc *m, const struct envelope *evp)
 {
 	char	buf[sizeof(*evp)];
+	int	len;
 
-	envelope_dump_buffer(evp, buf, sizeof(buf));
+	if ((len = envelope_dump_binary(evp, buf, sizeof(buf))) == 0)
+		fatalx("failed to dump envelope");
 	m_add_evpid(m, evp->id);
-	m_add_string(m, buf);
+	m_add_data(m, buf, len);
 }
 
 void
@@ -633,12 +664,13 @@ void
 m_get_envelope(struct msg *m, struct envelope *evp)
 {
 	uint64_t	 evpid;
-	const char	*buf;
+	const void	*buf;
+	size_t		 len;
 
 	m_get_evpid(m, &evpid);
-	m_get_string(m, &buf);
+	m_get_data(m, &buf, &len);
 
-	if (!envelope_load_buffer(evp, buf, strlen(buf)))
+	if (!envelope_load_buffer(evp, buf, len))
 		fatalx("failed to retrieve envelope");
 	evp->id = evpid;
 }
@@ -1281,6 +1281,7 @@ mta_connect(struct mta_connector *c)
 	route->dst->nconn += 1;
 	route->dst->lastconn = c->lastconn;
 
+	stat_increment("mta.pool.miss", 1);
 	mta_session(c->relay, route);	/* this never fails synchronously */
 	mta_relay_ref(c->relay);
 
@@ -1394,6 +1395,15 @@ mta_drain(struct mta_relay *r)
 		return;
 	}
 
+	/*
+	 * Sessions kept open for this relay take the tasks first.
+	 */
+	mta_session_resume(r);
+	if (r->ntask == 0) {
+		log_debug("debug: mta: all done for %s", mta_relay_to_text(r));
+		return;
+	}
+
 	/* Query secret if needed. */
 	if (r->flags & RELAY_AUTH && r->secret == NULL)
 		mta_query_secret(r);
@@ -1758,6 +1768,7 @@ mta_relay(struct envelope *e, struct relayhost *relayh)
 	if ((r = SPLAY_FIND(mta_relay_tree, &relays, &key)) == NULL) {
 		r = xcalloc(1, sizeof *r);
 		TAILQ_INIT(&r->tasks);
+		tree_init(&r->idle);
 		r->id = generate_uid();
 		r->tls = key.tls;
 		r->flags = key.flags;
@@ -1946,11 +1957,12 @@ mta_relay_show(struct mta_relay *r, struct mproc *p, uint32_t id, time_t t)
 	else
 		(void)strlcpy(dur, "-", sizeof(dur));
 
-	(void)snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu nconn=%zu lastconn=%s timeout=%s wait=%s%s",
+	(void)snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu nconn=%zu nidle=%zu lastconn=%s timeout=%s wait=%s%s",
 	    mta_relay_to_text(r),
 	    r->refcount,
 	    r->ntask,
 	    r->nconn,
+	    tree_count(&r->idle),
 	    r->lastconn ? duration_to_text(t - r->lastconn) : "-",
 	    dur,
 	    flags,
@@ -53,6 +53,13 @@
 #define MAX_TRYBEFOREDISABLE	10
 
 #define MTA_HIWAT		65535
+#define MTA_CHUNK_SIZE		32768
+
+/*
+ * The body is being sent and more of it is due from the queue: the io
+ * stays in write mode so that it is flushed as soon as it arrives.
+ */
+#define MTA_BODY_WAIT(s)	((s)->state == MTA_BODY && (s)->datafd != -1)
 
 enum mta_state {
 	MTA_INIT,
@@ -73,6 +80,7 @@ enum mta_state {
 	MTA_BODY,
 	MTA_EOM,
 	MTA_LMTP_EOM,
+	MTA_ABORT,
 	MTA_RSET,
 	MTA_QUIT,
 };
@@ -92,6 +100,11 @@ enum mta_state {
 #define MTA_WAIT		0x1000
 #define MTA_HANGON		0x2000
 #define MTA_RECONN		0x4000
+#define MTA_PIPELINING		0x8000
+#define MTA_CHUNKING		0x10000
+#define MTA_IDLE		0x20000
+
+#define MTA_TLS_CACHE_MAX	1024
 
 #define MTA_EXT_STARTTLS	0x01
 #define MTA_EXT_PIPELINING	0x02
@@ -99,6 +112,12 @@ enum mta_state {
 #define MTA_EXT_AUTH_PLAIN     	0x08
 #define MTA_EXT_AUTH_LOGIN     	0x10
 #define MTA_EXT_SIZE     	0x20
+#define MTA_EXT_CHUNKING	0x40
+
+struct mta_tls_entry {
+	SSL_SESSION		*session;
+	time_t			 expire;
+};
 
 struct mta_session {
 	uint64_t		 id;
@@ -123,12 +142,17 @@ struct mta_session {
 	size_t			 msgtried;
 	size_t			 msgcount;
 	size_t			 rcptcount;
-	int			 hangon;
+	size_t			 discard;
+	size_t			 chunks;
+	int			 bol;
 
 	enum mta_state		 state;
 	struct mta_task		*task;
 	struct mta_envelope	*currevp;
-	FILE			*datafp;
+	int			 datafd;
+	size_t			 datalen;
+	size_t			 dataoff;
+	struct event		 ev_data;
 
 	size_t			 failures;
 
@@ -142,12 +166,18 @@ static void mta_free(struct mta_session *);
 static void mta_getnameinfo_cb(void *, int, const char *, const char *);
 static void mta_on_ptr(void *, void *, void *);
 static void mta_on_timeout(struct runq *, void *);
+static void mta_idle_remove(struct mta_session *);
 static void mta_connect(struct mta_session *);
 static void mta_enter_state(struct mta_session *, int);
 static void mta_flush_task(struct mta_session *, int, const char *, size_t, int);
 static void mta_error(struct mta_session *, const char *, ...);
 static void mta_send(struct mta_session *, char *, ...);
+static void mta_send_rcpt(struct mta_session *, struct mta_envelope *);
 static ssize_t mta_queue_data(struct mta_session *);
+static ssize_t mta_queue_chunk(struct mta_session *);
+static ssize_t mta_read_data(struct mta_session *, char *, size_t);
+static void mta_data_ready(int, short, void *);
+static void mta_data_close(struct mta_session *);
 static void mta_response(struct mta_session *, char *);
 static const char * mta_strstate(int);
 static void mta_cert_init(struct mta_session *);
@@ -155,6 +185,13 @@ static void mta_cert_init_cb(void *, int, const char *, const void *, size_t);
 static void mta_cert_verify(struct mta_session *);
 static void mta_cert_verify_cb(void *, int);
 static void mta_tls_verified(struct mta_session *);
+static int mta_tls_session_key(struct mta_session *, char *, size_t);
+static void mta_tls_session_load(struct mta_session *, SSL *);
+static void mta_tls_session_save(struct mta_session *);
+static int mta_tls_verify_key(struct mta_session *, char *, size_t);
+static int mta_tls_cache_add(struct dict *, const char *, SSL_SESSION *,
+    time_t);
+static void mta_tls_cache_expire(struct dict *, time_t);
 static struct mta_session *mta_tree_pop(struct tree *, uint64_t);
 static const char * dsn_strret(enum dsn_ret);
 static const char * dsn_strnotify(uint8_t);
@@ -169,6 +206,8 @@ static struct tree wait_ptr;
 static struct tree wait_fd;
 static struct tree wait_ssl_init;
 static struct tree wait_ssl_verify;
+static struct dict tls_sessions;
+static struct dict tls_verified;
 
 static struct runq *hangon;
 
@@ -183,6 +222,8 @@ mta_session_init(void)
 		tree_init(&wait_fd);
 		tree_init(&wait_ssl_init);
 		tree_init(&wait_ssl_verify);
+		dict_init(&tls_sessions);
+		dict_init(&tls_verified);
 		runq_init(&hangon, mta_on_timeout);
 		init = 1;
 	}
@@ -200,6 +241,7 @@ mta_session(struct mta_relay *relay, struct mta_route *route)
 	s->id = generate_uid();
 	s->relay = relay;
 	s->route = route;
+	s->datafd = -1;
 
 	if (relay->flags & RELAY_LMTP)
 		s->flags |= MTA_LMTP;
@@ -239,6 +281,25 @@ mta_session(struct mta_relay *relay, struct mta_route *route)
 	}
 }
 
+/*
+ * Hand the pending tasks of a relay to the sessions kept open for it,
+ * before the relay considers opening new connections.
+ */
+void
+mta_session_resume(struct mta_relay *relay)
+{
+	struct mta_session	*s;
+
+	while (relay->ntask && tree_root(&relay->idle, NULL, (void **)&s)) {
+		log_debug("debug: mta: %p: reusing idle session for relay %s",
+		    s, mta_relay_to_text(relay));
+		runq_cancel(hangon, NULL, s);
+		mta_idle_remove(s);
+		stat_increment("mta.pool.hit", 1);
+		mta_enter_state(s, MTA_READY);
+	}
+}
+
 void
 mta_session_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -247,13 +308,14 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 	uint64_t		 reqid;
 	const char		*name;
 	int			 status;
-	struct stat		 sb;
-	
+	size_t			 size;
+
 	switch (imsg->hdr.type) {
 
 	case IMSG_MTA_OPEN_MESSAGE:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
+		m_get_size(&m, &size);
 		m_end(&m);
 
 		s = mta_tree_pop(&wait_fd, reqid);
@@ -271,28 +333,22 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 
-		if ((s->ext & MTA_EXT_SIZE) && s->ext_size != 0) {
-			if (fstat(imsg->fd, &sb) == -1) {
-				log_debug("debug: mta: failed to stat msg fd");
-				mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
-				    "Could not stat message fd", 0, 0);
-				mta_enter_state(s, MTA_READY);
-				close(imsg->fd);
-				return;
-			}
-			if (sb.st_size > (off_t)s->ext_size) {
-				log_debug("debug: mta: message too large for peer");
-				mta_flush_task(s, IMSG_MTA_DELIVERY_PERMFAIL,
-				    "message too large for peer", 0, 0);
-				mta_enter_state(s, MTA_READY);
-				close(imsg->fd);
-				return;
-			}
+		if ((s->ext & MTA_EXT_SIZE) && s->ext_size != 0 &&
+		    size > s->ext_size) {
+			log_debug("debug: mta: message too large for peer");
+			mta_flush_task(s, IMSG_MTA_DELIVERY_PERMFAIL,
+			    "message too large for peer", 0, 0);
+			mta_enter_state(s, MTA_READY);
+			close(imsg->fd);
+			return;
 		}
-		
-		s->datafp = fdopen(imsg->fd, "r");
-		if (s->datafp == NULL)
-			fatal("mta: fdopen");
+
+		/* the body may be streamed from the queue through a pipe */
+		io_set_nonblocking(imsg->fd);
+		s->datafd = imsg->fd;
+		s->datalen = size;
+		s->dataoff = 0;
+		event_set(&s->ev_data, s->datafd, EV_READ, mta_data_ready, s);
 
 		mta_enter_state(s, MTA_MAIL);
 		return;
@@ -352,18 +408,19 @@ mta_free(struct mta_session *s)
 	if (s->ready)
 		s->relay->nconn_ready -= 1;
 
-	if (s->flags & MTA_HANGON) {
+	if (s->flags & (MTA_HANGON | MTA_IDLE)) {
 		log_debug("debug: mta: %p: cancelling hangon timer", s);
 		runq_cancel(hangon, NULL, s);
 	}
+	if (s->flags & MTA_IDLE)
+		mta_idle_remove(s);
 
 	if (s->io)
 		io_free(s->io);
 
 	if (s->task)
 		fatalx("current task should have been deleted already");
-	if (s->datafp)
-		fclose(s->datafp);
+	mta_data_close(s);
 	free(s->helo);
 
 	relay = s->relay;
@@ -391,14 +448,28 @@ mta_on_timeout(struct runq *runq, void *arg)
 {
 	struct mta_session *s = arg;
 
+	if (s->flags & MTA_IDLE) {
+		log_debug("debug: mta: %p: keepalive expired", s);
+		mta_idle_remove(s);
+		mta_enter_state(s, MTA_QUIT);
+		return;
+	}
+
 	log_debug("mta: timeout for session hangon");
 
 	s->flags &= ~MTA_HANGON;
-	s->hangon++;
 
 	mta_enter_state(s, MTA_READY);
 }
 
+static void
+mta_idle_remove(struct mta_session *s)
+{
+	tree_xpop(&s->relay->idle, s->id);
+	s->flags &= ~MTA_IDLE;
+	stat_decrement("mta.pool.idle", 1);
+}
+
 static void
 mta_on_ptr(void *tag, void *arg, void *data)
 {
@@ -692,17 +763,24 @@ mta_enter_state(struct mta_session *s, int newstate)
 			log_debug("debug: mta: %p: no task for relay %s",
 			    s, mta_relay_to_text(s->relay));
 
-			if (s->relay->nconn > 1 ||
-			    s->hangon >= s->relay->limits->sessdelay_keepalive) {
+			/*
+			 * Keep the session, and its TLS state, open for
+			 * the next task on this relay if the pool has room.
+			 */
+			if (s->relay->limits->sessdelay_keepalive == 0 ||
+			    tree_count(&s->relay->idle) >=
+			    s->relay->limits->maxidle_per_relay) {
 				mta_enter_state(s, MTA_QUIT);
 				break;
 			}
 
-			log_debug("mta: debug: last connection: hanging on for %llds",
-			    (long long)(s->relay->limits->sessdelay_keepalive -
-			    s->hangon));
-			s->flags |= MTA_HANGON;
-			runq_schedule(hangon, time(NULL) + 1, NULL, s);
+			log_debug("debug: mta: %p: idle, hanging on for %llds",
+			    s, (long long)s->relay->limits->sessdelay_keepalive);
+			tree_xset(&s->relay->idle, s->id, s);
+			s->flags |= MTA_IDLE;
+			stat_increment("mta.pool.idle", 1);
+			runq_schedule(hangon, time(NULL) +
+			    s->relay->limits->sessdelay_keepalive, NULL, s);
 			break;
 		}
 
@@ -724,7 +802,6 @@ mta_enter_state(struct mta_session *s, int newstate)
 		s->currevp = TAILQ_FIRST(&s->task->envelopes);
 
 		e = s->currevp;
-		s->hangon = 0;
 		s->msgtried++;
 		envid_sz = strlen(e->dsn_envid);
 		if (s->ext & MTA_EXT_DSN) {
@@ -736,33 +813,53 @@ mta_enter_state(struct mta_session *s, int newstate)
 			    envid_sz ? e->dsn_envid : "");
 		} else
 			mta_send(s, "MAIL FROM:<%s>", s->task->sender);
+
+		/*
+		 * If the peer supports PIPELINING, send all the RCPT TO and
+		 * the DATA right away.  The replies are then matched in order
+		 * as the session walks through the usual states.
+		 *
+		 * With CHUNKING as well, the body goes out in BDAT chunks
+		 * that are not waited for either, so there is no DATA.
+		 */
+		s->flags &= ~(MTA_PIPELINING | MTA_CHUNKING);
+		if (s->ext & MTA_EXT_PIPELINING) {
+			if (s->ext & MTA_EXT_CHUNKING &&
+			    !(s->flags & MTA_LMTP))
+				s->flags |= MTA_CHUNKING;
+			TAILQ_FOREACH(e, &s->task->envelopes, entry)
+				mta_send_rcpt(s, e);
+			if (!(s->flags & MTA_CHUNKING))
+				mta_send(s, "DATA");
+			s->flags |= MTA_PIPELINING;
+		}
 		break;
 
 	case MTA_RCPT:
 		if (s->currevp == NULL)
 			s->currevp = TAILQ_FIRST(&s->task->envelopes);
 
-		e = s->currevp;
-		if (s->ext & MTA_EXT_DSN) {
-			mta_send(s, "RCPT TO:<%s>%s%s%s%s",
-			    e->dest,
-			    e->dsn_notify ? " NOTIFY=" : "",
-			    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
-			    e->dsn_orcpt ? " ORCPT=" : "",
-			    e->dsn_orcpt ? e->dsn_orcpt : "");
-		} else
-			mta_send(s, "RCPT TO:<%s>", e->dest);
+		/* already sent */
+		if (s->flags & MTA_PIPELINING)
+			break;
 
-		s->rcptcount++;
+		mta_send_rcpt(s, s->currevp);
 		break;
 
 	case MTA_DATA:
-		fseek(s->datafp, 0, SEEK_SET);
-		mta_send(s, "DATA");
+		s->bol = 1;
+		if (s->flags & MTA_CHUNKING) {
+			s->flags &= ~MTA_PIPELINING;
+			s->chunks = 0;
+			mta_enter_state(s, MTA_BODY);
+			break;
+		}
+		if (!(s->flags & MTA_PIPELINING))
+			mta_send(s, "DATA");
 		break;
 
 	case MTA_BODY:
-		if (s->datafp == NULL) {
+		if (s->datafd == -1) {
 			log_trace(TRACE_MTA, "mta: %p: end-of-file", s);
 			mta_enter_state(s, MTA_EOM);
 			break;
@@ -773,6 +870,9 @@ mta_enter_state(struct mta_session *s, int newstate)
 			break;
 		}
 		if (q == 0) {
+			/* waiting for the queue to feed the pipe */
+			if (s->datafd != -1)
+				break;
 			mta_enter_state(s, MTA_BODY);
 			break;
 		}
@@ -781,7 +881,9 @@ mta_enter_state(struct mta_session *s, int newstate)
 		break;
 
 	case MTA_EOM:
-		mta_send(s, ".");
+		/* the last chunk was sent as BDAT LAST */
+		if (!(s->flags & MTA_CHUNKING))
+			mta_send(s, ".");
 		break;
 
 	case MTA_LMTP_EOM:
@@ -789,11 +891,13 @@ mta_enter_state(struct mta_session *s, int newstate)
 		io_set_read(s->io);
 		break;
 
+	case MTA_ABORT:
+		/* wait for the reply to the pipelined DATA */
+		break;
+
 	case MTA_RSET:
-		if (s->datafp) {
-			fclose(s->datafp);
-			s->datafp = NULL;
-		}
+		s->flags &= ~MTA_PIPELINING;
+		mta_data_close(s);
 		mta_send(s, "RSET");
 		break;
 
@@ -929,6 +1033,14 @@ mta_response(struct mta_session *s, char *line)
 			else
 				delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
 			mta_flush_task(s, delivery, line, 0, 0);
+			/* skip the replies to the pipelined RCPT TO */
+			if (s->flags & MTA_PIPELINING) {
+				s->discard = s->rcptcount;
+				if (!(s->flags & MTA_CHUNKING)) {
+					mta_enter_state(s, MTA_ABORT);
+					return;
+				}
+			}
 			mta_enter_state(s, MTA_RSET);
 			return;
 		}
@@ -1001,7 +1113,11 @@ mta_response(struct mta_session *s, char *line)
 			if (TAILQ_EMPTY(&s->task->envelopes)) {
 				mta_flush_task(s, IMSG_MTA_DELIVERY_OK,
 				    "No envelope", 0, 0);
-				mta_enter_state(s, MTA_RSET);
+				if (s->flags & MTA_PIPELINING &&
+				    !(s->flags & MTA_CHUNKING))
+					mta_enter_state(s, MTA_ABORT);
+				else
+					mta_enter_state(s, MTA_RSET);
 				break;
 			}
 		}
@@ -1013,6 +1129,7 @@ mta_response(struct mta_session *s, char *line)
 		break;
 
 	case MTA_DATA:
+		s->flags &= ~MTA_PIPELINING;
 		if (line[0] == '2' || line[0] == '3') {
 			mta_enter_state(s, MTA_BODY);
 			break;
@@ -1027,6 +1144,23 @@ mta_response(struct mta_session *s, char *line)
 
 	case MTA_LMTP_EOM:
 	case MTA_EOM:
+		/* reply to an intermediate BDAT, the final one is still due */
+		if (s->chunks) {
+			s->chunks--;
+			if (line[0] == '2')
+				break;
+			if (line[0] == '5')
+				delivery = IMSG_MTA_DELIVERY_PERMFAIL;
+			else
+				delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
+			mta_flush_task(s, delivery, line, 0, 0);
+			s->discard = s->chunks + 1;
+			s->chunks = 0;
+			mta_enter_state(s, MTA_RSET);
+			break;
+		}
+		s->flags &= ~MTA_PIPELINING;
+
 		if (line[0] == '2') {
 			delivery = IMSG_MTA_DELIVERY_OK;
 			s->msgtried = 0;
@@ -1045,7 +1179,6 @@ mta_response(struct mta_session *s, char *line)
 			if (s->relay->limits->sessdelay_transaction) {
 				log_debug("debug: mta: waiting for %llds before next transaction",
 				    (long long int)s->relay->limits->sessdelay_transaction);
-				s->hangon = s->relay->limits->sessdelay_transaction -1;
 				s->flags |= MTA_HANGON;
 				runq_schedule(hangon, time(NULL)
 				    + s->relay->limits->sessdelay_transaction,
@@ -1056,12 +1189,24 @@ mta_response(struct mta_session *s, char *line)
 		}
 		break;
 
+	case MTA_ABORT:
+		/*
+		 * The transaction is gone but the server may still have
+		 * accepted the pipelined DATA.  End the empty message first
+		 * so that the RSET is not taken as message content.
+		 */
+		if (line[0] == '3') {
+			mta_send(s, ".");
+			s->discard = 1;
+		}
+		mta_enter_state(s, MTA_RSET);
+		break;
+
 	case MTA_RSET:
 		s->rcptcount = 0;
 		if (s->relay->limits->sessdelay_transaction) {
 			log_debug("debug: mta: waiting for %llds after reset",
 			    (long long int)s->relay->limits->sessdelay_transaction);
-			s->hangon = s->relay->limits->sessdelay_transaction -1;
 			s->flags |= MTA_HANGON;
 			runq_schedule(hangon, time(NULL)
 			    + s->relay->limits->sessdelay_transaction,
@@ -1108,6 +1253,12 @@ mta_io(struct io *io, int evt, void *arg)
 		    s->id, ssl_to_text(io_ssl(s->io)));
 		s->flags |= MTA_TLS;
 
+		if (SSL_session_reused(io_ssl(s->io)))
+			stat_increment("mta.tls.resumed", 1);
+		else
+			stat_increment("mta.tls.full", 1);
+		mta_tls_session_save(s);
+
 		mta_cert_verify(s);
 		break;
 
@@ -1119,11 +1270,22 @@ mta_io(struct io *io, int evt, void *arg)
 				mta_error(s, "Input too long");
 				mta_free(s);
 			}
+			/* flush what was queued while reading pipelined replies */
+			else if (io_queued(s->io))
+				io_set_write(io);
 			return;
 		}
 
 		log_trace(TRACE_MTA, "mta: %p: <<< %s", s, line);
 
+		/* the server gave up on a pooled session, typically with 421 */
+		if (s->flags & MTA_IDLE) {
+			log_debug("debug: mta: %p: idle session closed by "
+			    "server: %s", s, line);
+			mta_free(s);
+			return;
+		}
+
 		if ((error = parse_smtp_response(line, len, &msg, &cont))) {
 			mta_error(s, "Bad response: %s", error);
 			mta_free(s);
@@ -1145,6 +1307,8 @@ mta_io(struct io *io, int evt, void *arg)
 			}
 			else if (strcmp(msg, "PIPELINING") == 0)
 				s->ext |= MTA_EXT_PIPELINING;
+			else if (strcmp(msg, "CHUNKING") == 0)
+				s->ext |= MTA_EXT_CHUNKING;
 			else if (strcmp(msg, "DSN") == 0)
 				s->ext |= MTA_EXT_DSN;
 			else if (strncmp(msg, "SIZE ", 5) == 0) {
@@ -1186,11 +1350,22 @@ mta_io(struct io *io, int evt, void *arg)
 			(void)strlcpy(s->replybuf, line, sizeof s->replybuf);
 
 		if (s->state == MTA_QUIT) {
+			/* TLSv1.3 tickets only arrive after the handshake */
+			if (s->flags & MTA_TLS)
+				mta_tls_session_save(s);
 			log_info("%016"PRIx64" mta disconnected reason=quit messages=%zu",
 			    s->id, s->msgcount);
 			mta_free(s);
 			return;
 		}
+
+		/* reply to a pipelined command of an aborted transaction */
+		if (s->discard) {
+			s->discard--;
+			memset(s->replybuf, 0, sizeof s->replybuf);
+			goto nextline;
+		}
+
 		io_set_write(io);
 		mta_response(s, s->replybuf);
 		if (s->flags & MTA_FREE) {
@@ -1203,6 +1378,19 @@ mta_io(struct io *io, int evt, void *arg)
 			return;
 		}
 
+		/* more replies to pipelined commands */
+		if (s->flags & MTA_PIPELINING || s->discard) {
+			if (io_datalen(s->io)) {
+				io_set_read(io);
+				goto nextline;
+			}
+			if (io_queued(s->io) == 0) {
+				if (!MTA_BODY_WAIT(s))
+					io_set_read(io);
+				break;
+			}
+		}
+
 		if (io_datalen(s->io)) {
 			log_debug("debug: mta: remaining data in input buffer");
 			mta_error(s, "Remote host sent too much data");
@@ -1222,7 +1410,7 @@ mta_io(struct io *io, int evt, void *arg)
 			}
 		}
 
-		if (io_queued(s->io) == 0)
+		if (io_queued(s->io) == 0 && !MTA_BODY_WAIT(s))
 			io_set_read(io);
 		break;
 
@@ -1277,6 +1465,10 @@ mta_io(struct io *io, int evt, void *arg)
 	case IO_DISCONNECTED:
 		log_debug("debug: mta: %p: disconnected in state %s",
 		    s, mta_strstate(s->state));
+		if (s->flags & MTA_IDLE) {
+			mta_free(s);
+			break;
+		}
 		mta_error(s, "Connection closed unexpectedly");
 		if (!s->ready)
 			mta_connect(s);
@@ -1308,41 +1500,170 @@ mta_send(struct mta_session *s, char *fmt, ...)
 	free(p);
 }
 
+static void
+mta_send_rcpt(struct mta_session *s, struct mta_envelope *e)
+{
+	if (s->ext & MTA_EXT_DSN) {
+		mta_send(s, "RCPT TO:<%s>%s%s%s%s",
+		    e->dest,
+		    e->dsn_notify ? " NOTIFY=" : "",
+		    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
+		    e->dsn_orcpt ? " ORCPT=" : "",
+		    e->dsn_orcpt ? e->dsn_orcpt : "");
+	} else
+		mta_send(s, "RCPT TO:<%s>", e->dest);
+
+	s->rcptcount++;
+}
+
 /*
- * Queue some data into the input buffer
+ * Queue some data into the input buffer.  The content file is read in
+ * large blocks that are encoded straight into the output buffer.
  */
 static ssize_t
 mta_queue_data(struct mta_session *s)
 {
-	char	*ln = NULL;
-	size_t	 sz = 0, q;
-	ssize_t	 len;
+	static char	 buf[MTA_CHUNK_SIZE];
+	char		*p;
+	size_t		 n, q;
+	ssize_t		 len;
+
+	if (s->flags & MTA_CHUNKING)
+		return (mta_queue_chunk(s));
 
 	q = io_queued(s->io);
 
 	while (io_queued(s->io) < MTA_HIWAT) {
-		if ((len = getline(&ln, &sz, s->datafp)) == -1)
+		if ((len = mta_read_data(s, buf, sizeof buf)) == -1) {
+			mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
+			    "Error reading content file", 0, 0);
+			return (-1);
+		}
+		if (len == 0)
 			break;
-		if (ln[len - 1] == '\n')
-			ln[len - 1] = '\0';
-		io_xprintf(s->io, "%s%s\r\n", *ln == '.' ? "." : "", ln);
+		n = smtp_body_encoded_len(buf, len, 1, s->bol);
+		if ((p = io_reserve(s->io, n)) == NULL)
+			fatal("mta_queue_data: io_reserve");
+		smtp_body_encode(p, buf, len, 1, &s->bol);
+	}
+
+	if (s->dataoff == s->datalen) {
+		if (!s->bol)
+			io_xprint(s->io, "\r\n");
+		mta_data_close(s);
 	}
 
-	free(ln);
-	if (ferror(s->datafp)) {
+	return (io_queued(s->io) - q);
+}
+
+/*
+ * Queue the next BDAT chunk.  The spool has LF line endings, which are
+ * turned into CRLF; there is no dot-stuffing with BDAT.
+ */
+static ssize_t
+mta_queue_chunk(struct mta_session *s)
+{
+	static char	 buf[MTA_CHUNK_SIZE];
+	char		*p;
+	size_t		 n, q;
+	ssize_t		 len;
+	int		 last, eol;
+
+	q = io_queued(s->io);
+
+	if ((len = mta_read_data(s, buf, sizeof buf)) == -1) {
 		mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
 		    "Error reading content file", 0, 0);
 		return (-1);
 	}
+	last = s->dataoff == s->datalen;
+	if (len == 0 && !last)
+		return (0);
+
+	/* the last line is terminated within the last chunk */
+	n = smtp_body_encoded_len(buf, len, 0, s->bol);
+	eol = len ? buf[len - 1] == '\n' : s->bol;
+	if (last && !eol)
+		n += 2;
+
+	io_xprintf(s->io, "BDAT %zu%s\r\n", n, last ? " LAST" : "");
+	if (n) {
+		if ((p = io_reserve(s->io, n)) == NULL)
+			fatal("mta_queue_chunk: io_reserve");
+		p += smtp_body_encode(p, buf, len, 0, &s->bol);
+		if (last && !eol)
+			memcpy(p, "\r\n", 2);
+	}
 
-	if (feof(s->datafp)) {
-		fclose(s->datafp);
-		s->datafp = NULL;
+	if (last)
+		mta_data_close(s);
+	else {
+		s->chunks++;
+		s->flags |= MTA_PIPELINING;
 	}
 
 	return (io_queued(s->io) - q);
 }
 
+/*
+ * Read the next block of the message.  Returns the number of bytes
+ * read, 0 if the message is complete or nothing is available yet, in
+ * which case the session is resumed when there is, or -1 on error.  The
+ * queue withholds the end of a message it fails to decode, so reaching
+ * end-of-file before the announced size is an error.
+ */
+static ssize_t
+mta_read_data(struct mta_session *s, char *buf, size_t len)
+{
+	ssize_t	n;
+
+	if (len > s->datalen - s->dataoff)
+		len = s->datalen - s->dataoff;
+	if (len == 0)
+		return (0);
+
+	if ((n = read(s->datafd, buf, len)) == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			event_add(&s->ev_data, NULL);
+			return (0);
+		}
+		log_warn("warn: mta: read");
+		return (-1);
+	}
+	if (n == 0) {
+		log_warnx("warn: mta: message truncated at %zu of %zu bytes",
+		    s->dataoff, s->datalen);
+		return (-1);
+	}
+	s->dataoff += n;
+
+	return (n);
+}
+
+static void
+mta_data_ready(int fd, short event, void *arg)
+{
+	struct mta_session	*s = arg;
+
+	if (s->state != MTA_BODY)
+		return;
+
+	mta_enter_state(s, MTA_BODY);
+	if (s->flags & MTA_FREE)
+		mta_free(s);
+}
+
+static void
+mta_data_close(struct mta_session *s)
+{
+	if (s->datafd == -1)
+		return;
+
+	event_del(&s->ev_data);
+	close(s->datafd);
+	s->datafd = -1;
+}
+
 static void
 mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t count,
 	int cache)
@@ -1400,10 +1721,7 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 	free(s->task);
 	s->task = NULL;
 
-	if (s->datafp) {
-		fclose(s->datafp);
-		s->datafp = NULL;
-	}
+	mta_data_close(s);
 
 	stat_decrement("mta.envelope", n);
 	stat_decrement("mta.task.running", 1);
@@ -1496,15 +1814,35 @@ mta_cert_init_cb(void *arg, int status, const char *name, const void *cert,
 	free(xcert);
 	if (ssl == NULL)
 		fatal("mta: ssl_mta_init");
+	mta_tls_session_load(s, ssl);
 	io_start_tls(s->io, ssl);
 }
 
 static void
 mta_cert_verify(struct mta_session *s)
 {
+	struct mta_tls_entry *e;
 	const char *name;
+	char key[LINE_MAX];
 	int fallback;
 
+	/*
+	 * A resumed session presenting a certificate that was verified
+	 * recently needs no new round-trip to the lka.
+	 */
+	if (SSL_session_reused(io_ssl(s->io)) &&
+	    mta_tls_verify_key(s, key, sizeof key) &&
+	    (e = dict_get(&tls_verified, key))) {
+		if (e->expire > time(NULL)) {
+			stat_increment("mta.tls.verify.cached", 1);
+			s->flags |= MTA_TLS_VERIFIED;
+			mta_tls_verified(s);
+			return;
+		}
+		dict_xpop(&tls_verified, key);
+		free(e);
+	}
+
 	if (s->relay->ca_name) {
 		name = s->relay->ca_name;
 		fallback = 0;
@@ -1525,6 +1863,7 @@ static void
 mta_cert_verify_cb(void *arg, int status)
 {
 	struct mta_session *s = arg;
+	char key[LINE_MAX];
 	int resume = 0;
 
 	if (s->flags & MTA_WAIT) {
@@ -1532,8 +1871,12 @@ mta_cert_verify_cb(void *arg, int status)
 		resume = 1;
 	}
 
-	if (status == CERT_OK)
+	if (status == CERT_OK) {
 		s->flags |= MTA_TLS_VERIFIED;
+		if (mta_tls_verify_key(s, key, sizeof key))
+			mta_tls_cache_add(&tls_verified, key, NULL,
+			    time(NULL) + SSL_SESSION_TIMEOUT);
+	}
 	else if (s->relay->flags & RELAY_TLS_VERIFY) {
 		errno = 0;
 		mta_error(s, "SSL certificate check failed");
@@ -1568,6 +1911,152 @@ mta_tls_verified(struct mta_session *s)
 		mta_enter_state(s, MTA_EHLO);
 }
 
+/*
+ * Sessions are cached per route, port and client certificate: the MTA
+ * sends no SNI, so that is what tells two handshakes to a MX apart.
+ */
+static int
+mta_tls_session_key(struct mta_session *s, char *buf, size_t len)
+{
+	char		 src[NI_MAXHOST + 8];
+	const char	*name;
+	int		 n;
+
+	name = s->relay->pki_name ? s->relay->pki_name : s->helo;
+	if (s->route->src->sa)
+		(void)strlcpy(src, sa_to_text(s->route->src->sa), sizeof src);
+	else
+		(void)strlcpy(src, "*", sizeof src);
+
+	n = snprintf(buf, len, "%s %s %d %s %s", src,
+	    sa_to_text(s->route->dst->sa), s->relay->port,
+	    s->use_smtps ? "smtps" : "starttls", name ? name : "");
+	return (n >= 0 && (size_t)n < len);
+}
+
+static void
+mta_tls_session_load(struct mta_session *s, SSL *ssl)
+{
+	struct mta_tls_entry	*e;
+	char			 key[LINE_MAX];
+
+	if (!mta_tls_session_key(s, key, sizeof key))
+		return;
+	if ((e = dict_get(&tls_sessions, key)) == NULL)
+		return;
+
+	if (e->expire <= time(NULL)) {
+		dict_xpop(&tls_sessions, key);
+		SSL_SESSION_free(e->session);
+		free(e);
+		return;
+	}
+	if (!SSL_set_session(ssl, e->session))
+		ssl_error("mta_tls_session_load");
+}
+
+static void
+mta_tls_session_save(struct mta_session *s)
+{
+	struct mta_tls_entry	*e;
+	SSL_SESSION		*session;
+	char			 key[LINE_MAX];
+	time_t			 expire;
+
+	if (!mta_tls_session_key(s, key, sizeof key))
+		return;
+	if ((session = SSL_get1_session(io_ssl(s->io))) == NULL)
+		return;
+
+	expire = SSL_SESSION_get_time(session) +
+	    SSL_SESSION_get_timeout(session);
+	if ((e = dict_get(&tls_sessions, key))) {
+		SSL_SESSION_free(e->session);
+		e->session = session;
+		e->expire = expire;
+		return;
+	}
+	if (!mta_tls_cache_add(&tls_sessions, key, session, expire))
+		SSL_SESSION_free(session);
+}
+
+/*
+ * Verification results are keyed by the digest of the peer certificate
+ * and the CA it was checked against.
+ */
+static int
+mta_tls_verify_key(struct mta_session *s, char *buf, size_t len)
+{
+	X509		*x;
+	unsigned char	 md[EVP_MAX_MD_SIZE];
+	unsigned int	 mdlen, i;
+	const char	*name;
+	size_t		 n;
+
+	if ((x = SSL_get_peer_certificate(io_ssl(s->io))) == NULL)
+		return 0;
+	if (!X509_digest(x, EVP_sha256(), md, &mdlen)) {
+		X509_free(x);
+		return 0;
+	}
+	X509_free(x);
+
+	if (len < mdlen * 2 + 1)
+		return 0;
+	buf[0] = '\0';
+	for (i = 0; i < mdlen; i++)
+		(void)snprintf(buf + i * 2, 3, "%02x", md[i]);
+
+	name = s->relay->ca_name ? s->relay->ca_name : s->helo;
+	n = strlcat(buf, " ", len);
+	if (name)
+		n = strlcat(buf, name, len);
+	return (n < len);
+}
+
+static int
+mta_tls_cache_add(struct dict *d, const char *key, SSL_SESSION *session,
+    time_t expire)
+{
+	struct mta_tls_entry	*e;
+
+	if (dict_count(d) >= MTA_TLS_CACHE_MAX)
+		mta_tls_cache_expire(d, time(NULL));
+	if (dict_count(d) >= MTA_TLS_CACHE_MAX || dict_check(d, key))
+		return 0;
+
+	e = xcalloc(1, sizeof *e);
+	e->session = session;
+	e->expire = expire;
+	dict_xset(d, key, e);
+	return 1;
+}
+
+static void
+mta_tls_cache_expire(struct dict *d, time_t now)
+{
+	struct mta_tls_entry	*e;
+	const char		*key;
+	char			 buf[LINE_MAX];
+	void			*iter = NULL;
+	int			 more;
+
+	more = dict_iter(d, &iter, &key, (void **)&e);
+	while (more) {
+		if (e->expire > now) {
+			more = dict_iter(d, &iter, &key, (void **)&e);
+			continue;
+		}
+		(void)strlcpy(buf, key, sizeof buf);
+		dict_xpop(d, buf);
+		SSL_SESSION_free(e->session);
+		free(e);
+		/* carry on from the entry following the one removed */
+		iter = NULL;
+		more = dict_iterfrom(d, &iter, buf, &key, (void **)&e);
+	}
+}
+
 static const char *
 dsn_strret(enum dsn_ret ret)
 {
@@ -1631,6 +2120,7 @@ mta_strstate(int state)
 	CASE(MTA_BODY);
 	CASE(MTA_EOM);
 	CASE(MTA_LMTP_EOM);
+	CASE(MTA_ABORT);
 	CASE(MTA_RSET);
 	CASE(MTA_QUIT);
 	default:
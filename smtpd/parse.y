@@ -180,12 +180,12 @@ typedef struct {
 %}
 
 %token	ACTION ALIAS ANY ARROW AUTH AUTH_OPTIONAL
-%token	BACKUP BOUNCE BUILTIN
+%token	BACKEND BACKUP BINARY_ENVELOPES BOUNCE BUILTIN
 %token	CA CERT CHAIN CHROOT CIPHERS COMMIT COMPRESSION CONNECT
 %token	DATA DATA_LINE DHE DIRECTORY DISCONNECT DOMAIN
 %token	EHLO ENABLE ENCRYPTION ERROR EXPAND_ONLY 
 %token	FCRDNS FILTER FOR FORWARD_ONLY FROM
-%token	GROUP
+%token	GROUP GROUP_COMMIT
 %token	HELO HELO_SRC HOST HOSTNAME HOSTNAMES
 %token	INCLUDE INET4 INET6
 %token	JUNK
@@ -201,7 +201,7 @@ typedef struct {
 %token	TABLE TAG TAGGED TLS TLS_REQUIRE TTL
 %token	USER USERBASE
 %token	VERIFY VIRTUAL
-%token	WARN_INTERVAL WRAPPER
+%token	WARN_INTERVAL WEIGHT WORKERS WRAPPER
 
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
@@ -336,6 +336,14 @@ CA STRING {
 		dict_set(conf->sc_ca_dict, sca->ca_name, sca);
 	}
 } ca_params
+| CA WORKERS NUMBER {
+	if ($3 < 1 || $3 > SMTPD_MAXWORKERS) {
+		yyerror("ca workers must be between 1 and %d",
+		    SMTPD_MAXWORKERS);
+		YYERROR;
+	}
+	conf->sc_ca_workers = $3;
+}
 ;
 
 
@@ -488,7 +496,10 @@ proc_params_opt proc_params
 
 
 queue:
-QUEUE COMPRESSION {
+QUEUE BINARY_ENVELOPES {
+	conf->sc_queue_flags |= QUEUE_BINARY;
+}
+| QUEUE COMPRESSION {
 	conf->sc_queue_flags |= QUEUE_COMPRESSION;
 }
 | QUEUE ENCRYPTION {
@@ -503,6 +514,17 @@ QUEUE COMPRESSION {
 		conf->sc_queue_key = $3;
 	conf->sc_queue_flags |= QUEUE_ENCRYPTION;
 }
+| QUEUE GROUP_COMMIT {
+	conf->sc_queue_flags |= QUEUE_GROUPCOMMIT;
+}
+| QUEUE GROUP_COMMIT NUMBER {
+	if ($3 < 0 || $3 > 1000) {
+		yyerror("invalid group-commit window");
+		YYERROR;
+	}
+	conf->sc_queue_flags |= QUEUE_GROUPCOMMIT;
+	conf->sc_queue_commit_window = $3;
+}
 | QUEUE TTL STRING {
 	conf->sc_ttl = delaytonum($3);
 	if (conf->sc_ttl == -1) {
@@ -520,6 +542,32 @@ QUEUE COMPRESSION {
 
 scheduler:
 SCHEDULER LIMIT limits_scheduler
+| SCHEDULER BACKEND STRING {
+	conf->sc_scheduler_backend = $3;
+}
+| SCHEDULER WEIGHT STRING NUMBER {
+	char		 domain[HOST_NAME_MAX+1];
+	size_t		*weight;
+
+	if ($4 <= 0 || $4 > UINT16_MAX) {
+		yyerror("invalid scheduler weight: %" PRId64, $4);
+		free($3);
+		YYERROR;
+	}
+	if (!lowercase(domain, $3, sizeof domain)) {
+		yyerror("invalid domain name: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	free($3);
+	if (dict_check(conf->sc_scheduler_weights, domain)) {
+		yyerror("scheduler weight already set for %s", domain);
+		YYERROR;
+	}
+	weight = xcalloc(1, sizeof *weight);
+	*weight = $4;
+	dict_set(conf->sc_scheduler_weights, domain, weight);
+}
 ;
 
 
@@ -544,6 +592,20 @@ SMTP LIMIT limits_smtp
 	}
 	conf->sc_subaddressing_delim = $3;
 }
+| SMTP WORKERS NUMBER {
+	if ($3 < 1 || $3 > SMTPD_MAXWORKERS) {
+		yyerror("smtp workers must be between 1 and %d",
+		    SMTPD_MAXWORKERS);
+		YYERROR;
+	}
+#ifndef SO_REUSEPORT
+	if ($3 > 1) {
+		yyerror("smtp workers require SO_REUSEPORT");
+		YYERROR;
+	}
+#endif
+	conf->sc_smtp_workers = $3;
+}
 ;
 
 
@@ -2253,7 +2315,9 @@ lookup(char *s)
 		{ "any",		ANY },
 		{ "auth",		AUTH },
 		{ "auth-optional",     	AUTH_OPTIONAL },
+		{ "backend",		BACKEND },
 		{ "backup",		BACKUP },
+		{ "binary-envelopes",	BINARY_ENVELOPES },
 		{ "bounce",		BOUNCE },
 		{ "builtin",		BUILTIN },
 		{ "ca",			CA },
@@ -2279,6 +2343,7 @@ lookup(char *s)
 		{ "forward-only",      	FORWARD_ONLY },
 		{ "from",		FROM },
 		{ "group",		GROUP },
+		{ "group-commit",	GROUP_COMMIT },
 		{ "helo",		HELO },
 		{ "helo-src",       	HELO_SRC },
 		{ "host",		HOST },
@@ -2342,6 +2407,8 @@ lookup(char *s)
 		{ "verify",		VERIFY },
 		{ "virtual",		VIRTUAL },
 		{ "warn-interval",	WARN_INTERVAL },
+		{ "weight",		WEIGHT },
+		{ "workers",		WORKERS },
 		{ "wrapper",		WRAPPER },
 	};
 	const struct keywords	*p;
@@ -2746,6 +2813,12 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 		errors++;
 	}
 
+	/* each smtp worker has at most one key operation in flight */
+	if (conf->sc_ca_workers > conf->sc_smtp_workers)
+		log_warnx("warn: ca workers (%zu) beyond smtp workers (%zu) "
+		    "will be idle", conf->sc_ca_workers,
+		    conf->sc_smtp_workers);
+
 	if (errors) {
 		purge_config(PURGE_EVERYTHING);
 		return (-1);
@@ -104,6 +104,7 @@ pony_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_CTL_SMTP_SESSION:
 	case IMSG_CTL_PAUSE_SMTP:
 	case IMSG_CTL_RESUME_SMTP:
+	case IMSG_SMTP_TLS_TICKET_KEY:
 		smtp_imsg(p, imsg);
 		return;
 
@@ -143,6 +144,35 @@ pony_imsg(struct mproc *p, struct imsg *imsg)
 	errx(1, "session_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
 }
 
+/*
+ * Session ids issued by a worker carry its index in the low bits, so
+ * that the lka and queue processes can route replies back to it.
+ */
+uint64_t
+pony_uid(void)
+{
+	uint64_t	uid;
+
+	do {
+		uid = generate_uid() & ~(uint64_t)(SMTPD_MAXWORKERS - 1);
+		uid |= pony_worker;
+	} while (uid == 0);
+
+	return (uid);
+}
+
+struct mproc *
+pony_peer(uint64_t reqid)
+{
+	size_t	n;
+
+	n = reqid & (SMTPD_MAXWORKERS - 1);
+	if (n >= pony_nworkers)
+		fatalx("pony_peer: no worker for reqid %016"PRIx64, reqid);
+
+	return (p_ponies[n]);
+}
+
 static void
 pony_shutdown(void)
 {
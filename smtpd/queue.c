@@ -44,6 +44,10 @@
 #include "smtpd.h"
 #include "log.h"
 
+#define	QUEUE_DISCOVER_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE - sizeof(size_t)) / \
+	    sizeof(struct scheduler_info))
+
 static void queue_imsg(struct mproc *, struct imsg *);
 static void queue_timeout(int, short, void *);
 static void queue_bounce(struct envelope *, struct delivery_bounce *);
@@ -57,6 +61,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct delivery_bounce	 bounce;
 	struct msg_walkinfo	*wi;
+	struct mproc		*p_reply;
 	struct timeval		 tv;
 	struct bounce_req_msg	*req_bounce;
 	struct envelope		 evp;
@@ -65,7 +70,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 	uint64_t		 reqid, evpid, holdq;
 	uint32_t		 msgid;
 	time_t			 nexttry;
-	size_t			 n_evp;
+	size_t			 n_evp, sz;
 	int			 fd, mta_ext, ret, v, flags, code;
 
 	if (imsg == NULL)
@@ -156,15 +161,16 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			log_warnx("warn: imsg_queue_submit_envelope: msgid=0, "
 			    "evpid=%016"PRIx64, evp.id);
 		ret = queue_envelope_create(&evp);
-		m_create(p_pony, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-		m_add_id(p_pony, reqid);
+		p_reply = pony_peer(reqid);
+		m_create(p_reply, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
+		m_add_id(p_reply, reqid);
 		if (ret == 0)
-			m_add_int(p_pony, 0);
+			m_add_int(p_reply, 0);
 		else {
-			m_add_int(p_pony, 1);
-			m_add_evpid(p_pony, evp.id);
+			m_add_int(p_reply, 1);
+			m_add_evpid(p_reply, evp.id);
 		}
-		m_close(p_pony);
+		m_close(p_reply);
 		if (ret) {
 			m_create(p_scheduler,
 			    IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
@@ -177,10 +183,11 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
 		m_end(&m);
-		m_create(p_pony, IMSG_QUEUE_ENVELOPE_COMMIT, 0, 0, -1);
-		m_add_id(p_pony, reqid);
-		m_add_int(p_pony, 1);
-		m_close(p_pony);
+		p_reply = pony_peer(reqid);
+		m_create(p_reply, IMSG_QUEUE_ENVELOPE_COMMIT, 0, 0, -1);
+		m_add_id(p_reply, reqid);
+		m_add_int(p_reply, 1);
+		m_close(p_reply);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_REMOVE:
@@ -327,6 +334,16 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_id(&m, &reqid);
 		m_get_msgid(&m, &msgid);
 		m_end(&m);
+		/* the mta reads the body once, front to back */
+		if (imsg->hdr.type == IMSG_MTA_OPEN_MESSAGE) {
+			sz = 0;
+			fd = queue_message_fd_r_stream(msgid, &sz);
+			m_create(p, imsg->hdr.type, 0, 0, fd);
+			m_add_id(p, reqid);
+			m_add_size(p, sz);
+			m_close(p);
+			return;
+		}
 		fd = queue_message_fd_r(msgid);
 		m_create(p, imsg->hdr.type, 0, 0, fd);
 		m_add_id(p, reqid);
@@ -634,7 +651,7 @@ queue(void)
 			fatalx("unknown user " SMTPD_USER);
 
 	env->sc_queue_flags |= QUEUE_EVPCACHE;
-	env->sc_queue_evpcache_size = 1024;
+	env->sc_queue_evpcache_size = 8 * 1024 * 1024;
 
 	if (chroot(env->sc_queue_directory) == -1)
 		fatal("queue: chroot");
@@ -686,51 +703,54 @@ queue(void)
 	return (0);
 }
 
+/*
+ * Load the queue into the scheduler at startup.  Envelopes are walked in
+ * batches, one batch per event loop pass so that the queue keeps serving
+ * other requests, and each batch is sent to the scheduler as an array of
+ * scheduler_info in a single imsg.  The walk is not split across threads:
+ * backends offer a single walk cursor, and the fs backend and the
+ * envelope cache update their trees unlocked as envelopes are loaded.
+ */
 static void
 queue_timeout(int fd, short event, void *p)
 {
-	static uint32_t	 msgid = 0;
-	struct dispatcher *dsp;
-	struct envelope	 evp;
-	struct event	*ev = p;
-	struct timeval	 tv;
-	int		 r;
-
-	r = queue_envelope_walk(&evp);
-	if (r == -1) {
-		if (msgid) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
-		}
-		log_debug("debug: queue: done loading queue into scheduler");
-		return;
-	}
-
-	if (r) {
+	struct scheduler_info	 si[QUEUE_DISCOVER_MAX];
+	struct dispatcher	*dsp;
+	struct envelope		 evp;
+	struct event		*ev = p;
+	struct timeval		 tv;
+	size_t			 n;
+	int			 r = 0;
+
+	for (n = 0; n < QUEUE_DISCOVER_MAX; ) {
+		if ((r = queue_envelope_walk(&evp)) == -1)
+			break;
+		if (r == 0)
+			continue;
 		dsp = dict_get(env->sc_dispatchers, evp.dispatcher);
 		if (dsp == NULL) {
 			log_warnx("warn: queue: missing dispatcher \"%s\""
 			    " for envelope %016"PRIx64", ignoring",
 			    evp.dispatcher, evp.id);
-			goto reset;
+			continue;
 		}
-		if (msgid && evpid_to_msgid(evp.id) != msgid) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
-		}
-		msgid = evpid_to_msgid(evp.id);
-		m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
+		scheduler_info(&si[n++], &evp);
+	}
+
+	if (n) {
+		m_create(p_scheduler, IMSG_QUEUE_DISCOVER, 0, 0, -1);
+		m_add_data(p_scheduler, si, n * sizeof(si[0]));
 		m_close(p_scheduler);
+		stat_increment("queue.discover", n);
+	}
+
+	if (r == -1) {
+		log_debug("debug: queue: done loading queue into scheduler");
+		return;
 	}
 
-reset:
 	tv.tv_sec = 0;
-	tv.tv_usec = 10;
+	tv.tv_usec = 0;
 	evtimer_add(ev, &tv);
 }
 
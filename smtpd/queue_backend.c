@@ -42,22 +42,48 @@
 
 #include "smtpd.h"
 #include "log.h"
+#include "iobuf.h"
+
+#define	QUEUE_STREAM_BUFSZ	65536
 
 static const char* envelope_validate(struct envelope *);
 
 extern struct queue_backend	queue_backend_fs;
+extern struct queue_backend	queue_backend_log;
 extern struct queue_backend	queue_backend_null;
 extern struct queue_backend	queue_backend_proc;
 extern struct queue_backend	queue_backend_ram;
 
+static void queue_envelope_cache_init(void);
+static struct envelope *queue_envelope_cache_get(uint64_t);
 static void queue_envelope_cache_add(struct envelope *);
 static void queue_envelope_cache_update(struct envelope *);
 static void queue_envelope_cache_del(uint64_t evpid);
 
-TAILQ_HEAD(evplst, envelope);
-
-static struct tree		evpcache_tree;
-static struct evplst		evpcache_list;
+/*
+ * The envelope cache is a fixed array of envelope slots, sized from
+ * sc_queue_evpcache_size bytes, indexed by an open addressing hash
+ * table with linear probing.  Eviction is done with a clock over the
+ * slots, a hit only sets the slot reference bit.  The slots of a message
+ * are chained from the msgs tree, so they can be dropped on rollback.
+ */
+struct evpcache {
+	struct envelope	*slots;
+	uint64_t	*keys;		/* evpid in slot, 0 if free */
+	uint8_t		*ref;
+	uint32_t	*table;		/* slot + 1, 0 if empty */
+	uint32_t	*free;
+	uint32_t	*next;		/* slot + 1 in the message chain */
+	uint32_t	*prev;
+	struct tree	 msgs;		/* msgid -> first slot + 1 */
+	size_t		 nslots;
+	size_t		 nfree;
+	size_t		 mask;
+	int		 shift;
+	size_t		 hand;
+};
+
+static struct evpcache		evpcache;
 static struct queue_backend	*backend;
 
 static int (*handler_close)(void);
@@ -112,6 +138,242 @@ queue_message_path(uint32_t msgid, char *buf, size_t len)
 	return bsnprintf(buf, len, "%s/%08"PRIx32, PATH_TEMPORARY, msgid);
 }
 
+/*
+ * Chain of stream transforms applied to message contents: compression
+ * then encryption when encoding, the reverse when decoding.  Data is
+ * pushed through write(arg, ...) and comes out at the sink.
+ */
+struct queue_stream {
+	int	(*write)(void *, const void *, size_t);
+	void	 *arg;
+	void	 *cs;
+	void	 *zs;
+	int	  encode;
+};
+
+struct queue_reader {
+	struct event		 ev;
+	uint32_t		 msgid;
+	int			 fd;
+	FILE			*ifp;
+	struct queue_stream	 qs;
+	struct iobuf		 iobuf;
+	int			 held;
+	char			 last;
+};
+
+static int
+queue_stream_open(struct queue_stream *qs, int encode,
+    int (*sink)(void *, const void *, size_t), void *arg)
+{
+	memset(qs, 0, sizeof *qs);
+	qs->encode = encode;
+	qs->write = sink;
+	qs->arg = arg;
+
+	if (encode && env->sc_queue_flags & QUEUE_ENCRYPTION) {
+		if ((qs->cs = crypto_stream_open(1, qs->write, qs->arg)) == NULL)
+			return (0);
+		qs->write = crypto_stream_write;
+		qs->arg = qs->cs;
+	}
+
+	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
+		if (encode)
+			qs->zs = compress_stream_open(qs->write, qs->arg);
+		else
+			qs->zs = uncompress_stream_open(qs->write, qs->arg);
+		if (qs->zs == NULL)
+			goto err;
+		qs->write = compress_stream_write;
+		qs->arg = qs->zs;
+	}
+
+	if (!encode && env->sc_queue_flags & QUEUE_ENCRYPTION) {
+		if ((qs->cs = crypto_stream_open(0, qs->write, qs->arg)) == NULL)
+			goto err;
+		qs->write = crypto_stream_write;
+		qs->arg = qs->cs;
+	}
+
+	return (1);
+
+err:
+	if (qs->zs)
+		compress_stream_close(qs->zs);
+	if (qs->cs)
+		crypto_stream_close(qs->cs);
+	return (0);
+}
+
+/*
+ * Flush and release every stage, outermost first so that trailing
+ * output reaches the next stage before it is finalized.
+ */
+static int
+queue_stream_close(struct queue_stream *qs)
+{
+	int	ret = 1;
+
+	if (qs->encode) {
+		if (qs->zs && !compress_stream_close(qs->zs))
+			ret = 0;
+		if (qs->cs && !crypto_stream_close(qs->cs))
+			ret = 0;
+	}
+	else {
+		if (qs->cs && !crypto_stream_close(qs->cs))
+			ret = 0;
+		if (qs->zs && !compress_stream_close(qs->zs))
+			ret = 0;
+	}
+	qs->cs = NULL;
+	qs->zs = NULL;
+
+	return (ret);
+}
+
+static int
+queue_stream_copy(struct queue_stream *qs, FILE *ifp)
+{
+	char	buf[QUEUE_STREAM_BUFSZ];
+	size_t	n;
+	int	ret = 1;
+
+	while ((n = fread(buf, 1, sizeof buf, ifp)) != 0)
+		if (!qs->write(qs->arg, buf, n)) {
+			ret = 0;
+			break;
+		}
+	if (ferror(ifp))
+		ret = 0;
+
+	if (!queue_stream_close(qs))
+		ret = 0;
+
+	return (ret);
+}
+
+static int
+queue_stream_fwrite(void *arg, const void *buf, size_t len)
+{
+	return (fwrite(buf, 1, len, arg) == len);
+}
+
+/*
+ * Queue decoded data for the reader, always holding back the last byte:
+ * it is only released once the whole message has been authenticated,
+ * so a message that fails verification never reaches its announced
+ * size.
+ */
+static int
+queue_reader_sink(void *arg, const void *buf, size_t len)
+{
+	struct queue_reader	*r = arg;
+
+	if (len == 0)
+		return (1);
+	if (r->held && iobuf_queue(&r->iobuf, &r->last, 1) == -1)
+		return (0);
+	if (len > 1 && iobuf_queue(&r->iobuf, buf, len - 1) == -1)
+		return (0);
+	r->last = ((const char *)buf)[len - 1];
+	r->held = 1;
+
+	return (1);
+}
+
+/*
+ * Read the plaintext message once and push it through the enabled
+ * transforms down to ofp.
+ */
+static int
+queue_message_encode(FILE *ifp, FILE *ofp)
+{
+	struct queue_stream	qs;
+
+	if (!queue_stream_open(&qs, 1, queue_stream_fwrite, ofp))
+		return (0);
+
+	return (queue_stream_copy(&qs, ifp));
+}
+
+static int
+queue_message_decode(FILE *ifp, FILE *ofp)
+{
+	struct queue_stream	qs;
+
+	if (!queue_stream_open(&qs, 0, queue_stream_fwrite, ofp))
+		return (0);
+
+	return (queue_stream_copy(&qs, ifp));
+}
+
+static void
+queue_reader_free(struct queue_reader *r)
+{
+	if (event_initialized(&r->ev))
+		event_del(&r->ev);
+	if (r->ifp) {
+		queue_stream_close(&r->qs);
+		fclose(r->ifp);
+	}
+	close(r->fd);
+	iobuf_clear(&r->iobuf);
+	free(r);
+	stat_decrement("queue.reader", 1);
+}
+
+/*
+ * The pipe can take more data: decode input chunks until enough is
+ * pending, then write as much as the reader accepts.
+ */
+static void
+queue_reader_io(int fd, short event, void *arg)
+{
+	struct queue_reader	*r = arg;
+	char			 buf[QUEUE_STREAM_BUFSZ];
+	size_t			 n;
+	ssize_t			 w;
+
+	while (r->ifp && iobuf_queued(&r->iobuf) < QUEUE_STREAM_BUFSZ) {
+		n = fread(buf, 1, sizeof buf, r->ifp);
+		if (n && !r->qs.write(r->qs.arg, buf, n))
+			goto fail;
+		if (n)
+			continue;
+		if (ferror(r->ifp) || !queue_stream_close(&r->qs))
+			goto fail;
+		fclose(r->ifp);
+		r->ifp = NULL;
+		if (r->held && iobuf_queue(&r->iobuf, &r->last, 1) == -1)
+			goto fail;
+	}
+
+	if (iobuf_queued(&r->iobuf)) {
+		w = iobuf_write(&r->iobuf, r->fd);
+		if (w == IOBUF_CLOSED || w == IOBUF_ERROR) {
+			log_trace(TRACE_QUEUE, "queue-backend: reader %08"PRIx32
+			    " closed by peer", r->msgid);
+			queue_reader_free(r);
+			return;
+		}
+	}
+
+	if (r->ifp == NULL && iobuf_queued(&r->iobuf) == 0) {
+		queue_reader_free(r);
+		return;
+	}
+
+	event_add(&r->ev, NULL);
+	return;
+
+fail:
+	log_warnx("warn: queue-backend: failed to decode message %08"PRIx32,
+	    r->msgid);
+	queue_reader_free(r);
+}
+
 int
 queue_init(const char *name, int server)
 {
@@ -127,11 +389,10 @@ queue_init(const char *name, int server)
 	if (gr == NULL)
 		errx(1, "unknown group %s", SMTPD_QUEUE_GROUP);
 
-	tree_init(&evpcache_tree);
-	TAILQ_INIT(&evpcache_list);
-
 	if (!strcmp(name, "fs"))
 		backend = &queue_backend_fs;
+	else if (!strcmp(name, "log"))
+		backend = &queue_backend_log;
 	else if (!strcmp(name, "null"))
 		backend = &queue_backend_null;
 	else if (!strcmp(name, "ram"))
@@ -194,10 +455,9 @@ queue_message_create(uint32_t *msgid)
 int
 queue_message_delete(uint32_t msgid)
 {
-	char	msgpath[PATH_MAX];
-	uint64_t evpid;
-	void   *iter;
-	int	r;
+	char		msgpath[PATH_MAX];
+	uintptr_t	slot;
+	int		r;
 
 	profile_enter("queue_message_delete");
 	r = handler_message_delete(msgid);
@@ -208,15 +468,8 @@ queue_message_delete(uint32_t msgid)
 	unlink(msgpath);
 
 	/* remove remaining envelopes from the cache if any (on rollback) */
-	evpid = msgid_to_evpid(msgid);
-	for (;;) {
-		iter = NULL;
-		if (!tree_iterfrom(&evpcache_tree, &iter, evpid, &evpid, NULL))
-			break;
-		if (evpid_to_msgid(evpid) != msgid)
-			break;
-		queue_envelope_cache_del(evpid);
-	}
+	while ((slot = (uintptr_t)tree_get(&evpcache.msgs, msgid)))
+		queue_envelope_cache_del(evpcache.keys[slot - 1]);
 
 	log_trace(TRACE_QUEUE,
 	    "queue-backend: queue_message_delete(%08"PRIx32") -> %d", msgid, r);
@@ -237,39 +490,25 @@ queue_message_commit(uint32_t msgid)
 
 	queue_message_path(msgid, msgpath, sizeof(msgpath));
 
-	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.comp", msgpath);
+	/*
+	 * compression and encryption are chained in a single pass so
+	 * the message is only rewritten once, whichever are enabled.
+	 */
+	if (env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)) {
+		bsnprintf(tmppath, sizeof tmppath, "%s.enc", msgpath);
 		ifp = fopen(msgpath, "r");
 		ofp = fopen(tmppath, "w+");
 		if (ifp == NULL || ofp == NULL)
 			goto err;
-		if (!compress_file(ifp, ofp))
+		if (!queue_message_encode(ifp, ofp))
 			goto err;
 		fclose(ifp);
-		fclose(ofp);
 		ifp = NULL;
-		ofp = NULL;
-
-		if (rename(tmppath, msgpath) == -1) {
-			if (errno == ENOSPC)
-				return (0);
+		if (fclose(ofp) == EOF) {
+			ofp = NULL;
 			unlink(tmppath);
-			log_warn("rename");
-			return (0);
-		}
-	}
-
-	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.enc", msgpath);
-		ifp = fopen(msgpath, "r");
-		ofp = fopen(tmppath, "w+");
-		if (ifp == NULL || ofp == NULL)
 			goto err;
-		if (!crypto_encrypt_file(ifp, ofp))
-			goto err;
-		fclose(ifp);
-		fclose(ofp);
-		ifp = NULL;
+		}
 		ofp = NULL;
 
 		if (rename(tmppath, msgpath) == -1) {
@@ -296,18 +535,65 @@ queue_message_commit(uint32_t msgid)
 err:
 	if (ifp)
 		fclose(ifp);
-	if (ofp)
+	if (ofp) {
 		fclose(ofp);
+		unlink(tmppath);
+	}
 	return 0;
 }
 
-int
-queue_message_fd_r(uint32_t msgid)
+/*
+ * Decode the message read from fdin into a temporary file, and return
+ * a descriptor to it.
+ */
+static int
+queue_message_decode_fd(int fdin)
 {
-	int	fdin = -1, fdout = -1, fd = -1;
+	int	fdout = -1, fd = -1;
 	FILE	*ifp = NULL;
 	FILE	*ofp = NULL;
 
+	if ((fdout = mktmpfile()) == -1)
+		goto err;
+	if ((fd = dup(fdout)) == -1)
+		goto err;
+	if ((ifp = fdopen(fdin, "r")) == NULL)
+		goto err;
+	fdin = fd;
+	fd = -1;
+	if ((ofp = fdopen(fdout, "w+")) == NULL)
+		goto err;
+
+	if (!queue_message_decode(ifp, ofp))
+		goto err;
+
+	fclose(ifp);
+	ifp = NULL;
+	fclose(ofp);
+	ofp = NULL;
+	lseek(fdin, 0, SEEK_SET);
+
+	return (fdin);
+
+err:
+	if (fd != -1)
+		close(fd);
+	if (fdin != -1)
+		close(fdin);
+	if (fdout != -1 && ofp == NULL)
+		close(fdout);
+	if (ifp)
+		fclose(ifp);
+	if (ofp)
+		fclose(ofp);
+	return -1;
+}
+
+int
+queue_message_fd_r(uint32_t msgid)
+{
+	int	fdin;
+
 	profile_enter("queue_message_fd_r");
 	fdin = handler_message_fd_r(msgid);
 	profile_leave();
@@ -318,64 +604,146 @@ queue_message_fd_r(uint32_t msgid)
 	if (fdin == -1)
 		return (-1);
 
-	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		if ((fdout = mktmpfile()) == -1)
-			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
+	if (env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION))
+		return (queue_message_decode_fd(fdin));
 
-		if (!crypto_decrypt_file(ifp, ofp))
-			goto err;
+	return (fdin);
+}
 
-		fclose(ifp);
-		ifp = NULL;
-		fclose(ofp);
-		ofp = NULL;
-		lseek(fdin, SEEK_SET, 0);
-	}
+/*
+ * Find the size of the decoded message from the trailers of the encoded
+ * one, without decoding it: encryption adds a header and a tag of fixed
+ * size, and the compressed stream records the size at its end.
+ *
+ * The gzip trailer only holds the size modulo 2^32, and the compressed
+ * length says nothing about the plaintext length, so it is only trusted
+ * when messages are limited well below 4GB.  The margin leaves room for
+ * the headers added to accepted messages and for bounces carrying a
+ * whole message.
+ */
+static int
+queue_message_decoded_size(int fd, size_t *sizep)
+{
+	struct stat	sb;
+	char		tail[16];
+	off_t		len;
+
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+		return (0);
+	len = sb.st_size;
+
+	if (env->sc_queue_flags & QUEUE_ENCRYPTION)
+		if ((len = crypto_decrypted_size(len)) == -1)
+			return (0);
 
 	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
-		if ((fdout = mktmpfile()) == -1)
-			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
+		if (env->sc_maxsize > UINT32_MAX / 2)
+			return (0);
+		if (len < (off_t)sizeof tail)
+			return (0);
+		if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
+			if (!crypto_decrypt_at(fd, len - sizeof tail, tail,
+			    sizeof tail))
+				return (0);
+		}
+		else if (pread(fd, tail, sizeof tail, len - sizeof tail) !=
+		    sizeof tail)
+			return (0);
+		return (uncompress_stream_size(tail, sizeof tail, sizep));
+	}
 
-		if (!uncompress_file(ifp, ofp))
-			goto err;
+	*sizep = len;
+	return (1);
+}
 
-		fclose(ifp);
-		ifp = NULL;
-		fclose(ofp);
-		ofp = NULL;
-		lseek(fdin, SEEK_SET, 0);
+/*
+ * Like queue_message_fd_r(), but the size of the message is returned
+ * along with the fd, and when the queue is compressed or encrypted the
+ * plaintext is never materialized: the caller gets the read end of a
+ * pipe which is fed by the decoder, in a single pass, as it drains.
+ * The last byte is only written once the message is authenticated, so
+ * a reader must treat a message shorter than its size as an error.
+ * The fd is not seekable and must not be consumed from within this
+ * process.
+ */
+int
+queue_message_fd_r_stream(uint32_t msgid, size_t *sizep)
+{
+	struct queue_reader	*r = NULL;
+	struct stat		 sb;
+	FILE			*ifp = NULL;
+	int			 fd, fdin, fds[2];
+
+	if ((env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)) == 0) {
+		if ((fd = queue_message_fd_r(msgid)) == -1)
+			return (-1);
+		if (fstat(fd, &sb) == -1) {
+			close(fd);
+			return (-1);
+		}
+		*sizep = sb.st_size;
+		return (fd);
 	}
 
-	return (fdin);
+	profile_enter("queue_message_fd_r");
+	fdin = handler_message_fd_r(msgid);
+	profile_leave();
 
-err:
-	if (fd != -1)
-		close(fd);
-	if (fdin != -1)
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_message_fd_r_stream(%08"PRIx32") -> %d",
+	    msgid, fdin);
+
+	if (fdin == -1)
+		return (-1);
+
+	/* size unknown, fall back to decoding it whole */
+	if (!queue_message_decoded_size(fdin, sizep)) {
+		if ((fd = queue_message_decode_fd(fdin)) == -1)
+			return (-1);
+		if (fstat(fd, &sb) == -1) {
+			close(fd);
+			return (-1);
+		}
+		*sizep = sb.st_size;
+		return (fd);
+	}
+
+	if ((ifp = fdopen(fdin, "r")) == NULL) {
 		close(fdin);
-	if (fdout != -1)
-		close(fdout);
-	if (ifp)
-		fclose(ifp);
-	if (ofp)
-		fclose(ofp);
-	return -1;
+		return (-1);
+	}
+
+	if (pipe(fds) == -1) {
+		log_warn("warn: queue-backend: pipe");
+		goto err;
+	}
+	if (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		goto err;
+	}
+
+	r = xcalloc(1, sizeof *r);
+	r->msgid = msgid;
+	r->fd = fds[1];
+	r->ifp = ifp;
+	stat_increment("queue.reader", 1);
+	if (!queue_stream_open(&r->qs, 0, queue_reader_sink, r)) {
+		r->ifp = NULL;
+		queue_reader_free(r);
+		close(fds[0]);
+		goto err;
+	}
+
+	event_set(&r->ev, r->fd, EV_WRITE, queue_reader_io, r);
+	event_add(&r->ev, NULL);
+
+	return (fds[0]);
+
+err:
+	fclose(ifp);
+	return (-1);
 }
 
 int
@@ -399,7 +767,10 @@ queue_envelope_dump_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	char	encbuf[sizeof(struct envelope)];
 
 	evp = evpbuf;
-	evplen = envelope_dump_buffer(ep, evpbuf, evpbufsize);
+	if (env->sc_queue_flags & QUEUE_BINARY)
+		evplen = envelope_dump_binary(ep, evpbuf, evpbufsize);
+	else
+		evplen = envelope_dump_buffer(ep, evpbuf, evpbufsize);
 	if (evplen == 0)
 		return (0);
 
@@ -424,7 +795,7 @@ queue_envelope_dump_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	return (evplen);
 }
 
-static int
+int
 queue_envelope_load_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 {
 	char		*evp;
@@ -456,18 +827,121 @@ queue_envelope_load_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	return (envelope_load_buffer(ep, evp, evplen));
 }
 
+static void
+queue_envelope_cache_init(void)
+{
+	size_t	n, size;
+
+	n = env->sc_queue_evpcache_size / (sizeof(struct envelope) +
+	    sizeof(uint64_t) + sizeof(uint8_t) + 5 * sizeof(uint32_t));
+	if (n == 0)
+		n = 1;
+	if (n > UINT32_MAX / 2)
+		n = UINT32_MAX / 2;
+
+	/* keep the table at most half full */
+	evpcache.shift = 64;
+	for (size = 1; size < 2 * n; size <<= 1)
+		evpcache.shift--;
+
+	evpcache.slots = xcalloc(n, sizeof(*evpcache.slots));
+	evpcache.keys = xcalloc(n, sizeof(*evpcache.keys));
+	evpcache.ref = xcalloc(n, sizeof(*evpcache.ref));
+	evpcache.free = xcalloc(n, sizeof(*evpcache.free));
+	evpcache.next = xcalloc(n, sizeof(*evpcache.next));
+	evpcache.prev = xcalloc(n, sizeof(*evpcache.prev));
+	evpcache.table = xcalloc(size, sizeof(*evpcache.table));
+	evpcache.nslots = n;
+	evpcache.mask = size - 1;
+	for (evpcache.nfree = 0; evpcache.nfree < n; evpcache.nfree++)
+		evpcache.free[evpcache.nfree] = n - evpcache.nfree - 1;
+
+	log_debug("debug: queue: envelope cache of %zu entries", n);
+}
+
+static size_t
+queue_envelope_cache_hash(uint64_t evpid)
+{
+	if (evpcache.shift == 64)
+		return (0);
+	return ((evpid * 0x9e3779b97f4a7c15ULL) >> evpcache.shift);
+}
+
+/* return the table position for evpid, or of the empty bucket ending its chain */
+static size_t
+queue_envelope_cache_lookup(uint64_t evpid)
+{
+	size_t	i;
+
+	for (i = queue_envelope_cache_hash(evpid); evpcache.table[i];
+	    i = (i + 1) & evpcache.mask)
+		if (evpcache.keys[evpcache.table[i] - 1] == evpid)
+			break;
+	return (i);
+}
+
+static struct envelope *
+queue_envelope_cache_get(uint64_t evpid)
+{
+	size_t	i, slot;
+
+	if (evpcache.nslots == 0)
+		return (NULL);
+
+	i = queue_envelope_cache_lookup(evpid);
+	if (evpcache.table[i] == 0)
+		return (NULL);
+	slot = evpcache.table[i] - 1;
+	evpcache.ref[slot] = 1;
+
+	return (&evpcache.slots[slot]);
+}
+
 static void
 queue_envelope_cache_add(struct envelope *e)
 {
-	struct envelope *cached;
+	size_t		i, slot;
+	uint32_t	msgid;
+	uintptr_t	head;
+
+	if (evpcache.nslots == 0)
+		queue_envelope_cache_init();
+
+	i = queue_envelope_cache_lookup(e->id);
+	if (evpcache.table[i]) {
+		slot = evpcache.table[i] - 1;
+		evpcache.slots[slot] = *e;
+		evpcache.ref[slot] = 1;
+		return;
+	}
+
+	while (evpcache.nfree == 0) {
+		slot = evpcache.hand;
+		evpcache.hand = (evpcache.hand + 1) % evpcache.nslots;
+		if (evpcache.ref[slot]) {
+			evpcache.ref[slot] = 0;
+			continue;
+		}
+		queue_envelope_cache_del(evpcache.keys[slot]);
+		stat_increment("queue.evpcache.evict", 1);
+	}
 
-	while (tree_count(&evpcache_tree) >= env->sc_queue_evpcache_size)
-		queue_envelope_cache_del(TAILQ_LAST(&evpcache_list, evplst)->id);
+	/* the chain may have moved on removal */
+	i = queue_envelope_cache_lookup(e->id);
+	slot = evpcache.free[--evpcache.nfree];
+	evpcache.slots[slot] = *e;
+	evpcache.keys[slot] = e->id;
+	evpcache.ref[slot] = 0;
+	evpcache.table[i] = slot + 1;
+
+	msgid = evpid_to_msgid(e->id);
+	head = (uintptr_t)tree_get(&evpcache.msgs, msgid);
+	evpcache.prev[slot] = 0;
+	evpcache.next[slot] = head;
+	if (head)
+		evpcache.prev[head - 1] = slot + 1;
+	tree_set(&evpcache.msgs, msgid, (void *)(uintptr_t)(slot + 1));
 
-	cached = xcalloc(1, sizeof *cached);
-	*cached = *e;
-	TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
-	tree_xset(&evpcache_tree, e->id, cached);
 	stat_increment("queue.evpcache.size", 1);
 }
 
@@ -476,13 +950,11 @@ queue_envelope_cache_update(struct envelope *e)
 {
 	struct envelope *cached;
 
-	if ((cached = tree_get(&evpcache_tree, e->id)) == NULL) {
+	if ((cached = queue_envelope_cache_get(e->id)) == NULL) {
 		queue_envelope_cache_add(e);
 		stat_increment("queue.evpcache.update.missed", 1);
 	} else {
-		TAILQ_REMOVE(&evpcache_list, cached, entry);
 		*cached = *e;
-		TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
 		stat_increment("queue.evpcache.update.hit", 1);
 	}
 }
@@ -490,13 +962,45 @@ queue_envelope_cache_update(struct envelope *e)
 static void
 queue_envelope_cache_del(uint64_t evpid)
 {
-	struct envelope *cached;
+	size_t		i, j, h, slot;
+	uint32_t	next, prev;
+
+	if (evpcache.nslots == 0)
+		return;
 
-	if ((cached = tree_pop(&evpcache_tree, evpid)) == NULL)
+	i = queue_envelope_cache_lookup(evpid);
+	if (evpcache.table[i] == 0)
 		return;
+	slot = evpcache.table[i] - 1;
+	evpcache.table[i] = 0;
+	evpcache.keys[slot] = 0;
+	evpcache.free[evpcache.nfree++] = slot;
+
+	next = evpcache.next[slot];
+	prev = evpcache.prev[slot];
+	if (next)
+		evpcache.prev[next - 1] = prev;
+	if (prev)
+		evpcache.next[prev - 1] = next;
+	else if (next)
+		tree_set(&evpcache.msgs, evpid_to_msgid(evpid),
+		    (void *)(uintptr_t)next);
+	else
+		tree_xpop(&evpcache.msgs, evpid_to_msgid(evpid));
+
+	/* shift back the entries of the chain that follow the hole */
+	for (j = (i + 1) & evpcache.mask; evpcache.table[j];
+	    j = (j + 1) & evpcache.mask) {
+		h = queue_envelope_cache_hash(
+		    evpcache.keys[evpcache.table[j] - 1]);
+		if ((j > i && (h <= i || h > j)) ||
+		    (j < i && h <= i && h > j)) {
+			evpcache.table[i] = evpcache.table[j];
+			evpcache.table[j] = 0;
+			i = j;
+		}
+	}
 
-	TAILQ_REMOVE(&evpcache_list, cached, entry);
-	free(cached);
 	stat_decrement("queue.evpcache.size", 1);
 }
 
@@ -564,7 +1068,7 @@ queue_envelope_load(uint64_t evpid, struct envelope *ep)
 	struct envelope	*cached;
 
 	if ((env->sc_queue_flags & QUEUE_EVPCACHE) &&
-	    (cached = tree_get(&evpcache_tree, evpid))) {
+	    (cached = queue_envelope_cache_get(evpid))) {
 		*ep = *cached;
 		stat_increment("queue.evpcache.load.hit", 1);
 		return (1);
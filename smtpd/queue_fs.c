@@ -45,6 +45,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "smtpd.h"
 #include "log.h"
@@ -53,6 +54,11 @@
 #define PATH_INCOMING		"/incoming"
 #define PATH_EVPTMP		PATH_INCOMING "/envelope.tmp"
 #define PATH_MESSAGE		"/message"
+#define PATH_JOURNAL		"/journal"
+#define PATH_JOURNALTMP		"/journal.tmp"
+
+/* size of the journal after which updated envelopes are synced */
+#define	JOURNAL_CHECKPOINT	(4 * 1024 * 1024)
 
 /* percentage of remaining space / inodes required to accept new messages */
 #define	MINSPACE		5
@@ -63,6 +69,17 @@ struct qwalk {
 	int	 depth;
 };
 
+struct journal_record {
+	uint64_t	evpid;
+	uint32_t	len;
+	uint32_t	crc;
+};
+
+struct journal_update {
+	char		*buf;
+	size_t		 len;
+};
+
 static int	fsqueue_check_space(void);
 static void	fsqueue_envelope_path(uint64_t, char *, size_t);
 static void	fsqueue_envelope_incoming_path(uint64_t, char *, size_t);
@@ -72,10 +89,35 @@ static void	fsqueue_message_incoming_path(uint32_t, char *, size_t);
 static void    *fsqueue_qwalk_new(void);
 static int	fsqueue_qwalk(void *, uint64_t *);
 static void	fsqueue_qwalk_close(void *);
+static void	fsqueue_journal_open(int);
+static void	fsqueue_journal_replay(FILE *);
+static int	fsqueue_journal_append(uint64_t, const char *, size_t);
+static void	fsqueue_journal_flush(int, short, void *);
+static void	fsqueue_journal_materialize(int);
+static void	fsqueue_journal_checkpoint(void);
+static void	fsqueue_sync_dir(const char *);
 
 struct tree evpcount;
 static struct timespec startup;
 
+/*
+ * In group-commit mode, envelope updates are appended to a journal
+ * which is synced once per commit window.  The output of the process is
+ * held until then, so an update is not acknowledged before it is
+ * durable.  Updates are kept in memory, and the envelope files are only
+ * rewritten, without fsync, once the journal holds a durable copy; they
+ * are synced in bulk at checkpoint time.  Until then, the journal is
+ * what survives a crash.
+ */
+static struct {
+	FILE		*fp;
+	struct event	 ev;
+	int		 pending;
+	size_t		 size;
+	struct tree	 staged;
+	struct tree	 dirty;
+} journal;
+
 #define REF	(int*)0xf00
 
 static int
@@ -256,9 +298,21 @@ done:
 static int
 queue_fs_envelope_load(uint64_t evpid, char *buf, size_t len)
 {
-	char	 pathname[PATH_MAX];
-	FILE	*fp;
-	size_t	 r;
+	struct journal_update	*u;
+	char			 pathname[PATH_MAX];
+	FILE			*fp;
+	size_t			 r;
+
+	/* not yet written to the envelope file */
+	if (journal.fp && (u = tree_get(&journal.staged, evpid))) {
+		if (u->len >= len) {
+			log_warnx("warn: queue-fs: too large");
+			return (0);
+		}
+		memcpy(buf, u->buf, u->len);
+		buf[u->len] = '\0';
+		return (u->len);
+	}
 
 	fsqueue_envelope_path(evpid, pathname, sizeof(pathname));
 
@@ -290,21 +344,38 @@ queue_fs_envelope_update(uint64_t evpid, const char *buf, size_t len)
 
 	fsqueue_envelope_path(evpid, dest, sizeof(dest));
 
-	return (fsqueue_envelope_dump(dest, buf, len, 1, 1));
+	if (journal.fp == NULL)
+		return (fsqueue_envelope_dump(dest, buf, len, 1, 1));
+
+	if (!fsqueue_journal_append(evpid, buf, len)) {
+		/* the journal was reset, make this update durable by hand */
+		return (fsqueue_envelope_dump(dest, buf, len, 1, 1));
+	}
+
+	return (1);
 }
 
 static int
 queue_fs_envelope_delete(uint64_t evpid)
 {
-	char		pathname[PATH_MAX];
-	uint32_t	msgid;
-	int		*n;
+	struct journal_update	*u;
+	char			pathname[PATH_MAX];
+	uint32_t		msgid;
+	int			*n;
 
 	fsqueue_envelope_path(evpid, pathname, sizeof(pathname));
 	if (unlink(pathname) == -1)
 		if (errno != ENOENT)
 			return 0;
 
+	if (journal.fp) {
+		if ((u = tree_pop(&journal.staged, evpid))) {
+			free(u->buf);
+			free(u);
+		}
+		tree_pop(&journal.dirty, evpid);
+	}
+
 	msgid = evpid_to_msgid(evpid);
 	n = tree_pop(&evpcount, msgid);
 	n -= 1;
@@ -649,6 +720,250 @@ fsqueue_qwalk(void *hdl, uint64_t *evpid)
 	return (0);
 }
 
+static void
+fsqueue_journal_open(int enable)
+{
+	char	path[PATH_MAX];
+	FILE   *fp;
+
+	(void)strlcpy(path, env->sc_queue_directory, sizeof(path));
+	if (strlcat(path, PATH_JOURNAL, sizeof(path)) >= sizeof(path))
+		errx(1, "path too long %s%s", env->sc_queue_directory,
+		    PATH_JOURNAL);
+
+	/* left over from a previous run, possibly in group-commit mode */
+	if ((fp = fopen(path, enable ? "a+" : "r")) == NULL) {
+		if (errno != ENOENT)
+			err(1, "queue-fs: fopen: %s", path);
+		return;
+	}
+
+	if (fseek(fp, 0, SEEK_SET) == -1)
+		err(1, "queue-fs: fseek: %s", path);
+	fsqueue_journal_replay(fp);
+
+	if (!enable) {
+		fclose(fp);
+		if (unlink(path) == -1)
+			err(1, "queue-fs: unlink: %s", path);
+		return;
+	}
+
+	if (ftruncate(fileno(fp), 0) == -1)
+		err(1, "queue-fs: ftruncate: %s", path);
+	journal.fp = fp;
+	tree_init(&journal.staged);
+	tree_init(&journal.dirty);
+
+	log_debug("debug: queue-fs: group commit enabled, window %zums",
+	    env->sc_queue_commit_window);
+}
+
+/*
+ * Rewrite and sync every envelope that still exists from the journal,
+ * records are applied in order so the last update wins.  A truncated
+ * or corrupted record marks the end of what was synced.  Everything
+ * rewritten is on disk before the caller gets to discard the journal.
+ */
+static void
+fsqueue_journal_replay(FILE *fp)
+{
+	struct journal_record	rec;
+	char			buf[sizeof(struct envelope)];
+	char			path[PATH_MAX];
+	char			tmp[PATH_MAX];
+	struct stat		sb;
+	FILE		       *ofp;
+	size_t			n = 0;
+
+	if (!bsnprintf(tmp, sizeof tmp, "%s%s", env->sc_queue_directory,
+		PATH_JOURNALTMP))
+		errx(1, "fsqueue_journal_replay: path does not fit buffer");
+
+	while (fread(&rec, sizeof rec, 1, fp) == 1) {
+		if (rec.len == 0 || rec.len > sizeof buf)
+			break;
+		if (fread(buf, 1, rec.len, fp) != rec.len)
+			break;
+		if (crc32(crc32(0L, Z_NULL, 0), (unsigned char *)buf, rec.len)
+		    != rec.crc)
+			break;
+
+		if (!bsnprintf(path, sizeof path, "%s%s/%02x/%08x/%016"PRIx64,
+			env->sc_queue_directory, PATH_QUEUE,
+			(evpid_to_msgid(rec.evpid) & 0xff000000) >> 24,
+			evpid_to_msgid(rec.evpid), rec.evpid))
+			errx(1, "fsqueue_journal_replay: path does not fit buffer");
+
+		/* envelope was removed since */
+		if (stat(path, &sb) == -1)
+			continue;
+
+		if ((ofp = fopen(tmp, "w")) == NULL)
+			err(1, "queue-fs: fopen: %s", tmp);
+		if (fwrite(buf, 1, rec.len, ofp) != rec.len)
+			err(1, "queue-fs: fwrite: %s", tmp);
+		if (fflush(ofp) == EOF || fsync(fileno(ofp)) == -1)
+			err(1, "queue-fs: fsync: %s", tmp);
+		if (!safe_fclose(ofp))
+			errx(1, "queue-fs: could not write %s", tmp);
+		if (rename(tmp, path) == -1)
+			err(1, "queue-fs: rename: %s", path);
+		fsqueue_sync_dir(path);
+		n++;
+	}
+
+	if (n)
+		log_info("info: queue-fs: %zu envelope(s) recovered from journal",
+		    n);
+}
+
+static int
+fsqueue_journal_append(uint64_t evpid, const char *buf, size_t len)
+{
+	struct journal_record	rec;
+	struct journal_update	*u;
+	struct timeval		tv;
+
+	memset(&rec, 0, sizeof rec);
+	rec.evpid = evpid;
+	rec.len = len;
+	rec.crc = crc32(crc32(0L, Z_NULL, 0), (const unsigned char *)buf, len);
+
+	if (fwrite(&rec, 1, sizeof rec, journal.fp) != sizeof rec ||
+	    fwrite(buf, 1, len, journal.fp) != len) {
+		log_warn("warn: queue-fs: journal write");
+		clearerr(journal.fp);
+		fsqueue_journal_checkpoint();
+		return (0);
+	}
+	journal.size += sizeof rec + len;
+
+	if ((u = tree_get(&journal.staged, evpid)) == NULL) {
+		u = xcalloc(1, sizeof *u);
+		tree_xset(&journal.staged, evpid, u);
+	}
+	free(u->buf);
+	u->buf = xmemdup(buf, len);
+	u->len = len;
+
+	if (!journal.pending) {
+		if (!event_initialized(&journal.ev))
+			evtimer_set(&journal.ev, fsqueue_journal_flush, NULL);
+		tv.tv_sec = env->sc_queue_commit_window / 1000;
+		tv.tv_usec = (env->sc_queue_commit_window % 1000) * 1000;
+		evtimer_add(&journal.ev, &tv);
+		journal.pending = 1;
+		/* nothing goes out until the journal has the update */
+		mproc_hold();
+	}
+
+	return (1);
+}
+
+static void
+fsqueue_journal_flush(int fd, short event, void *arg)
+{
+	journal.pending = 0;
+
+	if (fflush(journal.fp) || fsync(fileno(journal.fp)))
+		fatal("queue-fs: journal sync");
+	stat_increment("queue.fs.journal.sync", 1);
+	mproc_release();
+
+	/* the journal now has them, the envelope files can follow */
+	fsqueue_journal_materialize(0);
+
+	if (journal.size >= JOURNAL_CHECKPOINT)
+		fsqueue_journal_checkpoint();
+}
+
+/*
+ * Write the staged updates to their envelope files, unless the envelope
+ * was removed meanwhile.  A failure is fatal: the update was already
+ * acknowledged and only the journal, replayed on restart, still has it.
+ */
+static void
+fsqueue_journal_materialize(int do_sync)
+{
+	struct journal_update	*u;
+	struct stat		 sb;
+	char			 path[PATH_MAX];
+	uint64_t		 evpid;
+
+	while (tree_poproot(&journal.staged, &evpid, (void **)&u)) {
+		fsqueue_envelope_path(evpid, path, sizeof(path));
+		if (stat(path, &sb) == 0) {
+			if (!fsqueue_envelope_dump(path, u->buf, u->len, 1,
+			    do_sync))
+				fatalx("queue-fs: could not write envelope "
+				    "%016"PRIx64, evpid);
+			if (!do_sync)
+				tree_set(&journal.dirty, evpid, NULL);
+		}
+		free(u->buf);
+		free(u);
+	}
+}
+
+/*
+ * Make the envelope files durable on their own, after which the
+ * journal can be discarded.  Updates still staged may not have a synced
+ * journal record yet, so they are written with fsync.
+ */
+static void
+fsqueue_journal_checkpoint(void)
+{
+	fsqueue_journal_materialize(1);
+
+#ifdef HAVE_SYNCFS
+	if (syncfs(fileno(journal.fp)) == -1)
+		fatal("queue-fs: syncfs");
+#else
+	char		 path[PATH_MAX];
+	uint64_t	 evpid;
+	void		*iter = NULL;
+	int		 fd;
+
+	while (tree_iter(&journal.dirty, &iter, &evpid, NULL)) {
+		fsqueue_envelope_path(evpid, path, sizeof(path));
+		if ((fd = open(path, O_RDONLY)) == -1)
+			continue;
+		if (fsync(fd) == -1)
+			fatal("queue-fs: fsync");
+		close(fd);
+	}
+#endif
+	while (tree_poproot(&journal.dirty, NULL, NULL))
+		;
+
+	if (fflush(journal.fp) == EOF)
+		clearerr(journal.fp);
+	if (ftruncate(fileno(journal.fp), 0) == -1)
+		fatal("queue-fs: journal truncate");
+	journal.size = 0;
+	stat_increment("queue.fs.journal.checkpoint", 1);
+}
+
+static void
+fsqueue_sync_dir(const char *path)
+{
+	char	dir[PATH_MAX];
+	char   *p;
+	int	fd;
+
+	(void)strlcpy(dir, path, sizeof(dir));
+	if ((p = strrchr(dir, '/')) == NULL)
+		return;
+	*p = '\0';
+
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+		err(1, "queue-fs: open: %s", dir);
+	if (fsync(fd) == -1)
+		err(1, "queue-fs: fsync: %s", dir);
+	close(fd);
+}
+
 static int
 queue_fs_init(struct passwd *pw, int server, const char *conf)
 {
@@ -677,6 +992,9 @@ queue_fs_init(struct passwd *pw, int server, const char *conf)
 			ret = 0;
 	}
 
+	if (server)
+		fsqueue_journal_open(env->sc_queue_flags & QUEUE_GROUPCOMMIT);
+
 	if (clock_gettime(CLOCK_REALTIME, &startup))
 		err(1, "clock_gettime");
 
@@ -0,0 +1,974 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Log-structured queue backend.
+ *
+ * Envelopes are not stored one per file but as records appended to a
+ * sequence of segment files under /log.  An in-memory index maps each
+ * evpid to the offset of its latest record, and is rebuilt at startup
+ * by replaying the segments in order.  Message contents are still kept
+ * one file per message.
+ *
+ * Records are: an envelope (create or update), an envelope removal, a
+ * message commit and a message removal.  Envelopes belonging to a
+ * message for which no commit record was seen are discarded on replay.
+ *
+ * Segments that are mostly dead are periodically compacted by appending
+ * their live records to the active segment and unlinking them.  Removal
+ * records are carried over as well unless no older segment is left for
+ * them to refer to.  A msgid is not reused as long as records of its
+ * previous message may remain in the log.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define PATH_LOG		"/log"
+#define PATH_LOG_MESSAGE	"message"
+#define PATH_LOG_SEGMENT	"segment."
+
+#define	SEGMENT_MAX		(16 * 1024 * 1024)
+#define	COMPACT_INTERVAL	60
+/* compact a segment when less than this percentage of it is live */
+#define	COMPACT_RATIO		50
+
+enum qlog_type {
+	QLOG_ENVELOPE = 1,
+	QLOG_ENVELOPE_DELETE,
+	QLOG_MESSAGE_COMMIT,
+	QLOG_MESSAGE_DELETE,
+};
+
+struct qlog_record {
+	uint64_t	id;
+	uint32_t	type;
+	uint32_t	len;
+	uint32_t	crc;
+	uint32_t	reserved;
+};
+
+struct qlog_segment {
+	uint32_t	id;
+	int		fd;
+	off_t		size;
+	off_t		live;
+};
+
+struct qlog_envelope {
+	uint32_t	segment;
+	uint32_t	len;
+	off_t		offset;
+};
+
+struct qlog_message {
+	int		committed;
+	uint32_t	segment;	/* of the commit record */
+	size_t		nevp;
+};
+
+static int	qlog_segment_open(uint32_t, int);
+static void	qlog_segment_roll(void);
+static void	qlog_segment_remove(struct qlog_segment *);
+static int	qlog_append(uint32_t, uint64_t, const char *, size_t, off_t *);
+static void	qlog_sync(int);
+static void	qlog_sync_cb(int, short, void *);
+static void	qlog_replay(struct qlog_segment *, int);
+static void	qlog_compact(int, short, void *);
+static int	qlog_compact_segment(struct qlog_segment *, int);
+static void	qlog_compact_schedule(void);
+static void	qlog_message_path(uint32_t, char *, size_t);
+static void	qlog_message_drop(uint32_t, struct qlog_message *);
+static void	qlog_message_dead(uint32_t);
+static void	qlog_dead_prune(void);
+static void	qlog_envelope_drop(uint64_t);
+static int	qlog_envelope_read(struct qlog_envelope *, char *, size_t);
+
+static int			 logfd = -1;
+static struct tree		 segments;
+static struct tree		 envelopes;
+static struct tree		 messages;
+static struct tree		 dead;	/* msgid -> segment of its last record */
+static struct qlog_segment	*active;
+static struct event		 ev_sync;
+static struct event		 ev_compact;
+static int			 sync_pending;
+
+static int
+queue_log_message_create(uint32_t *msgid)
+{
+	struct qlog_message	*msg;
+	char			 path[PATH_MAX];
+	struct stat		 sb;
+
+	do {
+		*msgid = queue_generate_msgid();
+		qlog_message_path(*msgid, path, sizeof(path));
+	} while (tree_check(&messages, *msgid) || tree_check(&dead, *msgid) ||
+	    fstatat(logfd, path, &sb, 0) == 0);
+
+	msg = xcalloc(1, sizeof *msg);
+	tree_xset(&messages, *msgid, msg);
+
+	return (1);
+}
+
+static int
+queue_log_message_commit(uint32_t msgid, const char *path)
+{
+	struct qlog_message	*msg;
+	char			 msgpath[PATH_MAX];
+	char			 bucket[PATH_MAX];
+
+	if ((msg = tree_get(&messages, msgid)) == NULL) {
+		log_warnx("warn: queue-log: msgid not found");
+		return (0);
+	}
+
+	qlog_message_path(msgid, msgpath, sizeof(msgpath));
+	if (renameat(AT_FDCWD, path, logfd, msgpath) == -1) {
+		if (errno != ENOENT) {
+			log_warn("warn: queue-log: rename");
+			return (0);
+		}
+
+		/* create the bucket */
+		(void)strlcpy(bucket, msgpath, sizeof(bucket));
+		*strrchr(bucket, '/') = '\0';
+		if (mkdirat(logfd, bucket, 0700) == -1 && errno != EEXIST) {
+			log_warn("warn: queue-log: mkdir");
+			return (0);
+		}
+		if (renameat(AT_FDCWD, path, logfd, msgpath) == -1) {
+			log_warn("warn: queue-log: rename");
+			return (0);
+		}
+	}
+
+	if (!qlog_append(QLOG_MESSAGE_COMMIT, msgid, NULL, 0, NULL)) {
+		unlinkat(logfd, msgpath, 0);
+		return (0);
+	}
+	msg->committed = 1;
+	msg->segment = active->id;
+	active->live += sizeof(struct qlog_record);
+
+	qlog_sync(0);
+
+	return (1);
+}
+
+static int
+queue_log_message_delete(uint32_t msgid)
+{
+	struct qlog_message	*msg;
+	char			 path[PATH_MAX];
+
+	if ((msg = tree_get(&messages, msgid)) == NULL)
+		return (1);
+
+	/* an aborted message may have left envelope records too */
+	if ((msg->committed || msg->nevp) &&
+	    !qlog_append(QLOG_MESSAGE_DELETE, msgid, NULL, 0, NULL))
+		return (0);
+	tree_xpop(&messages, msgid);
+
+	if (msg->committed) {
+		qlog_message_path(msgid, path, sizeof(path));
+		if (unlinkat(logfd, path, 0) == -1 && errno != ENOENT)
+			log_warn("warn: queue-log: unlink");
+	}
+	qlog_message_dead(msgid);
+	qlog_message_drop(msgid, msg);
+
+	return (1);
+}
+
+static int
+queue_log_message_fd_r(uint32_t msgid)
+{
+	char	path[PATH_MAX];
+	int	fd;
+
+	qlog_message_path(msgid, path, sizeof(path));
+	if ((fd = openat(logfd, path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-log: open");
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+queue_log_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	struct qlog_message	*msg;
+	struct qlog_envelope	*evp;
+	off_t			 offset;
+
+	if ((msg = tree_get(&messages, msgid)) == NULL) {
+		log_warnx("warn: queue-log: msgid not found");
+		return (0);
+	}
+
+	do {
+		*evpid = queue_generate_evpid(msgid);
+	} while (tree_check(&envelopes, *evpid));
+
+	if (!qlog_append(QLOG_ENVELOPE, *evpid, buf, len, &offset))
+		return (0);
+
+	evp = xcalloc(1, sizeof *evp);
+	evp->segment = active->id;
+	evp->offset = offset;
+	evp->len = len;
+	tree_xset(&envelopes, *evpid, evp);
+	active->live += sizeof(struct qlog_record) + len;
+	msg->nevp += 1;
+
+	/* envelopes of a queued message are durable right away */
+	if (msg->committed)
+		qlog_sync(0);
+
+	return (1);
+}
+
+static int
+queue_log_envelope_delete(uint64_t evpid)
+{
+	struct qlog_message	*msg;
+	uint32_t		 msgid;
+
+	if (!tree_check(&envelopes, evpid))
+		return (1);
+
+	if (!qlog_append(QLOG_ENVELOPE_DELETE, evpid, NULL, 0, NULL))
+		return (0);
+	qlog_envelope_drop(evpid);
+
+	msgid = evpid_to_msgid(evpid);
+	if ((msg = tree_get(&messages, msgid)) == NULL)
+		return (1);
+	if (--msg->nevp == 0)
+		queue_log_message_delete(msgid);
+
+	return (1);
+}
+
+static int
+queue_log_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	struct qlog_envelope	*evp;
+	struct qlog_segment	*seg;
+	off_t			 offset;
+
+	if ((evp = tree_get(&envelopes, evpid)) == NULL) {
+		log_warnx("warn: queue-log: evpid not found");
+		return (0);
+	}
+
+	if (!qlog_append(QLOG_ENVELOPE, evpid, buf, len, &offset))
+		return (0);
+
+	if ((seg = tree_get(&segments, evp->segment)) != NULL)
+		seg->live -= sizeof(struct qlog_record) + evp->len;
+	evp->segment = active->id;
+	evp->offset = offset;
+	evp->len = len;
+	active->live += sizeof(struct qlog_record) + len;
+
+	qlog_sync(0);
+
+	return (1);
+}
+
+static int
+queue_log_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct qlog_envelope	*evp;
+
+	if ((evp = tree_get(&envelopes, evpid)) == NULL)
+		return (0);
+
+	return (qlog_envelope_read(evp, buf, len));
+}
+
+/*
+ * Walks resume from the last evpid returned rather than from a tree
+ * position, the index may change between two calls.
+ */
+static int
+queue_log_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	static uint64_t		 next = 0;
+	static int		 done = 0;
+	struct qlog_envelope	*evp;
+	void			*iter;
+
+	if (done)
+		return (-1);
+
+	iter = NULL;
+	if (!tree_iterfrom(&envelopes, &iter, next, evpid, (void **)&evp)) {
+		done = 1;
+		return (-1);
+	}
+	next = *evpid + 1;
+	if (next == 0)
+		done = 1;
+
+	memset(buf, 0, len);
+	return (qlog_envelope_read(evp, buf, len));
+}
+
+static int
+queue_log_message_walk(uint64_t *evpid, char *buf, size_t len,
+    uint32_t msgid, int *done, void **data)
+{
+	struct qlog_envelope	*evp;
+	uint64_t		*next = *data;
+	void			*iter;
+
+	if (*done)
+		return (-1);
+
+	if (next == NULL) {
+		next = xmalloc(sizeof *next);
+		*next = msgid_to_evpid(msgid);
+		*data = next;
+	}
+
+	iter = NULL;
+	if (!tree_iterfrom(&envelopes, &iter, *next, evpid, (void **)&evp) ||
+	    evpid_to_msgid(*evpid) != msgid) {
+		free(next);
+		*data = NULL;
+		*done = 1;
+		return (-1);
+	}
+	*next = *evpid + 1;
+
+	memset(buf, 0, len);
+	return (qlog_envelope_read(evp, buf, len));
+}
+
+static int
+qlog_envelope_read(struct qlog_envelope *evp, char *buf, size_t len)
+{
+	struct qlog_segment	*seg;
+	ssize_t			 n;
+
+	if (evp->len >= len) {
+		log_warnx("warn: queue-log: too large");
+		return (0);
+	}
+
+	seg = tree_xget(&segments, evp->segment);
+	n = pread(seg->fd, buf, evp->len, evp->offset);
+	if (n == -1) {
+		log_warn("warn: queue-log: pread");
+		return (0);
+	}
+	if (n != evp->len) {
+		log_warnx("warn: queue-log: short read");
+		return (0);
+	}
+	buf[n] = '\0';
+
+	return (n);
+}
+
+static void
+qlog_envelope_drop(uint64_t evpid)
+{
+	struct qlog_envelope	*evp;
+	struct qlog_segment	*seg;
+
+	if ((evp = tree_pop(&envelopes, evpid)) == NULL)
+		return;
+	if ((seg = tree_get(&segments, evp->segment)) != NULL)
+		seg->live -= sizeof(struct qlog_record) + evp->len;
+	free(evp);
+}
+
+static void
+qlog_message_drop(uint32_t msgid, struct qlog_message *msg)
+{
+	struct qlog_segment	*seg;
+	uint64_t		 evpid;
+	void			*iter;
+
+	for (;;) {
+		iter = NULL;
+		if (!tree_iterfrom(&envelopes, &iter, msgid_to_evpid(msgid),
+		    &evpid, NULL))
+			break;
+		if (evpid_to_msgid(evpid) != msgid)
+			break;
+		qlog_envelope_drop(evpid);
+	}
+
+	if (msg->committed &&
+	    (seg = tree_get(&segments, msg->segment)) != NULL)
+		seg->live -= sizeof(struct qlog_record);
+	free(msg);
+}
+
+static void
+qlog_message_dead(uint32_t msgid)
+{
+	tree_set(&dead, msgid, (void *)(uintptr_t)active->id);
+}
+
+/*
+ * Forget the dead msgids whose records were all in segments that have
+ * since been removed.
+ */
+static void
+qlog_dead_prune(void)
+{
+	struct qlog_segment	*seg;
+	uint64_t		 msgid, next;
+	void			*iter, *data;
+
+	if (!tree_root(&segments, NULL, (void **)&seg))
+		return;
+
+	for (next = 0;; next = msgid + 1) {
+		iter = NULL;
+		if (!tree_iterfrom(&dead, &iter, next, &msgid, &data))
+			break;
+		if ((uintptr_t)data < seg->id)
+			tree_xpop(&dead, msgid);
+	}
+}
+
+static void
+qlog_message_path(uint32_t msgid, char *buf, size_t len)
+{
+	if (!bsnprintf(buf, len, "%s/%02x/%08x",
+		PATH_LOG_MESSAGE,
+		(msgid & 0xff000000) >> 24,
+		msgid))
+		fatalx("qlog_message_path: path does not fit buffer");
+}
+
+static int
+qlog_append(uint32_t type, uint64_t id, const char *buf, size_t len,
+    off_t *offset)
+{
+	struct qlog_record	rec;
+#ifdef HAVE_PWRITEV
+	struct iovec		iov[2];
+#else
+	char		       *p;
+#endif
+	ssize_t			n;
+
+	if (active->size >= SEGMENT_MAX)
+		qlog_segment_roll();
+
+	memset(&rec, 0, sizeof rec);
+	rec.id = id;
+	rec.type = type;
+	rec.len = len;
+	rec.crc = crc32(crc32(0L, Z_NULL, 0), (const unsigned char *)&rec,
+	    sizeof rec);
+	if (len)
+		rec.crc = crc32(rec.crc, (const unsigned char *)buf, len);
+
+#ifdef HAVE_PWRITEV
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof rec;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	n = pwritev(active->fd, iov, len ? 2 : 1, active->size);
+#else
+	/* a single write, as with pwritev(2) */
+	p = xmalloc(sizeof rec + len);
+	memcpy(p, &rec, sizeof rec);
+	if (len)
+		memcpy(p + sizeof rec, buf, len);
+	n = pwrite(active->fd, p, sizeof rec + len, active->size);
+	free(p);
+#endif
+	if (n != (ssize_t)(sizeof rec + len)) {
+		log_warn("warn: queue-log: write");
+		/* do not leave a partial record behind */
+		if (ftruncate(active->fd, active->size) == -1)
+			fatal("queue-log: ftruncate");
+		return (0);
+	}
+
+	if (offset)
+		*offset = active->size + sizeof rec;
+	active->size += n;
+	stat_increment("queue.log.append", 1);
+
+	/* appends only happen once the event loop is set up */
+	qlog_compact_schedule();
+
+	return (1);
+}
+
+/*
+ * Sync the active segment, right away or at the end of the commit
+ * window when group commit is enabled.  The output of the process is
+ * held meanwhile, so that nothing is acknowledged before the sync.
+ */
+static void
+qlog_sync(int now)
+{
+	struct timeval	tv;
+
+	if (now || !(env->sc_queue_flags & QUEUE_GROUPCOMMIT)) {
+		if (fsync(active->fd) == -1)
+			fatal("queue-log: fsync");
+		if (env->sc_queue_flags & QUEUE_GROUPCOMMIT)
+			mproc_release();
+		return;
+	}
+
+	mproc_hold();
+	if (sync_pending)
+		return;
+	tv.tv_sec = env->sc_queue_commit_window / 1000;
+	tv.tv_usec = (env->sc_queue_commit_window % 1000) * 1000;
+	evtimer_set(&ev_sync, qlog_sync_cb, NULL);
+	if (evtimer_add(&ev_sync, &tv) == -1)
+		fatal("queue-log: evtimer_add");
+	sync_pending = 1;
+}
+
+static void
+qlog_sync_cb(int fd, short event, void *arg)
+{
+	sync_pending = 0;
+	qlog_sync(1);
+}
+
+static int
+qlog_segment_open(uint32_t id, int create)
+{
+	struct qlog_segment	*seg;
+	struct stat		 sb;
+	char			 path[PATH_MAX];
+	int			 fd;
+
+	if (!bsnprintf(path, sizeof path, "%s%08"PRIx32, PATH_LOG_SEGMENT, id))
+		fatalx("qlog_segment_open: path does not fit buffer");
+
+	fd = openat(logfd, path, O_RDWR | (create ? O_CREAT | O_EXCL : 0),
+	    0600);
+	if (fd == -1)
+		return (-1);
+	if (fstat(fd, &sb) == -1)
+		fatal("queue-log: fstat");
+
+	seg = xcalloc(1, sizeof *seg);
+	seg->id = id;
+	seg->fd = fd;
+	seg->size = sb.st_size;
+	tree_xset(&segments, id, seg);
+
+	return (0);
+}
+
+static void
+qlog_segment_roll(void)
+{
+	uint32_t	id;
+
+	qlog_sync(1);
+	id = active->id + 1;
+	if (qlog_segment_open(id, 1) == -1)
+		fatal("queue-log: segment %08"PRIx32, id);
+	active = tree_xget(&segments, id);
+	stat_increment("queue.log.segment", 1);
+}
+
+static void
+qlog_segment_remove(struct qlog_segment *seg)
+{
+	char	path[PATH_MAX];
+
+	if (!bsnprintf(path, sizeof path, "%s%08"PRIx32, PATH_LOG_SEGMENT,
+		seg->id))
+		fatalx("qlog_segment_remove: path does not fit buffer");
+
+	tree_xpop(&segments, seg->id);
+	close(seg->fd);
+	if (unlinkat(logfd, path, 0) == -1)
+		log_warn("warn: queue-log: unlink");
+	free(seg);
+	stat_decrement("queue.log.segment", 1);
+}
+
+/*
+ * Load the records of a segment into the index.  Only the last segment
+ * may end with a partial record, from a crash during an append, and it
+ * is truncated to the last complete one.
+ */
+static void
+qlog_replay(struct qlog_segment *seg, int last)
+{
+	struct qlog_record	 rec;
+	struct qlog_envelope	*evp;
+	struct qlog_message	*msg;
+	struct qlog_segment	*old;
+	char			 buf[sizeof(struct envelope)];
+	uint32_t		 crc, msgid;
+	off_t			 off = 0;
+
+	while (off < seg->size) {
+		if (pread(seg->fd, &rec, sizeof rec, off) != sizeof rec)
+			break;
+		if (rec.len > sizeof buf)
+			break;
+		if (rec.len &&
+		    pread(seg->fd, buf, rec.len, off + sizeof rec) != rec.len)
+			break;
+		crc = rec.crc;
+		rec.crc = 0;
+		rec.crc = crc32(crc32(0L, Z_NULL, 0),
+		    (const unsigned char *)&rec, sizeof rec);
+		if (rec.len)
+			rec.crc = crc32(rec.crc, (unsigned char *)buf, rec.len);
+		if (rec.crc != crc)
+			break;
+
+		switch (rec.type) {
+		case QLOG_ENVELOPE:
+			msgid = evpid_to_msgid(rec.id);
+			if ((msg = tree_get(&messages, msgid)) == NULL) {
+				msg = xcalloc(1, sizeof *msg);
+				tree_xset(&messages, msgid, msg);
+			}
+			if ((evp = tree_get(&envelopes, rec.id)) == NULL) {
+				evp = xcalloc(1, sizeof *evp);
+				tree_xset(&envelopes, rec.id, evp);
+				msg->nevp += 1;
+			}
+			else if ((old = tree_get(&segments, evp->segment)))
+				old->live -= sizeof rec + evp->len;
+			evp->segment = seg->id;
+			evp->offset = off + sizeof rec;
+			evp->len = rec.len;
+			seg->live += sizeof rec + rec.len;
+			break;
+
+		case QLOG_ENVELOPE_DELETE:
+			if (!tree_check(&envelopes, rec.id))
+				break;
+			qlog_envelope_drop(rec.id);
+			msgid = evpid_to_msgid(rec.id);
+			if ((msg = tree_get(&messages, msgid)) &&
+			    --msg->nevp == 0) {
+				qlog_message_dead(msgid);
+				qlog_message_drop(msgid,
+				    tree_xpop(&messages, msgid));
+			}
+			break;
+
+		case QLOG_MESSAGE_COMMIT:
+			msgid = rec.id;
+			if ((msg = tree_get(&messages, msgid)) == NULL) {
+				msg = xcalloc(1, sizeof *msg);
+				tree_xset(&messages, msgid, msg);
+			}
+			msg->committed = 1;
+			msg->segment = seg->id;
+			seg->live += sizeof rec;
+			break;
+
+		case QLOG_MESSAGE_DELETE:
+			msgid = rec.id;
+			qlog_message_dead(msgid);
+			if ((msg = tree_pop(&messages, msgid)))
+				qlog_message_drop(msgid, msg);
+			break;
+
+		default:
+			log_warnx("warn: queue-log: unknown record type %"PRIu32
+			    " in segment %08"PRIx32, rec.type, seg->id);
+			break;
+		}
+
+		off += sizeof rec + rec.len;
+	}
+
+	if (off == seg->size)
+		return;
+
+	if (!last)
+		fatalx("queue-log: segment %08"PRIx32" is corrupted at offset "
+		    "%lld", seg->id, (long long)off);
+
+	log_warnx("warn: queue-log: truncating segment %08"PRIx32" from %lld "
+	    "to %lld bytes", seg->id, (long long)seg->size, (long long)off);
+	if (ftruncate(seg->fd, off) == -1)
+		fatal("queue-log: ftruncate");
+	seg->size = off;
+}
+
+/*
+ * Compact every segment but the active one that is mostly dead, oldest
+ * first.  A mostly live segment does not hold back the ones after it.
+ */
+static void
+qlog_compact(int fd, short event, void *arg)
+{
+	struct qlog_segment	*seg;
+	uint64_t		 id, next;
+	void			*iter;
+	int			 oldest = 1;
+
+	for (next = 0;; next = id + 1) {
+		iter = NULL;
+		if (!tree_iterfrom(&segments, &iter, next, &id, (void **)&seg))
+			break;
+		if (seg == active)
+			break;
+		if (seg->size && seg->live * 100 / seg->size >= COMPACT_RATIO) {
+			oldest = 0;
+			continue;
+		}
+		if (!qlog_compact_segment(seg, oldest)) {
+			log_warnx("warn: queue-log: compaction failed");
+			break;
+		}
+	}
+
+	qlog_dead_prune();
+	qlog_compact_schedule();
+}
+
+/*
+ * Move the live records of a segment to the active one and remove it.
+ * Removal records are dropped only from the oldest segment; elsewhere
+ * they may still shadow records in an older one, and are carried over
+ * unless their target has been created again since.
+ */
+static int
+qlog_compact_segment(struct qlog_segment *seg, int oldest)
+{
+	struct qlog_record	 rec;
+	struct qlog_envelope	*evp;
+	struct qlog_message	*msg;
+	char			 buf[sizeof(struct envelope)];
+	uint64_t		 id;
+	void			*iter;
+	off_t			 offset, off;
+	size_t			 n;
+
+	for (off = 0; !oldest && off < seg->size; off += sizeof rec + rec.len) {
+		if (pread(seg->fd, &rec, sizeof rec, off) != sizeof rec) {
+			log_warn("warn: queue-log: pread");
+			return (0);
+		}
+		switch (rec.type) {
+		case QLOG_ENVELOPE_DELETE:
+			if (tree_check(&envelopes, rec.id))
+				continue;
+			break;
+		case QLOG_MESSAGE_DELETE:
+			if (tree_check(&messages, rec.id))
+				continue;
+			break;
+		default:
+			continue;
+		}
+		if (!qlog_append(rec.type, rec.id, NULL, 0, NULL))
+			return (0);
+	}
+
+	iter = NULL;
+	while (tree_iter(&messages, &iter, &id, (void **)&msg)) {
+		if (!msg->committed || msg->segment != seg->id)
+			continue;
+		if (!qlog_append(QLOG_MESSAGE_COMMIT, id, NULL, 0, NULL))
+			return (0);
+		msg->segment = active->id;
+		active->live += sizeof(struct qlog_record);
+		seg->live -= sizeof(struct qlog_record);
+	}
+
+	n = 0;
+	iter = NULL;
+	while (tree_iter(&envelopes, &iter, &id, (void **)&evp)) {
+		if (evp->segment != seg->id)
+			continue;
+		if (!qlog_envelope_read(evp, buf, sizeof buf) ||
+		    !qlog_append(QLOG_ENVELOPE, id, buf, evp->len, &offset))
+			return (0);
+		evp->segment = active->id;
+		evp->offset = offset;
+		active->live += sizeof(struct qlog_record) + evp->len;
+		seg->live -= sizeof(struct qlog_record) + evp->len;
+		n++;
+	}
+
+	qlog_sync(1);
+	log_debug("debug: queue-log: compacted segment %08"PRIx32
+	    ", %zu envelope(s) moved", seg->id, n);
+	qlog_segment_remove(seg);
+	stat_increment("queue.log.compaction", 1);
+
+	return (1);
+}
+
+static void
+qlog_compact_schedule(void)
+{
+	struct timeval	tv;
+
+	if (event_initialized(&ev_compact) &&
+	    evtimer_pending(&ev_compact, NULL))
+		return;
+
+	tv.tv_sec = COMPACT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_set(&ev_compact, qlog_compact, NULL);
+	if (evtimer_add(&ev_compact, &tv) == -1)
+		fatal("queue-log: evtimer_add");
+}
+
+static int
+queue_log_init(struct passwd *pw, int server, const char *conf)
+{
+	struct qlog_segment	*seg;
+	struct qlog_message	*msg;
+	struct dirent		*dp;
+	DIR			*dir;
+	char			 path[PATH_MAX];
+	char			*ep;
+	uint32_t		 msgid;
+	uint64_t		 id, segid;
+	void			*iter;
+	size_t			 n;
+	int			 fd;
+
+	(void)strlcpy(path, env->sc_queue_directory, sizeof(path));
+	if (strlcat(path, PATH_LOG, sizeof(path)) >= sizeof(path))
+		errx(1, "path too long %s%s", env->sc_queue_directory, PATH_LOG);
+	if (ckdir(path, 0700, pw->pw_uid, 0, server) == 0)
+		return (0);
+
+	/* everything is reached relative to this, before and after chroot */
+	if ((logfd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+		err(1, "queue-log: open: %s", path);
+	if (server && mkdirat(logfd, PATH_LOG_MESSAGE, 0700) == -1 &&
+	    errno != EEXIST)
+		err(1, "queue-log: mkdir: %s/%s", path, PATH_LOG_MESSAGE);
+
+	tree_init(&segments);
+	tree_init(&envelopes);
+	tree_init(&messages);
+	tree_init(&dead);
+
+	if ((fd = dup(logfd)) == -1 || (dir = fdopendir(fd)) == NULL)
+		err(1, "queue-log: opendir: %s", path);
+	while ((dp = readdir(dir)) != NULL) {
+		if (strncmp(dp->d_name, PATH_LOG_SEGMENT,
+		    strlen(PATH_LOG_SEGMENT)))
+			continue;
+		errno = 0;
+		segid = strtoull(dp->d_name + strlen(PATH_LOG_SEGMENT), &ep, 16);
+		if (*ep != '\0' || errno || segid > UINT32_MAX) {
+			log_debug("debug: queue-log: bogus file %s", dp->d_name);
+			continue;
+		}
+		if (qlog_segment_open(segid, 0) == -1)
+			err(1, "queue-log: open: %s/%s", path, dp->d_name);
+	}
+	closedir(dir);
+
+	/* only the last segment may end with a torn record */
+	n = 0;
+	iter = NULL;
+	while (tree_iter(&segments, &iter, NULL, (void **)&seg)) {
+		active = seg;
+		qlog_replay(seg, ++n == tree_count(&segments));
+	}
+
+	/* envelopes of messages never committed are lost */
+	for (;;) {
+		iter = NULL;
+		msgid = 0;
+		while (tree_iter(&messages, &iter, &id, (void **)&msg))
+			if (!msg->committed) {
+				msgid = id;
+				break;
+			}
+		if (msgid == 0)
+			break;
+		qlog_message_dead(msgid);
+		qlog_message_drop(msgid, tree_xpop(&messages, msgid));
+	}
+
+	if (active == NULL) {
+		if (qlog_segment_open(1, 1) == -1)
+			err(1, "queue-log: segment");
+		active = tree_xget(&segments, 1);
+	}
+
+	log_debug("debug: queue-log: %zu segment(s), %zu message(s), "
+	    "%zu envelope(s)", tree_count(&segments), tree_count(&messages),
+	    tree_count(&envelopes));
+
+	queue_api_on_message_create(queue_log_message_create);
+	queue_api_on_message_commit(queue_log_message_commit);
+	queue_api_on_message_delete(queue_log_message_delete);
+	queue_api_on_message_fd_r(queue_log_message_fd_r);
+	queue_api_on_envelope_create(queue_log_envelope_create);
+	queue_api_on_envelope_delete(queue_log_envelope_delete);
+	queue_api_on_envelope_update(queue_log_envelope_update);
+	queue_api_on_envelope_load(queue_log_envelope_load);
+	queue_api_on_envelope_walk(queue_log_envelope_walk);
+	queue_api_on_message_walk(queue_log_message_walk);
+
+	return (1);
+}
+
+struct queue_backend	queue_backend_log = {
+	queue_log_init,
+};
@@ -69,10 +69,11 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 	struct envelope		 evp;
 	struct scheduler_info	 si;
 	struct msg		 m;
+	const void		*data;
 	uint64_t		 evpid, id, holdq;
 	uint32_t		 msgid;
 	uint32_t       		 inflight;
-	size_t			 n, i;
+	size_t			 n, i, sz;
 	time_t			 timestamp;
 	int			 v, r, type;
 
@@ -104,6 +105,36 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		scheduler_reset_events();
 		return;
 
+	case IMSG_QUEUE_DISCOVER:
+		m_msg(&m, imsg);
+		m_get_data(&m, &data, &sz);
+		m_end(&m);
+		if (sz % sizeof si)
+			fatalx("scheduler: bad discover batch");
+		log_trace(TRACE_SCHEDULER,
+		    "scheduler: discovering %zu envelope(s)", sz / sizeof si);
+		/* envelopes of a message are grouped, commit each group */
+		msgid = 0;
+		for (i = 0; i < sz / sizeof si; i++) {
+			memmove(&si, (const char *)data + i * sizeof si,
+			    sizeof si);
+			if (msgid && evpid_to_msgid(si.evpid) != msgid) {
+				n = backend->commit(msgid);
+				stat_decrement("scheduler.envelope.incoming", n);
+				stat_increment("scheduler.envelope", n);
+			}
+			msgid = evpid_to_msgid(si.evpid);
+			stat_increment("scheduler.envelope.incoming", 1);
+			backend->insert(&si);
+		}
+		if (msgid) {
+			n = backend->commit(msgid);
+			stat_decrement("scheduler.envelope.incoming", n);
+			stat_increment("scheduler.envelope", n);
+		}
+		scheduler_reset_events();
+		return;
+
 	case IMSG_QUEUE_DISCOVER_EVPID:
 		m_msg(&m, imsg);
 		m_get_envelope(&m, &evp);
@@ -39,6 +39,7 @@
 extern struct scheduler_backend scheduler_backend_null;
 extern struct scheduler_backend scheduler_backend_proc;
 extern struct scheduler_backend scheduler_backend_ramqueue;
+extern struct scheduler_backend scheduler_backend_wheel;
 
 struct scheduler_backend *
 scheduler_backend_lookup(const char *name)
@@ -47,6 +48,8 @@ scheduler_backend_lookup(const char *name)
 		return &scheduler_backend_null;
 	if (!strcmp(name, "ramqueue"))
 		return &scheduler_backend_ramqueue;
+	if (!strcmp(name, "wheel"))
+		return &scheduler_backend_wheel;
 
 	return &scheduler_backend_proc;
 }
@@ -79,4 +82,22 @@ scheduler_info(struct scheduler_info *sched, struct envelope *evp)
 	sched->lasttry = evp->lasttry;
 	sched->lastbounce = evp->lastbounce;
 	sched->nexttry	= 0;
+	sched->dest = scheduler_dest(evp->dest.domain);
+}
+
+/*
+ * Hash a destination domain into the key the scheduler uses to share
+ * deliveries fairly between destinations.
+ */
+uint32_t
+scheduler_dest(const char *domain)
+{
+	uint32_t	h = 2166136261U;
+
+	for (; *domain; domain++) {
+		h ^= (unsigned char)tolower((unsigned char)*domain);
+		h *= 16777619U;
+	}
+
+	return (h);
 }
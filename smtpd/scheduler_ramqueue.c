@@ -41,18 +41,40 @@
 
 TAILQ_HEAD(evplist, rq_envelope);
 
+/*
+ * The scheduler may have to track millions of deferred envelopes, so
+ * their representation is kept small.  Envelopes are carved out of slabs
+ * of RQ_SLAB_SIZE entries, times are stored as 32-bit offsets from the
+ * time the scheduler started, and a message keeps its envelopes in a
+ * vector sorted by evpid.  On LP64 this amounts to 80 bytes per
+ * envelope: 72 for the envelope itself and 8 for its slot in the message
+ * vector, against about 180 with malloc'd envelopes in a tree.
+ */
+#define	RQ_SLAB_SIZE		1024
+
 struct rq_message {
 	uint32_t		 msgid;
-	struct tree		 envelopes;
+	uint32_t		 count;
+	uint32_t		 size;
+	struct rq_envelope     **envelopes;
 };
 
 struct rq_envelope {
 	TAILQ_ENTRY(rq_envelope) entry;
-	SPLAY_ENTRY(rq_envelope) t_entry;
+	union {
+		SPLAY_ENTRY(rq_envelope) tree;	/* in q_priotree */
+		uint16_t		 slot;	/* in the wheel */
+	}			 t;
 
 	uint64_t		 evpid;
 	uint64_t		 holdq;
-	enum delivery_type	 type;
+
+	int32_t			 ctime;
+	int32_t			 sched;
+	int32_t			 expire;
+	int32_t			 t_state;	/* inflight or scheduled */
+
+	uint8_t			 type;
 
 #define	RQ_EVPSTATE_PENDING	 0
 #define	RQ_EVPSTATE_SCHEDULED	 1
@@ -67,14 +89,42 @@ struct rq_envelope {
 #define	RQ_ENVELOPE_OVERFLOW	 0x10
 	uint8_t			 flags;
 
-	time_t			 ctime;
-	time_t			 sched;
-	time_t			 expire;
+	uint32_t		 dest;
+};
 
-	struct rq_message	*message;
+/*
+ * MTA envelopes are queued per destination domain, and destinations are
+ * served in deficit round-robin so that a bulk of mail to one domain
+ * does not delay everyone else.
+ */
+struct rq_dest {
+	TAILQ_ENTRY(rq_dest)	 entry;
+	struct evplist		 q;
+	uint32_t		 dest;
+	uint32_t		 weight;
+	uint32_t		 deficit;
+};
+TAILQ_HEAD(destlist, rq_dest);
 
-	time_t			 t_inflight;
-	time_t			 t_scheduled;
+/*
+ * With the wheel backend, pending envelopes are kept in a hierarchical
+ * timing wheel instead of the sorted tree.  The wheel has four levels of
+ * 256 slots, one second per slot on the first level; an envelope is put
+ * on the lowest level whose range covers its next event, and moved down
+ * a level each time the wheel reaches its slot.  Insertion and removal
+ * are O(1), and envelopes whose time has come are moved to a due list.
+ */
+#define	WHEEL_LEVELS	4
+#define	WHEEL_BITS	8
+#define	WHEEL_SIZE	(1 << WHEEL_BITS)
+#define	WHEEL_MASK	(WHEEL_SIZE - 1)
+#define	WHEEL_DUE	0xffff
+
+struct wheel {
+	int32_t			 now;
+	struct evplist		 due;
+	struct evplist		 slots[WHEEL_LEVELS][WHEEL_SIZE];
+	size_t			 count[WHEEL_LEVELS];
 };
 
 struct rq_holdq {
@@ -87,10 +137,11 @@ struct rq_queue {
 	struct tree		 messages;
 	SPLAY_HEAD(prioqtree, rq_envelope)	q_priotree;
 
-	struct evplist		 q_pending;
+	struct evplist		 q_pending;	/* sorted, unless wheel */
 	struct evplist		 q_inflight;
 
-	struct evplist		 q_mta;
+	struct tree		 q_mta;		/* dest -> rq_dest */
+	struct destlist		 q_mta_ring;
 	struct evplist		 q_mda;
 	struct evplist		 q_bounce;
 	struct evplist		 q_update;
@@ -100,8 +151,9 @@ struct rq_queue {
 
 static int rq_envelope_cmp(struct rq_envelope *, struct rq_envelope *);
 
-SPLAY_PROTOTYPE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
+SPLAY_PROTOTYPE(prioqtree, rq_envelope, t.tree, rq_envelope_cmp);
 static int scheduler_ram_init(const char *);
+static int scheduler_wheel_init(const char *);
 static int scheduler_ram_insert(struct scheduler_info *);
 static size_t scheduler_ram_commit(uint32_t);
 static size_t scheduler_ram_rollback(uint32_t);
@@ -119,12 +171,30 @@ static int scheduler_ram_resume(uint64_t);
 static int scheduler_ram_query(uint64_t);
 
 static void sorted_insert(struct rq_queue *, struct rq_envelope *);
+static void pending_remove(struct rq_queue *, struct rq_envelope *);
+static struct rq_envelope *pending_due(struct rq_queue *);
+static time_t pending_next(struct rq_queue *);
+
+static void wheel_init(struct wheel *, int32_t);
+static void wheel_insert(struct wheel *, struct rq_envelope *);
+static void wheel_remove(struct wheel *, struct rq_envelope *);
+static void wheel_advance(struct wheel *, int32_t);
+static int32_t wheel_next(struct wheel *);
+
+static struct rq_envelope *rq_message_get(struct rq_message *, uint64_t);
+static uint32_t rq_message_lookup(struct rq_message *, uint64_t);
+static void rq_message_add(struct rq_message *, struct rq_envelope *);
+static void rq_message_del(struct rq_message *, struct rq_envelope *);
+static void rq_message_merge(struct rq_message *, struct rq_message *);
 
 static void rq_queue_init(struct rq_queue *);
 static void rq_queue_merge(struct rq_queue *, struct rq_queue *);
 static void rq_queue_dump(struct rq_queue *, const char *);
 static void rq_queue_schedule(struct rq_queue *rq);
 static struct evplist *rq_envelope_list(struct rq_queue *, struct rq_envelope *);
+static struct rq_envelope *rq_envelope_alloc(void);
+static struct evplist *rq_mta_queue(struct rq_queue *, struct rq_envelope *);
+static struct rq_envelope *rq_mta_next(struct rq_queue *);
 static void rq_envelope_schedule(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_remove(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_suspend(struct rq_queue *, struct rq_envelope *);
@@ -155,16 +225,59 @@ struct scheduler_backend scheduler_backend_ramqueue = {
 	scheduler_ram_query,
 };
 
+struct scheduler_backend scheduler_backend_wheel = {
+	scheduler_wheel_init,
+
+	scheduler_ram_insert,
+	scheduler_ram_commit,
+	scheduler_ram_rollback,
+
+	scheduler_ram_update,
+	scheduler_ram_delete,
+	scheduler_ram_hold,
+	scheduler_ram_release,
+
+	scheduler_ram_batch,
+
+	scheduler_ram_messages,
+	scheduler_ram_envelopes,
+	scheduler_ram_schedule,
+	scheduler_ram_remove,
+	scheduler_ram_suspend,
+	scheduler_ram_resume,
+	scheduler_ram_query,
+};
+
 static struct rq_queue	ramqueue;
+static struct wheel	*wheel;
 static struct tree	updates;
 static struct tree	holdqs[3]; /* delivery type */
+static struct tree	weights;
 
 static time_t		currtime;
+static time_t		epoch;
+static struct evplist	freelist;
 
 #define BACKOFF_TRANSFER	400
 #define BACKOFF_DELIVERY	10
 #define BACKOFF_OVERFLOW	3
 
+static int32_t
+rq_time(time_t t)
+{
+	if (t - epoch > INT32_MAX)
+		return (INT32_MAX);
+	if (t - epoch < INT32_MIN)
+		return (INT32_MIN);
+	return (t - epoch);
+}
+
+static time_t
+rq_abstime(int32_t t)
+{
+	return (epoch + t);
+}
+
 static time_t
 scheduler_backoff(time_t t0, time_t base, uint32_t step)
 {
@@ -186,6 +299,18 @@ scheduler_next(time_t t0, time_t base, uint32_t step)
 static int
 scheduler_ram_init(const char *arg)
 {
+	const char	*domain;
+	size_t		*weight;
+	void		*iter;
+
+	tree_init(&weights);
+	iter = NULL;
+	while (dict_iter(env->sc_scheduler_weights, &iter, &domain,
+	    (void **)&weight))
+		tree_set(&weights, scheduler_dest(domain), weight);
+
+	epoch = time(NULL);
+	TAILQ_INIT(&freelist);
 	rq_queue_init(&ramqueue);
 	tree_init(&updates);
 	tree_init(&holdqs[D_MDA]);
@@ -195,6 +320,17 @@ scheduler_ram_init(const char *arg)
 	return (1);
 }
 
+static int
+scheduler_wheel_init(const char *arg)
+{
+	scheduler_ram_init(arg);
+
+	wheel = xcalloc(1, sizeof *wheel);
+	wheel_init(wheel, rq_time(epoch));
+
+	return (1);
+}
+
 static int
 scheduler_ram_insert(struct scheduler_info *si)
 {
@@ -219,21 +355,21 @@ scheduler_ram_insert(struct scheduler_info *si)
 	if ((message = tree_get(&update->messages, msgid)) == NULL) {
 		message = xcalloc(1, sizeof *message);
 		message->msgid = msgid;
-		tree_init(&message->envelopes);
 		tree_xset(&update->messages, msgid, message);
 		stat_increment("scheduler.ramqueue.message", 1);
 	}
 
 	/* create envelope in ramqueue message */
-	envelope = xcalloc(1, sizeof *envelope);
+	envelope = rq_envelope_alloc();
 	envelope->evpid = si->evpid;
 	envelope->type = si->type;
-	envelope->message = message;
-	envelope->ctime = si->creation;
-	envelope->expire = si->creation + si->ttl;
-	envelope->sched = scheduler_backoff(si->creation,
-	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
-	tree_xset(&message->envelopes, envelope->evpid, envelope);
+	envelope->dest = si->dest;
+	envelope->ctime = rq_time(si->creation);
+	envelope->expire = rq_time(si->creation + si->ttl);
+	envelope->sched = rq_time(scheduler_backoff(si->creation,
+	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY,
+	    si->retry));
+	rq_message_add(message, envelope);
 
 	update->evpcount++;
 	stat_increment("scheduler.ramqueue.envelope", 1);
@@ -241,7 +377,7 @@ scheduler_ram_insert(struct scheduler_info *si)
 	envelope->state = RQ_EVPSTATE_PENDING;
 	TAILQ_INSERT_TAIL(&update->q_pending, envelope, entry);
 
-	si->nexttry = envelope->sched;
+	si->nexttry = rq_abstime(envelope->sched);
 
 	return (1);
 }
@@ -308,7 +444,8 @@ scheduler_ram_update(struct scheduler_info *si)
 
 	msgid = evpid_to_msgid(si->evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, si->evpid);
+	if ((evp = rq_message_get(msg, si->evpid)) == NULL)
+		errx(1, "evp:%016" PRIx64 " not found", si->evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
@@ -323,18 +460,19 @@ scheduler_ram_update(struct scheduler_info *si)
 	if (evp->flags & RQ_ENVELOPE_REMOVED) {
 		TAILQ_INSERT_TAIL(&ramqueue.q_removed, evp, entry);
 		evp->state = RQ_EVPSTATE_SCHEDULED;
-		evp->t_scheduled = currtime;
+		evp->t_state = rq_time(currtime);
 		return (1);
 	}
 
-	evp->sched = scheduler_next(evp->ctime,
-	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
+	evp->sched = rq_time(scheduler_next(rq_abstime(evp->ctime),
+	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY,
+	    si->retry));
 
 	evp->state = RQ_EVPSTATE_PENDING;
 	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
 		sorted_insert(&ramqueue, evp);
 
-	si->nexttry = evp->sched;
+	si->nexttry = rq_abstime(evp->sched);
 
 	return (1);
 }
@@ -350,7 +488,8 @@ scheduler_ram_delete(uint64_t evpid)
 
 	msgid = evpid_to_msgid(evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, evpid);
+	if ((evp = rq_message_get(msg, evpid)) == NULL)
+		errx(1, "evp:%016" PRIx64 " not found", evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
@@ -377,7 +516,8 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 
 	msgid = evpid_to_msgid(evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, evpid);
+	if ((evp = rq_message_get(msg, evpid)) == NULL)
+		errx(1, "evp:%016" PRIx64 " not found", evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
@@ -523,7 +663,8 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 			else
 				t = BACKOFF_DELIVERY;
 
-			evp->sched = scheduler_next(evp->ctime, t, 0);
+			evp->sched = rq_time(scheduler_next(
+			    rq_abstime(evp->ctime), t, 0));
 			evp->flags &= ~(RQ_ENVELOPE_UPDATE|RQ_ENVELOPE_OVERFLOW);
 			evp->state = RQ_EVPSTATE_PENDING;
 			if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
@@ -540,7 +681,7 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 
 			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
 			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			evp->t_state = rq_time(currtime);
 
 			if (++i == *count)
 				break;
@@ -553,20 +694,19 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 
 			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
 			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			evp->t_state = rq_time(currtime);
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_MTA && (evp = TAILQ_FIRST(&ramqueue.q_mta))) {
-			TAILQ_REMOVE(&ramqueue.q_mta, evp, entry);
+		if (mask & SCHED_MTA && (evp = rq_mta_next(&ramqueue))) {
 			types[i] = SCHED_MTA;
 			evpids[i] = evp->evpid;
 
 			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
 			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			evp->t_state = rq_time(currtime);
 
 			if (++i == *count)
 				break;
@@ -584,13 +724,8 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 		return (1);
 	}
 
-	if ((evp = TAILQ_FIRST(&ramqueue.q_pending))) {
-		if (evp->sched < evp->expire)
-			t = evp->sched;
-		else
-			t = evp->expire;
+	if ((t = pending_next(&ramqueue)) != -1)
 		*delay = (t < currtime) ? 0 : (t - currtime);
-	}
 	else
 		*delay = -1;
 
@@ -618,17 +753,15 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	void			*i;
+	uint32_t		 i;
 	size_t			 n;
 
 	if ((msg = tree_get(&ramqueue.messages, evpid_to_msgid(from))) == NULL)
 		return (0);
 
-	for (n = 0, i = NULL; n < size; ) {
-
-		if (tree_iterfrom(&msg->envelopes, &i, from, NULL,
-		    (void**)&evp) == 0)
-			break;
+	i = rq_message_lookup(msg, from);
+	for (n = 0; n < size && i < msg->count; i++) {
+		evp = msg->envelopes[i];
 
 		if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
 			continue;
@@ -639,20 +772,20 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 		dst[n].time = 0;
 
 		if (evp->state == RQ_EVPSTATE_PENDING) {
-			dst[n].time = evp->sched;
+			dst[n].time = rq_abstime(evp->sched);
 			dst[n].flags = EF_PENDING;
 		}
 		else if (evp->state == RQ_EVPSTATE_SCHEDULED) {
-			dst[n].time = evp->t_scheduled;
+			dst[n].time = rq_abstime(evp->t_state);
 			dst[n].flags = EF_PENDING;
 		}
 		else if (evp->state == RQ_EVPSTATE_INFLIGHT) {
-			dst[n].time = evp->t_inflight;
+			dst[n].time = rq_abstime(evp->t_state);
 			dst[n].flags = EF_INFLIGHT;
 		}
 		else if (evp->state == RQ_EVPSTATE_HELD) {
 			/* same as scheduled */
-			dst[n].time = evp->t_scheduled;
+			dst[n].time = rq_abstime(evp->t_state);
 			dst[n].flags = EF_PENDING;
 			dst[n].flags |= EF_HOLD;
 		}
@@ -670,8 +803,7 @@ scheduler_ram_schedule(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -680,7 +812,7 @@ scheduler_ram_schedule(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (evp->state == RQ_EVPSTATE_INFLIGHT)
 			return (0);
@@ -691,9 +823,9 @@ scheduler_ram_schedule(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp))) {
+		for (i = 0; i < msg->count; i++) {
+			evp = msg->envelopes[i];
 			if (evp->state == RQ_EVPSTATE_INFLIGHT)
 				continue;
 			rq_envelope_schedule(&ramqueue, evp);
@@ -708,8 +840,7 @@ scheduler_ram_remove(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -718,7 +849,7 @@ scheduler_ram_remove(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (rq_envelope_remove(&ramqueue, evp))
 			return (1);
@@ -728,10 +859,9 @@ scheduler_ram_remove(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_remove(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if (rq_envelope_remove(&ramqueue, msg->envelopes[i]))
 				r++;
 		return (r);
 	}
@@ -742,8 +872,7 @@ scheduler_ram_suspend(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -752,7 +881,7 @@ scheduler_ram_suspend(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (rq_envelope_suspend(&ramqueue, evp))
 			return (1);
@@ -762,10 +891,9 @@ scheduler_ram_suspend(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_suspend(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if (rq_envelope_suspend(&ramqueue, msg->envelopes[i]))
 				r++;
 		return (r);
 	}
@@ -776,8 +904,7 @@ scheduler_ram_resume(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -786,7 +913,7 @@ scheduler_ram_resume(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (rq_envelope_resume(&ramqueue, evp))
 			return (1);
@@ -796,10 +923,9 @@ scheduler_ram_resume(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_resume(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if (rq_envelope_resume(&ramqueue, msg->envelopes[i]))
 				r++;
 		return (r);
 	}
@@ -826,6 +952,11 @@ sorted_insert(struct rq_queue *rq, struct rq_envelope *evp)
 {
 	struct rq_envelope	*evp2;
 
+	if (wheel) {
+		wheel_insert(wheel, evp);
+		return;
+	}
+
 	SPLAY_INSERT(prioqtree, &rq->q_priotree, evp);
 	evp2 = SPLAY_NEXT(prioqtree, &rq->q_priotree, evp);
 	if (evp2)
@@ -834,6 +965,318 @@ sorted_insert(struct rq_queue *rq, struct rq_envelope *evp)
 		TAILQ_INSERT_TAIL(&rq->q_pending, evp, entry);
 }
 
+static void
+pending_remove(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	if (wheel) {
+		wheel_remove(wheel, evp);
+		return;
+	}
+
+	TAILQ_REMOVE(&rq->q_pending, evp, entry);
+	SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+}
+
+/*
+ * Return the first pending envelope whose schedule or expiry time has
+ * come, if any.
+ */
+static struct rq_envelope *
+pending_due(struct rq_queue *rq)
+{
+	struct rq_envelope	*evp;
+
+	if (wheel)
+		return (TAILQ_FIRST(&wheel->due));
+
+	if ((evp = TAILQ_FIRST(&rq->q_pending)) == NULL)
+		return (NULL);
+	if (rq_abstime(evp->sched) > currtime &&
+	    rq_abstime(evp->expire) > currtime)
+		return (NULL);
+	return (evp);
+}
+
+/*
+ * Return a time no later than the next pending event, or -1 if there is
+ * none.
+ */
+static time_t
+pending_next(struct rq_queue *rq)
+{
+	struct rq_envelope	*evp;
+	int32_t			 t;
+
+	if (wheel) {
+		if ((t = wheel_next(wheel)) == -1)
+			return (-1);
+		return (rq_abstime(t));
+	}
+
+	if ((evp = TAILQ_FIRST(&rq->q_pending)) == NULL)
+		return (-1);
+	if (evp->sched < evp->expire)
+		return (rq_abstime(evp->sched));
+	return (rq_abstime(evp->expire));
+}
+
+static int32_t
+wheel_key(struct rq_envelope *evp)
+{
+	return (evp->sched < evp->expire) ? evp->sched : evp->expire;
+}
+
+static void
+wheel_init(struct wheel *w, int32_t now)
+{
+	int	l, i;
+
+	w->now = now;
+	TAILQ_INIT(&w->due);
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		for (i = 0; i < WHEEL_SIZE; i++)
+			TAILQ_INIT(&w->slots[l][i]);
+		w->count[l] = 0;
+	}
+}
+
+static void
+wheel_insert(struct wheel *w, struct rq_envelope *evp)
+{
+	int32_t	t;
+	int	l, shift, s;
+
+	t = wheel_key(evp);
+	if (t <= w->now) {
+		evp->t.slot = WHEEL_DUE;
+		TAILQ_INSERT_TAIL(&w->due, evp, entry);
+		return;
+	}
+
+	for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+		shift = l * WHEEL_BITS;
+		if ((t >> shift) - (w->now >> shift) < WHEEL_SIZE)
+			break;
+	}
+	shift = l * WHEEL_BITS;
+	if ((t >> shift) - (w->now >> shift) < WHEEL_SIZE)
+		s = (t >> shift) & WHEEL_MASK;
+	else
+		/* out of range, park it in the farthest slot */
+		s = ((w->now >> shift) + WHEEL_MASK) & WHEEL_MASK;
+
+	evp->t.slot = (l << WHEEL_BITS) | s;
+	TAILQ_INSERT_TAIL(&w->slots[l][s], evp, entry);
+	w->count[l] += 1;
+}
+
+static void
+wheel_remove(struct wheel *w, struct rq_envelope *evp)
+{
+	int	l, s;
+
+	if (evp->t.slot == WHEEL_DUE) {
+		TAILQ_REMOVE(&w->due, evp, entry);
+		return;
+	}
+
+	l = evp->t.slot >> WHEEL_BITS;
+	s = evp->t.slot & WHEEL_MASK;
+	TAILQ_REMOVE(&w->slots[l][s], evp, entry);
+	w->count[l] -= 1;
+}
+
+/*
+ * Move the wheel forward to time t.  When the lower levels are empty,
+ * jump straight to the next boundary of the first non-empty one, so that
+ * a long idle period does not cost one step per second.
+ */
+static void
+wheel_advance(struct wheel *w, int32_t t)
+{
+	struct rq_envelope	*evp;
+	struct evplist		*q;
+	int32_t			 next;
+	int			 l, s;
+
+	while (w->now < t) {
+		for (l = 0; l < WHEEL_LEVELS; l++)
+			if (w->count[l])
+				break;
+		if (l == WHEEL_LEVELS) {
+			w->now = t;
+			break;
+		}
+		if (l > 0) {
+			next = w->now | ((1 << (l * WHEEL_BITS)) - 1);
+			if (next >= t) {
+				w->now = t;
+				break;
+			}
+			w->now = next;
+		}
+
+		w->now += 1;
+
+		/* higher levels first, so that envelopes trickle down */
+		for (l = WHEEL_LEVELS - 1; l > 0; l--) {
+			if (w->now & ((1 << (l * WHEEL_BITS)) - 1))
+				continue;
+			s = (w->now >> (l * WHEEL_BITS)) & WHEEL_MASK;
+			q = &w->slots[l][s];
+			while ((evp = TAILQ_FIRST(q))) {
+				TAILQ_REMOVE(q, evp, entry);
+				w->count[l] -= 1;
+				wheel_insert(w, evp);
+			}
+		}
+
+		q = &w->slots[0][w->now & WHEEL_MASK];
+		while ((evp = TAILQ_FIRST(q))) {
+			TAILQ_REMOVE(q, evp, entry);
+			w->count[0] -= 1;
+			evp->t.slot = WHEEL_DUE;
+			TAILQ_INSERT_TAIL(&w->due, evp, entry);
+		}
+	}
+}
+
+/*
+ * Return a time no later than the next event in the wheel, or -1 if it
+ * is empty.  It is exact on the first level, and the start of the slot
+ * on the others.
+ */
+static int32_t
+wheel_next(struct wheel *w)
+{
+	int32_t	t, best = -1;
+	int	l, k, shift;
+
+	if (!TAILQ_EMPTY(&w->due))
+		return (w->now);
+
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		if (w->count[l] == 0)
+			continue;
+		shift = l * WHEEL_BITS;
+		for (k = 1; k < WHEEL_SIZE; k++) {
+			t = (w->now >> shift) + k;
+			if (TAILQ_EMPTY(&w->slots[l][t & WHEEL_MASK]))
+				continue;
+			t <<= shift;
+			if (best == -1 || t < best)
+				best = t;
+			break;
+		}
+	}
+
+	return (best);
+}
+
+static uint32_t
+rq_message_lookup(struct rq_message *msg, uint64_t evpid)
+{
+	uint32_t	lo, hi, mid;
+
+	lo = 0;
+	hi = msg->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (msg->envelopes[mid]->evpid < evpid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static struct rq_envelope *
+rq_message_get(struct rq_message *msg, uint64_t evpid)
+{
+	uint32_t	i;
+
+	i = rq_message_lookup(msg, evpid);
+	if (i == msg->count || msg->envelopes[i]->evpid != evpid)
+		return (NULL);
+
+	return (msg->envelopes[i]);
+}
+
+static void
+rq_message_grow(struct rq_message *msg, uint32_t count)
+{
+	struct rq_envelope	**tmp;
+	uint32_t		  size;
+
+	if (count <= msg->size)
+		return;
+
+	size = msg->size ? msg->size : 1;
+	while (size < count)
+		size *= 2;
+	tmp = reallocarray(msg->envelopes, size, sizeof *tmp);
+	if (tmp == NULL)
+		fatal("rq_message_grow: reallocarray");
+	msg->envelopes = tmp;
+	msg->size = size;
+}
+
+static void
+rq_message_add(struct rq_message *msg, struct rq_envelope *evp)
+{
+	uint32_t	i;
+
+	i = rq_message_lookup(msg, evp->evpid);
+	if (i < msg->count && msg->envelopes[i]->evpid == evp->evpid)
+		errx(1, "evp:%016" PRIx64 " already in message", evp->evpid);
+
+	rq_message_grow(msg, msg->count + 1);
+	memmove(&msg->envelopes[i + 1], &msg->envelopes[i],
+	    (msg->count - i) * sizeof *msg->envelopes);
+	msg->envelopes[i] = evp;
+	msg->count++;
+}
+
+static void
+rq_message_del(struct rq_message *msg, struct rq_envelope *evp)
+{
+	uint32_t	i;
+
+	i = rq_message_lookup(msg, evp->evpid);
+	if (i == msg->count || msg->envelopes[i] != evp)
+		errx(1, "evp:%016" PRIx64 " not in message", evp->evpid);
+
+	msg->count--;
+	memmove(&msg->envelopes[i], &msg->envelopes[i + 1],
+	    (msg->count - i) * sizeof *msg->envelopes);
+}
+
+/*
+ * Merge the envelopes of src into dst.  Both vectors are sorted, so this
+ * is done in place from the end of dst.
+ */
+static void
+rq_message_merge(struct rq_message *dst, struct rq_message *src)
+{
+	uint32_t	i, j, k;
+
+	rq_message_grow(dst, dst->count + src->count);
+
+	i = dst->count;
+	j = src->count;
+	k = i + j;
+	while (j > 0) {
+		if (i > 0 &&
+		    dst->envelopes[i - 1]->evpid > src->envelopes[j - 1]->evpid)
+			dst->envelopes[--k] = dst->envelopes[--i];
+		else
+			dst->envelopes[--k] = src->envelopes[--j];
+	}
+	dst->count += src->count;
+	src->count = 0;
+}
+
 static void
 rq_queue_init(struct rq_queue *rq)
 {
@@ -841,7 +1284,8 @@ rq_queue_init(struct rq_queue *rq)
 	tree_init(&rq->messages);
 	TAILQ_INIT(&rq->q_pending);
 	TAILQ_INIT(&rq->q_inflight);
-	TAILQ_INIT(&rq->q_mta);
+	tree_init(&rq->q_mta);
+	TAILQ_INIT(&rq->q_mta_ring);
 	TAILQ_INIT(&rq->q_mda);
 	TAILQ_INIT(&rq->q_bounce);
 	TAILQ_INIT(&rq->q_update);
@@ -856,7 +1300,6 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 	struct rq_message	*message, *tomessage;
 	struct rq_envelope	*envelope;
 	uint64_t		 id;
-	void			*i;
 
 	while (tree_poproot(&update->messages, &id, (void*)&message)) {
 		if ((tomessage = tree_get(&rq->messages, id)) == NULL) {
@@ -864,12 +1307,8 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 			tree_xset(&rq->messages, id, message);
 			continue;
 		}
-		/* need to re-link all envelopes before merging them */
-		i = NULL;
-		while ((tree_iter(&message->envelopes, &i, &id,
-		    (void*)&envelope)))
-			envelope->message = tomessage;
-		tree_merge(&tomessage->envelopes, &message->envelopes);
+		rq_message_merge(tomessage, message);
+		free(message->envelopes);
 		free(message);
 		stat_decrement("scheduler.ramqueue.message", 1);
 	}
@@ -891,11 +1330,11 @@ rq_queue_schedule(struct rq_queue *rq)
 	struct rq_envelope	*evp;
 	size_t			 n;
 
-	n = 0;
-	while ((evp = TAILQ_FIRST(&rq->q_pending))) {
-		if (evp->sched > currtime && evp->expire > currtime)
-			break;
+	if (wheel)
+		wheel_advance(wheel, rq_time(currtime));
 
+	n = 0;
+	while ((evp = pending_due(rq))) {
 		if (n == SCHEDULEMAX)
 			break;
 
@@ -903,13 +1342,12 @@ rq_queue_schedule(struct rq_queue *rq)
 			errx(1, "evp:%016" PRIx64 " flags=0x%x", evp->evpid,
 			    evp->flags);
 
-		if (evp->expire <= currtime) {
-			TAILQ_REMOVE(&rq->q_pending, evp, entry);
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+		if (rq_abstime(evp->expire) <= currtime) {
+			pending_remove(rq, evp);
 			TAILQ_INSERT_TAIL(&rq->q_expired, evp, entry);
 			evp->state = RQ_EVPSTATE_SCHEDULED;
 			evp->flags |= RQ_ENVELOPE_EXPIRED;
-			evp->t_scheduled = currtime;
+			evp->t_state = rq_time(currtime);
 			continue;
 		}
 		rq_envelope_schedule(rq, evp);
@@ -932,12 +1370,13 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 		if (evp->flags & RQ_ENVELOPE_UPDATE)
 			return &rq->q_update;
 		if (evp->type == D_MTA)
-			return &rq->q_mta;
+			return rq_mta_queue(rq, evp);
 		if (evp->type == D_MDA)
 			return &rq->q_mda;
 		if (evp->type == D_BOUNCE)
 			return &rq->q_bounce;
 		errx(1, "%016" PRIx64 " bad evp type %d", evp->evpid, evp->type);
+		break;
 
 	case RQ_EVPSTATE_INFLIGHT:
 		return &rq->q_inflight;
@@ -950,26 +1389,90 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 	return (NULL);
 }
 
+static struct evplist *
+rq_mta_queue(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_dest	*d;
+	size_t		*weight;
+
+	if ((d = tree_get(&rq->q_mta, evp->dest)) == NULL) {
+		d = xcalloc(1, sizeof *d);
+		TAILQ_INIT(&d->q);
+		d->dest = evp->dest;
+		weight = tree_get(&weights, evp->dest);
+		d->weight = weight ? *weight : 1;
+		tree_xset(&rq->q_mta, d->dest, d);
+		TAILQ_INSERT_TAIL(&rq->q_mta_ring, d, entry);
+		stat_increment("scheduler.ramqueue.dest", 1);
+	}
+
+	return (&d->q);
+}
+
+static void
+rq_mta_free(struct rq_queue *rq, struct rq_dest *d)
+{
+	TAILQ_REMOVE(&rq->q_mta_ring, d, entry);
+	tree_xpop(&rq->q_mta, d->dest);
+	free(d);
+	stat_decrement("scheduler.ramqueue.dest", 1);
+}
+
+/*
+ * Each destination at the head of the ring may send as many envelopes
+ * as its weight before it is moved to the back.  Destinations emptied
+ * behind our back are released when they are reached.
+ */
+static struct rq_envelope *
+rq_mta_next(struct rq_queue *rq)
+{
+	struct rq_dest		*d;
+	struct rq_envelope	*evp;
+
+	while ((d = TAILQ_FIRST(&rq->q_mta_ring))) {
+		if ((evp = TAILQ_FIRST(&d->q)) == NULL) {
+			rq_mta_free(rq, d);
+			continue;
+		}
+
+		if (d->deficit == 0)
+			d->deficit = d->weight;
+		TAILQ_REMOVE(&d->q, evp, entry);
+		d->deficit -= 1;
+
+		if (TAILQ_EMPTY(&d->q))
+			rq_mta_free(rq, d);
+		else if (d->deficit == 0) {
+			TAILQ_REMOVE(&rq->q_mta_ring, d, entry);
+			TAILQ_INSERT_TAIL(&rq->q_mta_ring, d, entry);
+		}
+		return (evp);
+	}
+
+	return (NULL);
+}
+
 static void
 rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
 {
 	struct rq_holdq	*hq;
 	struct evplist	*q = NULL;
 
-	switch (evp->type) {
-	case D_MTA:
-		q = &rq->q_mta;
-		break;
-	case D_MDA:
-		q = &rq->q_mda;
-		break;
-	case D_BOUNCE:
-		q = &rq->q_bounce;
-		break;
-	}
-
 	if (evp->flags & RQ_ENVELOPE_UPDATE)
 		q = &rq->q_update;
+	else {
+		switch (evp->type) {
+		case D_MTA:
+			q = rq_mta_queue(rq, evp);
+			break;
+		case D_MDA:
+			q = &rq->q_mda;
+			break;
+		case D_BOUNCE:
+			q = &rq->q_bounce;
+			break;
+		}
+	}
 
 	if (evp->state == RQ_EVPSTATE_HELD) {
 		hq = tree_xget(&holdqs[evp->type], evp->holdq);
@@ -982,14 +1485,12 @@ rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
 		evp->holdq = 0;
 		stat_decrement("scheduler.ramqueue.hold", 1);
 	}
-	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
-		TAILQ_REMOVE(&rq->q_pending, evp, entry);
-		SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
-	}
+	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
+		pending_remove(rq, evp);
 
 	TAILQ_INSERT_TAIL(q, evp, entry);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
-	evp->t_scheduled = currtime;
+	evp->t_state = rq_time(currtime);
 }
 
 static int
@@ -1021,15 +1522,16 @@ rq_envelope_remove(struct rq_queue *rq, struct rq_envelope *evp)
 	}
 	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
 		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
 		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			pending_remove(rq, evp);
+		else
+			TAILQ_REMOVE(evl, evp, entry);
 	}
 
 	TAILQ_INSERT_TAIL(&rq->q_removed, evp, entry);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
 	evp->flags |= RQ_ENVELOPE_REMOVED;
-	evp->t_scheduled = currtime;
+	evp->t_state = rq_time(currtime);
 
 	return (1);
 }
@@ -1057,9 +1559,10 @@ rq_envelope_suspend(struct rq_queue *rq, struct rq_envelope *evp)
 	}
 	else if (evp->state != RQ_EVPSTATE_INFLIGHT) {
 		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
 		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			pending_remove(rq, evp);
+		else
+			TAILQ_REMOVE(evl, evp, entry);
 	}
 
 	evp->flags |= RQ_ENVELOPE_SUSPEND;
@@ -1088,17 +1591,40 @@ rq_envelope_resume(struct rq_queue *rq, struct rq_envelope *evp)
 	return (1);
 }
 
+static struct rq_envelope *
+rq_envelope_alloc(void)
+{
+	struct rq_envelope	*evp;
+	size_t			 i;
+
+	if ((evp = TAILQ_FIRST(&freelist)) == NULL) {
+		evp = xcalloc(RQ_SLAB_SIZE, sizeof *evp);
+		for (i = 1; i < RQ_SLAB_SIZE; i++)
+			TAILQ_INSERT_TAIL(&freelist, &evp[i], entry);
+		stat_increment("scheduler.ramqueue.slab", 1);
+	}
+	else
+		TAILQ_REMOVE(&freelist, evp, entry);
+
+	memset(evp, 0, sizeof *evp);
+	return (evp);
+}
+
 static void
 rq_envelope_delete(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	tree_xpop(&evp->message->envelopes, evp->evpid);
-	if (tree_empty(&evp->message->envelopes)) {
-		tree_xpop(&rq->messages, evp->message->msgid);
-		free(evp->message);
+	struct rq_message	*msg;
+
+	msg = tree_xget(&rq->messages, evpid_to_msgid(evp->evpid));
+	rq_message_del(msg, evp);
+	if (msg->count == 0) {
+		tree_xpop(&rq->messages, msg->msgid);
+		free(msg->envelopes);
+		free(msg);
 		stat_decrement("scheduler.ramqueue.message", 1);
 	}
 
-	free(evp);
+	TAILQ_INSERT_HEAD(&freelist, evp, entry);
 	rq->evpcount--;
 	stat_decrement("scheduler.ramqueue.envelope", 1);
 }
@@ -1119,32 +1645,32 @@ rq_envelope_to_text(struct rq_envelope *e)
 		(void)strlcat(buf, "mta", sizeof buf);
 
 	(void)snprintf(t, sizeof t, ",expire=%s",
-	    duration_to_text(e->expire - currtime));
+	    duration_to_text(rq_abstime(e->expire) - currtime));
 	(void)strlcat(buf, t, sizeof buf);
 
 
 	switch (e->state) {
 	case RQ_EVPSTATE_PENDING:
 		(void)snprintf(t, sizeof t, ",pending=%s",
-		    duration_to_text(e->sched - currtime));
+		    duration_to_text(rq_abstime(e->sched) - currtime));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_SCHEDULED:
 		(void)snprintf(t, sizeof t, ",scheduled=%s",
-		    duration_to_text(currtime - e->t_scheduled));
+		    duration_to_text(currtime - rq_abstime(e->t_state)));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_INFLIGHT:
 		(void)snprintf(t, sizeof t, ",inflight=%s",
-		    duration_to_text(currtime - e->t_inflight));
+		    duration_to_text(currtime - rq_abstime(e->t_state)));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_HELD:
 		(void)snprintf(t, sizeof t, ",held=%s",
-		    duration_to_text(currtime - e->t_inflight));
+		    duration_to_text(currtime - rq_abstime(e->t_state)));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 	default:
@@ -1167,20 +1693,18 @@ static void
 rq_queue_dump(struct rq_queue *rq, const char * name)
 {
 	struct rq_message	*message;
-	struct rq_envelope	*envelope;
-	void			*i, *j;
+	void			*i;
 	uint64_t		 id;
+	uint32_t		 j;
 
 	log_debug("debug: /--- ramqueue: %s", name);
 
 	i = NULL;
 	while ((tree_iter(&rq->messages, &i, &id, (void*)&message))) {
 		log_debug("debug: | msg:%08" PRIx32, message->msgid);
-		j = NULL;
-		while ((tree_iter(&message->envelopes, &j, &id,
-		    (void*)&envelope)))
+		for (j = 0; j < message->count; j++)
 			log_debug("debug: |   %s",
-			    rq_envelope_to_text(envelope));
+			    rq_envelope_to_text(message->envelopes[j]));
 	}
 	log_debug("debug: \\---");
 }
@@ -1188,7 +1712,7 @@ rq_queue_dump(struct rq_queue *rq, const char * name)
 static int
 rq_envelope_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
 {
-	time_t	ref1, ref2;
+	int32_t	ref1, ref2;
 
 	ref1 = (e1->sched < e1->expire) ? e1->sched : e1->expire;
 	ref2 = (e2->sched < e2->expire) ? e2->sched : e2->expire;
@@ -1201,4 +1725,4 @@ rq_envelope_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
 	return 0;
 }
 
-SPLAY_GENERATE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
+SPLAY_GENERATE(prioqtree, rq_envelope, t.tree, rq_envelope_cmp);
@@ -51,6 +51,7 @@ static void smtp_resume(void);
 static void smtp_accept(int, short, void *);
 static int smtp_enqueue(void);
 static int smtp_can_accept(void);
+static size_t smtp_accept_budget(void);
 static void smtp_setup_listeners(void);
 static int smtp_sni_callback(SSL *, int *, void *);
 
@@ -58,6 +59,7 @@ static void smtp_accepted(struct listener *, int, const struct sockaddr_storage
 
 
 #define	SMTP_FD_RESERVE	5
+#define	SMTP_ACCEPT_BATCH	64
 #define	getdtablecount()	0
 
 static size_t	sessions;
@@ -105,6 +107,11 @@ smtp_imsg(struct mproc *p, struct imsg *imsg)
 		env->sc_flags &= ~SMTPD_SMTP_PAUSED;
 		smtp_resume();
 		return;
+
+	case IMSG_SMTP_TLS_TICKET_KEY:
+		CHECK_IMSG_DATA_SIZE(imsg, sizeof(struct ssl_ticket_key));
+		ssl_ticket_key_set(imsg->data);
+		return;
 	}
 
 	errx(1, "smtp_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
@@ -151,6 +158,23 @@ smtp_setup_listeners(void)
 			sizeof(opt)) < 0)
 			fatal("smtpd: setsockopt");
 #endif
+#if defined(SO_REUSEPORT_LB)
+		/*
+		 * Each worker binds its own socket to the listener address.
+		 * Whether connections are spread across them is up to the
+		 * kernel: FreeBSD only does it with SO_REUSEPORT_LB, and
+		 * OpenBSD hands all of them to a single socket.
+		 */
+		if (env->sc_smtp_workers > 1)
+			if (setsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT_LB, &opt,
+				sizeof(opt)) < 0)
+				fatal("smtpd: setsockopt");
+#elif defined(SO_REUSEPORT)
+		if (env->sc_smtp_workers > 1)
+			if (setsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+				sizeof(opt)) < 0)
+				fatal("smtpd: setsockopt");
+#endif
 #ifdef IPV6_V6ONLY
 		/*
 		 * If using IPv6, bind only to IPv6 if possible.
@@ -201,7 +225,11 @@ smtp_setup_events(void)
 	purge_config(PURGE_PKI_KEYS);
 
 	maxsessions = (getdtablesize() - getdtablecount()) / 2 - SMTP_FD_RESERVE;
-	log_debug("debug: smtp: will accept at most %zu clients", maxsessions);
+	log_debug("debug: smtp: worker %zu will accept at most %zu clients",
+	    pony_worker, maxsessions);
+
+	/* the control process sums this over all workers */
+	stat_increment("smtp.session.max", maxsessions);
 }
 
 static void
@@ -264,30 +292,47 @@ smtp_accept(int fd, short event, void *p)
 	struct listener		*listener = p;
 	struct sockaddr_storage	 ss;
 	socklen_t		 len;
+	size_t			 budget;
 	int			 sock;
 
 	if (env->sc_flags & SMTPD_SMTP_PAUSED)
 		fatalx("smtp_session: unexpected client");
 
-	if (!smtp_can_accept()) {
+	/*
+	 * Drain the backlog within the session and descriptor limits,
+	 * which are evaluated once for the whole batch.
+	 */
+	if ((budget = smtp_accept_budget()) == 0) {
 		log_warnx("warn: Disabling incoming SMTP connections: "
 		    "Client limit reached");
 		goto pause;
 	}
 
-	len = sizeof(ss);
-	if ((sock = accept(fd, (struct sockaddr *)&ss, &len)) == -1) {
-		if (errno == ENFILE || errno == EMFILE) {
-			log_warn("warn: Disabling incoming SMTP connections");
-			goto pause;
+	while (budget--) {
+		len = sizeof(ss);
+#ifdef HAVE_ACCEPT4
+		sock = accept4(fd, (struct sockaddr *)&ss, &len,
+		    SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+		sock = accept(fd, (struct sockaddr *)&ss, &len);
+#endif
+		if (sock == -1) {
+			if (errno == ENFILE || errno == EMFILE) {
+				log_warn("warn: Disabling incoming SMTP "
+				    "connections");
+				goto pause;
+			}
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return;
+			fatal("smtp_accept");
 		}
-		if (errno == EINTR || errno == EWOULDBLOCK ||
-		    errno == ECONNABORTED)
-			return;
-		fatal("smtp_accept");
+#ifndef HAVE_ACCEPT4
+		io_set_nonblocking(sock);
+#endif
+		smtp_accepted(listener, sock, &ss, NULL);
 	}
-
-	smtp_accepted(listener, sock, &ss, NULL);
 	return;
 
 pause:
@@ -299,9 +344,32 @@ pause:
 static int
 smtp_can_accept(void)
 {
-	if (sessions + 1 == maxsessions)
-		return 0;
-	return (getdtablesize() - getdtablecount() - SMTP_FD_RESERVE >= 2);
+	return (smtp_accept_budget() != 0);
+}
+
+/*
+ * Number of connections that may be accepted in a row before hitting
+ * either the session limit or the descriptor reserve.
+ */
+static size_t
+smtp_accept_budget(void)
+{
+	size_t	budget;
+	int	fds;
+
+	if (sessions + 1 >= maxsessions)
+		return (0);
+	budget = maxsessions - sessions - 1;
+
+	fds = (getdtablesize() - getdtablecount() - SMTP_FD_RESERVE) / 2;
+	if (fds <= 0)
+		return (0);
+	if ((size_t)fds < budget)
+		budget = fds;
+
+	if (budget > SMTP_ACCEPT_BATCH)
+		budget = SMTP_ACCEPT_BATCH;
+	return (budget);
 }
 
 void
@@ -348,7 +416,6 @@ smtp_accepted(struct listener *listener, int sock, const struct sockaddr_storage
 		close(sock);
 		return;
 	}
-	io_set_nonblocking(sock);
 
 	sessions++;
 	stat_increment("smtp.session", 1);
@@ -66,6 +66,7 @@ enum smtp_state {
 	STATE_AUTH_PASSWORD,
 	STATE_AUTH_FINALIZE,
 	STATE_BODY,
+	STATE_BDAT,
 	STATE_QUIT,
 };
 
@@ -77,6 +78,7 @@ enum session_flags {
 	SF_BOUNCE		= 0x0010,
 	SF_VERIFIED		= 0x0020,
 	SF_BADINPUT		= 0x0080,
+	SF_PIPELINING		= 0x0100,
 };
 
 enum {
@@ -98,6 +100,7 @@ enum smtp_command {
 	CMD_MAIL_FROM,
 	CMD_RCPT_TO,
 	CMD_DATA,
+	CMD_BDAT,
 	CMD_RSET,
 	CMD_QUIT,
 	CMD_HELP,
@@ -132,6 +135,13 @@ struct smtp_tx {
 	int			 rcvcount;
 	int			 has_date;
 	int			 has_message_id;
+
+	int			 chunking;
+	int			 in_body;
+	int			 chunk_cr;
+	int			 chunk_noeol;
+	size_t			 chunk_linelen;
+	char			 chunk_line[SMTP_LINE_MAX];
 };
 
 struct smtp_session {
@@ -154,6 +164,12 @@ struct smtp_session {
 
 	size_t			 mailcount;
 	struct event		 pause;
+	struct event		 pipeline;
+
+	size_t			 chunklen;
+	size_t			 chunkleft;
+	int			 chunk_last;
+	int			 chunk_discard;
 
 	struct smtp_tx		*tx;
 
@@ -188,6 +204,11 @@ static void smtp_connected(struct smtp_session *);
 static void smtp_send_banner(struct smtp_session *);
 static void smtp_tls_verified(struct smtp_session *);
 static void smtp_io(struct io *, int, void *);
+static int smtp_pipelined(struct smtp_session *);
+static void smtp_pipeline_resume(int, short, void *);
+static void smtp_chunk_begin(struct smtp_session *);
+static void smtp_chunk_data(struct smtp_session *);
+static void smtp_chunk_end(struct smtp_session *);
 static void smtp_enter_state(struct smtp_session *, int);
 static void smtp_reply(struct smtp_session *, char *, ...);
 static void smtp_command(struct smtp_session *, char *);
@@ -211,6 +232,11 @@ static void smtp_tx_open_message(struct smtp_tx *);
 static void smtp_tx_commit(struct smtp_tx *);
 static void smtp_tx_rollback(struct smtp_tx *);
 static int  smtp_tx_dataline(struct smtp_tx *, const char *);
+static void smtp_tx_body(struct smtp_tx *, struct io *);
+static int  smtp_tx_parseline(struct smtp_tx *, const char *);
+static void smtp_tx_chunk(struct smtp_tx *, const char *, size_t);
+static void smtp_tx_chunk_body(struct smtp_tx *, const char *, size_t);
+static void smtp_tx_chunk_eom(struct smtp_tx *);
 static int  smtp_tx_filtered_dataline(struct smtp_tx *, const char *);
 static void smtp_tx_eom(struct smtp_tx *);
 static void smtp_filter_fd(struct smtp_tx *, int);
@@ -219,6 +245,8 @@ static void smtp_message_begin(struct smtp_tx *);
 static void smtp_message_end(struct smtp_tx *);
 static int  smtp_filter_printf(struct smtp_tx *, const char *, ...);
 static int  smtp_message_printf(struct smtp_tx *, const char *, ...);
+static int  smtp_message_write(struct smtp_tx *, const char *, size_t);
+static int  smtp_message_writev(struct smtp_tx *, struct iovec *, int);
 
 static int  smtp_check_rset(struct smtp_session *, const char *);
 static int  smtp_check_helo(struct smtp_session *, const char *);
@@ -228,6 +256,7 @@ static int  smtp_check_starttls(struct smtp_session *, const char *);
 static int  smtp_check_mail_from(struct smtp_session *, const char *);
 static int  smtp_check_rcpt_to(struct smtp_session *, const char *);
 static int  smtp_check_data(struct smtp_session *, const char *);
+static int  smtp_check_bdat(struct smtp_session *, const char *);
 static int  smtp_check_noparam(struct smtp_session *, const char *);
 
 static void smtp_filter_phase(enum filter_phase, struct smtp_session *, const char *);
@@ -241,6 +270,7 @@ static void smtp_proceed_starttls(struct smtp_session *, const char *);
 static void smtp_proceed_mail_from(struct smtp_session *, const char *);
 static void smtp_proceed_rcpt_to(struct smtp_session *, const char *);
 static void smtp_proceed_data(struct smtp_session *, const char *);
+static void smtp_proceed_bdat(struct smtp_session *, const char *);
 static void smtp_proceed_noop(struct smtp_session *, const char *);
 static void smtp_proceed_help(struct smtp_session *, const char *);
 static void smtp_proceed_wiz(struct smtp_session *, const char *);
@@ -268,6 +298,7 @@ static struct {
 	{ CMD_MAIL_FROM,        FILTER_MAIL_FROM,       "MAIL FROM",    smtp_check_mail_from,   smtp_proceed_mail_from },
 	{ CMD_RCPT_TO,          FILTER_RCPT_TO,         "RCPT TO",      smtp_check_rcpt_to,     smtp_proceed_rcpt_to },
 	{ CMD_DATA,             FILTER_DATA,            "DATA",         smtp_check_data,        smtp_proceed_data },
+	{ CMD_BDAT,             FILTER_DATA,            "BDAT",         smtp_check_bdat,        smtp_proceed_bdat },
 	{ CMD_RSET,             FILTER_RSET,            "RSET",         smtp_check_rset,        smtp_proceed_rset },
 	{ CMD_QUIT,             FILTER_QUIT,            "QUIT",         smtp_check_noparam,     smtp_proceed_quit },
 	{ CMD_NOOP,             FILTER_NOOP,            "NOOP",         smtp_check_noparam,     smtp_proceed_noop },
@@ -585,7 +616,7 @@ smtp_session(struct listener *listener, int sock,
 	if ((s = calloc(1, sizeof(*s))) == NULL)
 		return (-1);
 
-	s->id = generate_uid();
+	s->id = pony_uid();
 	s->listener = listener;
 	memmove(&s->ss, ss, sizeof(*ss));
 
@@ -596,6 +627,7 @@ smtp_session(struct listener *listener, int sock,
 
 	io_set_callback(s->io, smtp_io, s);
 	io_set_fd(s->io, sock);
+	evtimer_set(&s->pipeline, smtp_pipeline_resume, s);
 	io_set_timeout(s->io, SMTPD_SESSION_TIMEOUT * 1000);
 	io_set_write(s->io);
 
@@ -1076,6 +1108,11 @@ smtp_io(struct io *io, int evt, void *arg)
 
 		report_smtp_link_tls("smtp-in", s->id, ssl_to_text(io_ssl(s->io)));
 
+		if (SSL_session_reused(io_ssl(s->io)))
+			stat_increment("smtp.tls.resumed", 1);
+		else
+			stat_increment("smtp.tls.full", 1);
+
 		s->flags |= SF_SECURE;
 		s->helo[0] = '\0';
 
@@ -1083,7 +1120,16 @@ smtp_io(struct io *io, int evt, void *arg)
 		break;
 
 	case IO_DATAIN:
+		if (s->state == STATE_BDAT) {
+			smtp_chunk_data(s);
+			break;
+		}
+
 	    nextline:
+		if (s->state == STATE_BODY && s->tx->in_body &&
+		    s->tx->filter == NULL)
+			smtp_tx_body(s->tx, io);
+
 		line = io_getline(s->io, &len);
 		if ((line == NULL && io_datalen(s->io) >= SMTP_LINE_MAX) ||
 		    (line && len >= SMTP_LINE_MAX)) {
@@ -1114,19 +1160,12 @@ smtp_io(struct io *io, int evt, void *arg)
 				goto nextline;
 		}
 
-		/* Pipelining not supported */
-		if (io_datalen(s->io)) {
-			s->flags |= SF_BADINPUT;
-			smtp_reply(s, "500 %s %s: Pipelining not supported",
-			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
-			    esc_description(ESC_INVALID_COMMAND));
-			smtp_enter_state(s, STATE_QUIT);
-			io_set_write(io);
-			return;
-		}
-
 		if (eom) {
 			io_set_write(io);
+			if (smtp_pipelined(s)) {
+				s->flags |= SF_PIPELINING;
+				io_pause(io, IO_OUT);
+			}
 			if (s->tx->filter == NULL)
 				smtp_tx_eom(s->tx);
 			return;
@@ -1142,6 +1181,10 @@ smtp_io(struct io *io, int evt, void *arg)
 			return;
 		}
 		io_set_write(io);
+		if (smtp_pipelined(s)) {
+			s->flags |= SF_PIPELINING;
+			io_pause(io, IO_OUT);
+		}
 		smtp_command(s, line);
 		break;
 
@@ -1190,6 +1233,96 @@ smtp_io(struct io *io, int evt, void *arg)
 	}
 }
 
+/*
+ * RFC 2920: the client may send several commands without waiting for
+ * the replies.  They are processed one at a time as usual, but output is
+ * held while more complete commands are buffered, so that the replies to
+ * a whole group go out in a single write.
+ */
+static int
+smtp_pipelined(struct smtp_session *s)
+{
+	return (memchr(io_data(s->io), '\n', io_datalen(s->io)) != NULL);
+}
+
+static void
+smtp_pipeline_resume(int fd, short event, void *p)
+{
+	struct smtp_session *s = p;
+
+	s->flags &= ~SF_PIPELINING;
+	io_resume(s->io, IO_OUT);
+
+	if (s->state == STATE_QUIT || s->state == STATE_TLS)
+		return;
+	if (!smtp_pipelined(s))
+		return;
+
+	io_set_read(s->io);
+	smtp_io(s->io, IO_DATAIN, s);
+}
+
+/*
+ * RFC 3030: a BDAT command is followed by exactly the announced number
+ * of octets, which are taken from the input buffer as they are and not
+ * scanned for a terminating dot.
+ */
+static void
+smtp_chunk_begin(struct smtp_session *s)
+{
+	smtp_enter_state(s, STATE_BDAT);
+	io_set_read(s->io);
+	smtp_chunk_data(s);
+}
+
+static void
+smtp_chunk_data(struct smtp_session *s)
+{
+	size_t	len;
+
+	len = io_datalen(s->io);
+	if (len > s->chunkleft)
+		len = s->chunkleft;
+	if (len) {
+		if (!s->chunk_discard)
+			smtp_tx_chunk(s->tx, io_data(s->io), len);
+		io_drop(s->io, len);
+		s->chunkleft -= len;
+	}
+
+	if (s->chunkleft == 0)
+		smtp_chunk_end(s);
+}
+
+static void
+smtp_chunk_end(struct smtp_session *s)
+{
+	io_set_write(s->io);
+	if (smtp_pipelined(s)) {
+		s->flags |= SF_PIPELINING;
+		io_pause(s->io, IO_OUT);
+	}
+	smtp_enter_state(s, STATE_HELO);
+
+	if (s->chunk_discard) {
+		s->chunk_discard = 0;
+		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+		    esc_description(ESC_INVALID_COMMAND));
+		return;
+	}
+
+	if (!s->chunk_last) {
+		smtp_reply(s, "250 %s: %zu octets received",
+		    esc_code(ESC_STATUS_OK, ESC_OTHER_STATUS),
+		    s->chunklen);
+		return;
+	}
+
+	smtp_tx_chunk_eom(s->tx);
+	smtp_tx_eom(s->tx);
+}
+
 static void
 smtp_command(struct smtp_session *s, char *line)
 {
@@ -1294,6 +1427,12 @@ smtp_command(struct smtp_session *s, char *line)
 		smtp_filter_phase(FILTER_DATA, s, NULL);
 		break;
 
+	case CMD_BDAT:
+		if (!smtp_check_bdat(s, args))
+			break;
+		smtp_proceed_bdat(s, args);
+		break;
+
 	/*
 	 * ANY
 	 */
@@ -1595,6 +1734,58 @@ smtp_check_data(struct smtp_session *s, const char *args)
 		return 0;
 	}
 
+	if (s->tx->chunking) {
+		smtp_reply(s, "503 %s %s: Command not allowed at this point.",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+		    esc_description(ESC_INVALID_COMMAND));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+smtp_check_bdat(struct smtp_session *s, const char *args)
+{
+	char		 buf[64], *last;
+	const char	*errstr;
+	long long	 size = 0;
+
+	last = NULL;
+	if (args && strlcpy(buf, args, sizeof buf) < sizeof buf) {
+		if ((last = strchr(buf, ' ')) != NULL) {
+			*last++ = '\0';
+			while (isspace((unsigned char)*last))
+				last++;
+		}
+		size = strtonum(buf, 0, LLONG_MAX, &errstr);
+	}
+	else
+		errstr = "missing";
+
+	/*
+	 * Without a valid size there is no telling where the chunk ends,
+	 * so the session cannot be kept in sync with the client.
+	 */
+	if (errstr || (last && strcasecmp(last, "LAST"))) {
+		s->flags |= SF_BADINPUT;
+		smtp_reply(s, "501 %s %s: Invalid BDAT arguments",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND_ARGUMENTS),
+		    esc_description(ESC_INVALID_COMMAND_ARGUMENTS));
+		smtp_enter_state(s, STATE_QUIT);
+		return 0;
+	}
+
+	s->chunklen = s->chunkleft = size;
+	s->chunk_last = (last != NULL);
+
+	/* the chunk follows anyway, swallow it before refusing the command */
+	if (SESSION_FILTERED(s) || s->tx == NULL || s->tx->rcptcount == 0) {
+		s->chunk_discard = 1;
+		smtp_chunk_begin(s);
+		return 0;
+	}
+
 	return 1;
 }
 
@@ -1748,6 +1939,9 @@ smtp_proceed_ehlo(struct smtp_session *s, const char *args)
 
 	smtp_reply(s, "250-8BITMIME");
 	smtp_reply(s, "250-ENHANCEDSTATUSCODES");
+	smtp_reply(s, "250-PIPELINING");
+	if (!SESSION_FILTERED(s))
+		smtp_reply(s, "250-CHUNKING");
 	smtp_reply(s, "250-SIZE %zu", env->sc_maxsize);
 	if (ADVERTISE_EXT_DSN(s))
 		smtp_reply(s, "250-DSN");
@@ -1786,6 +1980,16 @@ smtp_proceed_auth(struct smtp_session *s, const char *args)
 static void
 smtp_proceed_starttls(struct smtp_session *s, const char *args)
 {
+	/* Anything sent in the clear after STARTTLS must not be trusted */
+	if (io_datalen(s->io)) {
+		s->flags |= SF_BADINPUT;
+		smtp_reply(s, "500 %s %s: Pipelining not allowed after STARTTLS",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+		    esc_description(ESC_INVALID_COMMAND));
+		smtp_enter_state(s, STATE_QUIT);
+		return;
+	}
+
 	smtp_reply(s, "220 %s: Ready to start TLS",
 	    esc_code(ESC_STATUS_OK, ESC_OTHER_STATUS));
 	smtp_enter_state(s, STATE_TLS);
@@ -1809,6 +2013,19 @@ smtp_proceed_data(struct smtp_session *s, const char *args)
 	smtp_tx_open_message(s->tx);
 }
 
+static void
+smtp_proceed_bdat(struct smtp_session *s, const char *args)
+{
+	if (s->tx->chunking) {
+		smtp_chunk_begin(s);
+		return;
+	}
+
+	/* the first chunk opens the message, smtp_message_begin() goes on */
+	s->tx->chunking = 1;
+	smtp_tx_open_message(s->tx);
+}
+
 static void
 smtp_proceed_quit(struct smtp_session *s, const char *args)
 {
@@ -2036,9 +2253,10 @@ smtp_enter_state(struct smtp_session *s, int newstate)
 static void
 smtp_reply(struct smtp_session *s, char *fmt, ...)
 {
-	va_list	 ap;
-	int	 n;
-	char	 buf[LINE_MAX], tmp[LINE_MAX];
+	struct timeval	 tv = { 0, 0 };
+	va_list		 ap;
+	int		 n;
+	char		 buf[LINE_MAX], tmp[LINE_MAX];
 
 	va_start(ap, fmt);
 	n = vsnprintf(buf, sizeof buf, fmt, ap);
@@ -2113,6 +2331,10 @@ smtp_reply(struct smtp_session *s, char *fmt, ...)
 
 	io_xprintf(s->io, "%s\r\n", buf);
 	report_smtp_protocol_server("smtp-in", s->id, buf);
+
+	/* The command is answered, move on to the next pipelined one */
+	if (s->flags & SF_PIPELINING && buf[3] != '-')
+		evtimer_add(&s->pipeline, &tv);
 }
 
 static void
@@ -2127,6 +2349,8 @@ smtp_free(struct smtp_session *s, const char * reason)
 	report_smtp_link_disconnect("smtp-in", s->id);
 	smtp_filter_end(s);
 
+	evtimer_del(&s->pipeline);
+
 	if (s->flags & SF_SECURE && s->listener->flags & F_SMTPS)
 		stat_decrement("smtp.smtps", 1);
 	if (s->flags & SF_SECURE && s->listener->flags & F_STARTTLS)
@@ -2558,9 +2782,6 @@ smtp_tx_rollback(struct smtp_tx *tx)
 static int
 smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 {
-	struct rfc5322_result res;
-	int r;
-
 	log_trace(TRACE_SMTP, "<<< [MSG] %s", line);
 
 	if (!strcmp(line, ".")) {
@@ -2580,6 +2801,42 @@ smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 			line += 1;
 	}
 
+	return smtp_tx_parseline(tx, line);
+}
+
+/*
+ * Once past the headers, nothing is rewritten in the message, so the
+ * complete body lines available in the input buffer are written to the
+ * spool straight from there, the CR and stuffed dots being skipped
+ * over, instead of going through the parser and stdio one line at a
+ * time.  The final "." is left to smtp_io().
+ */
+static void
+smtp_tx_body(struct smtp_tx *tx, struct io *io)
+{
+	struct iovec	iov[IOV_MAX];
+	size_t		n, len;
+	int		iovcnt;
+
+	while ((n = smtp_body_iov(iov, &iovcnt, IOV_MAX, io_data(io),
+	    io_datalen(io), SMTP_LINE_MAX, &len)) != 0) {
+		log_trace(TRACE_SMTP, "<<< [MSG] %zu octets", len);
+
+		tx->datain += len;
+		if (tx->datain > env->sc_maxsize)
+			tx->error = TX_ERROR_SIZE;
+
+		smtp_message_writev(tx, iov, iovcnt);
+		io_drop(io, n);
+	}
+}
+
+static int
+smtp_tx_parseline(struct smtp_tx *tx, const char *line)
+{
+	struct rfc5322_result res;
+	int r;
+
 	if (rfc5322_push(tx->parser, line) == -1) {
 		log_warnx("failed to push dataline");
 		tx->error = TX_ERROR_INTERNAL;
@@ -2668,6 +2925,8 @@ smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 			break;
 
 		case RFC5322_BODY_START:
+			tx->in_body = 1;
+			/* FALLTHROUGH */
 		case RFC5322_BODY:
 			smtp_message_printf(tx, "%s\n", res.value);
 			break;
@@ -2681,6 +2940,121 @@ smtp_tx_dataline(struct smtp_tx *tx, const char *line)
 	}
 }
 
+/*
+ * Chunk data carries CRLF line endings and no dot-stuffing.  Headers
+ * still go through the parser one line at a time, but once the body is
+ * reached the data is copied to the spool as is, only turning CRLF into
+ * LF.
+ */
+static void
+smtp_tx_chunk(struct smtp_tx *tx, const char *data, size_t len)
+{
+	const char	*lf;
+	size_t		 n;
+
+	log_trace(TRACE_SMTP, "<<< [CHUNK] %zu octets", len);
+
+	tx->datain += len;
+	if (tx->datain > env->sc_maxsize)
+		tx->error = TX_ERROR_SIZE;
+
+	while (len && !tx->in_body) {
+		if (tx->error)
+			return;
+
+		lf = memchr(data, '\n', len);
+		n = lf ? (size_t)(lf - data) : len;
+		if (tx->chunk_linelen + n >= sizeof(tx->chunk_line)) {
+			tx->error = TX_ERROR_MALFORMED;
+			return;
+		}
+		memcpy(tx->chunk_line + tx->chunk_linelen, data, n);
+		tx->chunk_linelen += n;
+		if (lf == NULL)
+			return;
+		data += n + 1;
+		len -= n + 1;
+
+		n = tx->chunk_linelen;
+		if (n && tx->chunk_line[n - 1] == '\r')
+			n--;
+		tx->chunk_line[n] = '\0';
+		tx->chunk_linelen = 0;
+		smtp_tx_parseline(tx, tx->chunk_line);
+	}
+
+	if (len && !tx->error)
+		smtp_tx_chunk_body(tx, data, len);
+}
+
+static void
+smtp_tx_chunk_body(struct smtp_tx *tx, const char *data, size_t len)
+{
+	const char	*cr;
+	size_t		 n;
+
+	/* a CR ended the previous chunk */
+	if (tx->chunk_cr) {
+		tx->chunk_cr = 0;
+		if (data[0] != '\n')
+			smtp_message_write(tx, "\r", 1);
+	}
+
+	tx->chunk_noeol = (data[len - 1] != '\n');
+
+	while (len) {
+		if ((cr = memchr(data, '\r', len)) == NULL) {
+			smtp_message_write(tx, data, len);
+			return;
+		}
+		n = cr - data;
+		if (n + 1 == len) {
+			smtp_message_write(tx, data, n);
+			tx->chunk_cr = 1;
+			return;
+		}
+		if (cr[1] == '\n') {
+			smtp_message_write(tx, data, n);
+			n += 1;
+		}
+		else {
+			n += 1;
+			smtp_message_write(tx, data, n);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+smtp_tx_chunk_eom(struct smtp_tx *tx)
+{
+	size_t	n;
+
+	log_trace(TRACE_SMTP, "<<< [EOM]");
+
+	if (tx->error)
+		return;
+
+	if (tx->in_body) {
+		if (tx->chunk_cr)
+			smtp_message_write(tx, "\r", 1);
+		if (tx->chunk_noeol)
+			smtp_message_write(tx, "\n", 1);
+	}
+	else if (tx->chunk_linelen) {
+		n = tx->chunk_linelen;
+		if (tx->chunk_line[n - 1] == '\r')
+			n--;
+		tx->chunk_line[n] = '\0';
+		tx->chunk_linelen = 0;
+		smtp_tx_parseline(tx, tx->chunk_line);
+	}
+
+	if (!tx->error)
+		smtp_tx_parseline(tx, NULL);
+}
+
 static int
 smtp_tx_filtered_dataline(struct smtp_tx *tx, const char *line)
 {
@@ -2776,8 +3150,11 @@ smtp_message_begin(struct smtp_tx *tx)
 
 	log_debug("smtp: %p: message begin", s);
 
-	smtp_reply(s, "354 Enter mail, end with \".\""
-	    " on a line by itself");	
+	if (tx->chunking)
+		report_smtp_tx_data("smtp-in", s->id, tx->msgid, 1);
+	else
+		smtp_reply(s, "354 Enter mail, end with \".\""
+		    " on a line by itself");
 	
 	m_printf(tx, "Received: ");
 	if (!(s->listener->flags & F_MASK_SOURCE)) {
@@ -2819,7 +3196,10 @@ smtp_message_begin(struct smtp_tx *tx)
 
 	m_printf(tx, ";\n\t%s\n", time_to_text(time(&tx->time)));
 
-	smtp_enter_state(s, STATE_BODY);
+	if (tx->chunking)
+		smtp_chunk_begin(s);
+	else
+		smtp_enter_state(s, STATE_BODY);
 }
 
 static void
@@ -2919,6 +3299,59 @@ smtp_message_printf(struct smtp_tx *tx, const char *fmt, ...)
 	return len;
 }
 
+static int
+smtp_message_write(struct smtp_tx *tx, const char *buf, size_t len)
+{
+	if (tx->error)
+		return -1;
+
+	if (fwrite(buf, 1, len, tx->ofile) != len) {
+		log_warn("smtp-in: session %016"PRIx64": fwrite", tx->session->id);
+		tx->error = TX_ERROR_IO;
+		return -1;
+	}
+	tx->odatalen += len;
+
+	return len;
+}
+
+static int
+smtp_message_writev(struct smtp_tx *tx, struct iovec *iov, int iovcnt)
+{
+	ssize_t	n;
+
+	if (tx->error)
+		return -1;
+
+	/* headers may still sit in the stdio buffer */
+	if (fflush(tx->ofile) == EOF)
+		goto fail;
+
+	while (iovcnt) {
+		if ((n = writev(fileno(tx->ofile), iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		tx->odatalen += n;
+
+		/* short write, skip what went out */
+		for (; iovcnt && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+
+fail:
+	log_warn("smtp-in: session %016"PRIx64": writev", tx->session->id);
+	tx->error = TX_ERROR_IO;
+	return -1;
+}
+
 #define CASE(x) case x : return #x
 
 const char *
@@ -2936,6 +3369,7 @@ smtp_strstate(int state)
 	CASE(STATE_AUTH_PASSWORD);
 	CASE(STATE_AUTH_FINALIZE);
 	CASE(STATE_BODY);
+	CASE(STATE_BDAT);
 	CASE(STATE_QUIT);
 	default:
 		(void)snprintf(buf, sizeof(buf), "STATE_??? (%d)", state);
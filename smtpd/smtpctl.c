@@ -82,6 +82,8 @@ void usage(void);
 static void show_queue_envelope(struct envelope *, int);
 static void getflag(uint *, int, char *, char *, size_t);
 static void display(const char *);
+static void display_envelope(const char *);
+static char *setup_key(void);
 static int str_to_trace(const char *);
 static int str_to_profile(const char *);
 static void show_offline_envelope(uint64_t);
@@ -127,6 +129,14 @@ void stat_decrement(const char *k, size_t v)
 {
 }
 
+void mproc_hold(void)
+{
+}
+
+void mproc_release(void)
+{
+}
+
 int
 srv_connect(void)
 {
@@ -261,44 +271,24 @@ srv_get_evpid(uint64_t *evpid)
 }
 
 static void
-srv_get_string(const char **s)
+srv_get_data(const void **data, size_t *sz)
 {
-	const char *end;
-	size_t len;
-
-	if (rlen == 0)
-		errx(1, "message too short");
-
-	rlen -= 1;
-	if (*rdata++ == '\0') {
-		*s = NULL;
-		return;
-	}
-
-	if (rlen == 0)
-		errx(1, "bogus string");
-
-	end = memchr(rdata, 0, rlen);
-	if (end == NULL)
-		errx(1, "unterminated string");
-
-	len = end + 1 - rdata;
-
-	*s = rdata;
-	rlen -= len;
-	rdata += len;
+	srv_read(sz, sizeof(*sz));
+	*data = rdata;
+	srv_read(NULL, *sz);
 }
 
 static void
 srv_get_envelope(struct envelope *evp)
 {
 	uint64_t	 evpid;
-	const char	*str;
+	const void	*buf;
+	size_t		 len;
 
 	srv_get_evpid(&evpid);
-	srv_get_string(&str);
+	srv_get_data(&buf, &len);
 
-	envelope_load_buffer(evp, str, strlen(str));
+	envelope_load_buffer(evp, buf, len);
 	evp->id = evpid;
 }
 
@@ -731,7 +721,7 @@ do_show_envelope(int argc, struct parameter *argv)
 	    argv[0].u.u_evpid))
 		errx(1, "unable to retrieve envelope");
 
-	display(buf);
+	display_envelope(buf);
 
 	return (0);
 }
@@ -1307,6 +1297,59 @@ end:
 		fclose(fp);
 }
 
+/*
+ * Envelopes are shown in the ASCII format whatever the queue stored them
+ * as, once the queue backend has decrypted and uncompressed them.
+ */
+static void
+display_envelope(const char *s)
+{
+	struct envelope	evp;
+	char		buf[sizeof(struct envelope)];
+	char		tmp[sizeof(struct envelope)];
+	const char     *p = buf;
+	FILE	       *fp;
+	size_t		len;
+
+	if ((fp = fopen(s, "r")) == NULL)
+		err(1, "fopen");
+	len = fread(buf, 1, sizeof(buf), fp);
+	fclose(fp);
+	if (len == 0)
+		errx(1, "invalid envelope");
+
+	if (is_encrypted_buffer(buf)) {
+		setup_key();
+		env->sc_queue_flags |= QUEUE_ENCRYPTION;
+		/* only to find out whether it is compressed as well */
+		if (crypto_decrypt_buffer(buf, len, tmp, sizeof(tmp)) == 0)
+			errx(1, "unable to decrypt envelope");
+		p = tmp;
+	}
+	if (is_gzip_buffer(p))
+		env->sc_queue_flags |= QUEUE_COMPRESSION;
+
+	if (!queue_envelope_load_buffer(&evp, buf, len) ||
+	    (len = envelope_dump_buffer(&evp, buf, sizeof(buf))) == 0)
+		errx(1, "invalid envelope");
+	fwrite(buf, 1, len, stdout);
+}
+
+static char *
+setup_key(void)
+{
+	char   *key;
+	int	i;
+
+	for (i = 0; i < 3; i++) {
+		key = getpass("key> ");
+		if (crypto_setup(key, strlen(key)))
+			return (key);
+	}
+	errx(1, "crypto-setup: invalid key");
+	return (NULL);
+}
+
 static void
 display(const char *s)
 {
@@ -1319,7 +1362,6 @@ display(const char *s)
 		err(1, "fopen");
 
 	if (is_encrypted_fp(fp)) {
-		int	i;
 		int	fd;
 		FILE   *ofp = NULL;
 		char	sfn[] = "/tmp/smtpd.XXXXXXXXXX";
@@ -1335,14 +1377,7 @@ display(const char *s)
 		}
 		unlink(sfn);
 
-		for (i = 0; i < 3; i++) {
-			key = getpass("key> ");
-			if (crypto_setup(key, strlen(key)))
-				break;
-		}
-		if (i == 3)
-			errx(1, "crypto-setup: invalid key");
-
+		key = setup_key();
 		if (!crypto_decrypt_file(fp, ofp)) {
 			printf("object is encrypted: %s\n", key);
 			exit(1);
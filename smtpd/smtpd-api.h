@@ -46,7 +46,7 @@ enum {
 	PROC_QUEUE_ENVELOPE_WALK,
 };
 
-#define PROC_SCHEDULER_API_VERSION	2
+#define PROC_SCHEDULER_API_VERSION	3
 
 struct scheduler_info;
 
@@ -105,6 +105,7 @@ struct scheduler_info {
 	time_t			lasttry;
 	time_t			lastbounce;
 	time_t			nexttry;
+	uint32_t		dest;
 };
 
 #define SCHED_REMOVE		0x01
@@ -99,6 +99,7 @@ static void parent_send_config(int, short, void *);
 static void parent_send_config_lka(void);
 static void parent_send_config_pony(void);
 static void parent_send_config_ca(void);
+static void parent_send_ticket_key(int, short, void *);
 static void parent_sig_handler(int, short, void *);
 static void forkmda(struct mproc *, uint64_t, struct deliver *);
 static int parent_forward_open(char *, char *, uid_t, gid_t);
@@ -108,6 +109,7 @@ static struct mproc *setup_peer(enum smtp_proc_type, pid_t, int);
 static void setup_peers(struct mproc *, struct mproc *);
 static void setup_done(struct mproc *);
 static void setup_proc(void);
+static void setup_worker(struct mproc *, size_t);
 static struct mproc *setup_peer(enum smtp_proc_type, pid_t, int);
 static int imsg_wait(struct imsgbuf *, struct imsg *, int);
 
@@ -153,6 +155,7 @@ TAILQ_HEAD(, offline)		offline_q;
 
 static struct event		config_ev;
 static struct event		offline_ev;
+static struct event		ticket_ev;
 static struct timeval		offline_timeout;
 
 static pid_t			purge_pid = -1;
@@ -171,9 +174,14 @@ struct mproc	*p_queue = NULL;
 struct mproc	*p_scheduler = NULL;
 struct mproc	*p_pony = NULL;
 struct mproc	*p_ca = NULL;
+struct mproc	*p_ponies[SMTPD_MAXWORKERS];
+size_t		 pony_nworkers = 0;
+size_t		 pony_worker = 0;
+struct mproc	*p_cas[SMTPD_MAXWORKERS];
+size_t		 ca_nworkers = 0;
 
 const char	*backend_queue = "fs";
-const char	*backend_scheduler = "ramqueue";
+const char	*backend_scheduler = NULL;
 const char	*backend_stat = "ram";
 
 int	profiling = 0;
@@ -307,10 +315,13 @@ usage(void)
 static void
 parent_shutdown(void)
 {
-	pid_t pid;
+	pid_t	pid;
+	size_t	w;
 
-	mproc_clear(p_ca);
-	mproc_clear(p_pony);
+	for (w = 0; w < ca_nworkers; w++)
+		mproc_clear(p_cas[w]);
+	for (w = 0; w < pony_nworkers; w++)
+		mproc_clear(p_ponies[w]);
 	mproc_clear(p_control);
 	mproc_clear(p_lka);
 	mproc_clear(p_scheduler);
@@ -338,9 +349,13 @@ parent_send_config(int fd, short event, void *p)
 static void
 parent_send_config_pony(void)
 {
+	size_t	w;
+
 	log_debug("debug: parent_send_config: configuring pony process");
-	m_compose(p_pony, IMSG_CONF_START, 0, 0, -1, NULL, 0);
-	m_compose(p_pony, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	for (w = 0; w < pony_nworkers; w++) {
+		m_compose(p_ponies[w], IMSG_CONF_START, 0, 0, -1, NULL, 0);
+		m_compose(p_ponies[w], IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	}
 }
 
 void
@@ -354,9 +369,35 @@ parent_send_config_lka()
 static void
 parent_send_config_ca(void)
 {
+	size_t	w;
+
 	log_debug("debug: parent_send_config: configuring ca process");
-	m_compose(p_ca, IMSG_CONF_START, 0, 0, -1, NULL, 0);
-	m_compose(p_ca, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	for (w = 0; w < ca_nworkers; w++) {
+		m_compose(p_cas[w], IMSG_CONF_START, 0, 0, -1, NULL, 0);
+		m_compose(p_cas[w], IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	}
+}
+
+/*
+ * Hand a new session ticket key to the pony workers, so that they all
+ * accept the tickets issued by any of them, and rotate it regularly.
+ */
+static void
+parent_send_ticket_key(int fd, short event, void *p)
+{
+	struct ssl_ticket_key	 key;
+	struct timeval		 tv;
+	size_t			 w;
+
+	arc4random_buf(&key, sizeof(key));
+	for (w = 0; w < pony_nworkers; w++)
+		m_compose(p_ponies[w], IMSG_SMTP_TLS_TICKET_KEY, 0, 0, -1,
+		    &key, sizeof(key));
+	explicit_bzero(&key, sizeof(key));
+
+	tv.tv_sec = SSL_TICKET_KEY_ROTATE;
+	tv.tv_usec = 0;
+	evtimer_add(&ticket_ev, &tv);
 }
 
 static void
@@ -499,6 +540,7 @@ main(int argc, char *argv[])
 {
 	int		 c, i;
 	int		 opts, flags;
+	size_t		 w, n;
 	const char	*conffile = CONF_FILE;
 	int		 save_argc = argc;
 	char		**save_argv = argv;
@@ -654,6 +696,10 @@ main(int argc, char *argv[])
 	if (parse_config(conf, conffile, opts))
 		exit(1);
 
+	if (backend_scheduler == NULL)
+		backend_scheduler = env->sc_scheduler_backend ?
+		    env->sc_scheduler_backend : "ramqueue";
+
 	seed_rng();
 
 	if (strlcpy(env->sc_conffile, conffile, PATH_MAX)
@@ -731,8 +777,12 @@ main(int argc, char *argv[])
 
 		/* setup all processes */
 
-		p_ca = start_child(save_argc, save_argv, "ca");
-		p_ca->proc = PROC_CA;
+		for (w = 0; w < env->sc_ca_workers; w++) {
+			p_cas[w] = start_child(save_argc, save_argv, "ca");
+			p_cas[w]->proc = PROC_CA;
+		}
+		ca_nworkers = env->sc_ca_workers;
+		p_ca = p_cas[0];
 
 		p_control = start_child(save_argc, save_argv, "control");
 		p_control->proc = PROC_CONTROL;
@@ -740,8 +790,12 @@ main(int argc, char *argv[])
 		p_lka = start_child(save_argc, save_argv, "lka");
 		p_lka->proc = PROC_LKA;
 
-		p_pony = start_child(save_argc, save_argv, "pony");
-		p_pony->proc = PROC_PONY;
+		for (w = 0; w < env->sc_smtp_workers; w++) {
+			p_ponies[w] = start_child(save_argc, save_argv, "pony");
+			p_ponies[w]->proc = PROC_PONY;
+		}
+		pony_nworkers = env->sc_smtp_workers;
+		p_pony = p_ponies[0];
 
 		p_queue = start_child(save_argc, save_argv, "queue");
 		p_queue->proc = PROC_QUEUE;
@@ -749,14 +803,19 @@ main(int argc, char *argv[])
 		p_scheduler = start_child(save_argc, save_argv, "scheduler");
 		p_scheduler->proc = PROC_SCHEDULER;
 
-		setup_peers(p_control, p_ca);
+		for (w = 0; w < ca_nworkers; w++)
+			setup_peers(p_control, p_cas[w]);
 		setup_peers(p_control, p_lka);
-		setup_peers(p_control, p_pony);
 		setup_peers(p_control, p_queue);
 		setup_peers(p_control, p_scheduler);
-		setup_peers(p_pony, p_ca);
-		setup_peers(p_pony, p_lka);
-		setup_peers(p_pony, p_queue);
+		for (w = 0; w < pony_nworkers; w++) {
+			setup_worker(p_ponies[w], w);
+			setup_peers(p_control, p_ponies[w]);
+			for (n = 0; n < ca_nworkers; n++)
+				setup_peers(p_ponies[w], p_cas[n]);
+			setup_peers(p_ponies[w], p_lka);
+			setup_peers(p_ponies[w], p_queue);
+		}
 		setup_peers(p_queue, p_lka);
 		setup_peers(p_queue, p_scheduler);
 
@@ -769,10 +828,12 @@ main(int argc, char *argv[])
 				fatal("imsg_flush");
 		}
 
-		setup_done(p_ca);
+		for (w = 0; w < ca_nworkers; w++)
+			setup_done(p_cas[w]);
 		setup_done(p_control);
 		setup_done(p_lka);
-		setup_done(p_pony);
+		for (w = 0; w < pony_nworkers; w++)
+			setup_done(p_ponies[w]);
 		setup_done(p_queue);
 		setup_done(p_scheduler);
 
@@ -922,6 +983,16 @@ setup_peers(struct mproc *a, struct mproc *b)
 		fatal("imsg_flush");
 }
 
+static void
+setup_worker(struct mproc *p, size_t n)
+{
+	if (imsg_compose(&p->imsgbuf, IMSG_SETUP_WORKER, n, 0, -1,
+	    NULL, 0) == -1)
+		fatal("imsg_compose");
+	if (imsg_flush(&p->imsgbuf) == -1)
+		fatal("imsg_flush");
+}
+
 static void
 setup_done(struct mproc *p)
 {
@@ -974,6 +1045,9 @@ setup_proc(void)
 		case IMSG_SETUP_PEER:
 			setup_peer(imsg.hdr.peerid, imsg.hdr.pid, imsg.fd);
 			break;
+		case IMSG_SETUP_WORKER:
+			pony_worker = imsg.hdr.peerid;
+			break;
 		case IMSG_SETUP_DONE:
 			setup = 0;
 			break;
@@ -1017,10 +1091,16 @@ setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 		pp = &p_scheduler;
 		break;
 	case PROC_PONY:
-		pp = &p_pony;
+		/* workers are set up in order, the first one is p_pony */
+		if (pony_nworkers == SMTPD_MAXWORKERS)
+			fatalx("too many pony workers");
+		pp = &p_ponies[pony_nworkers++];
 		break;
 	case PROC_CA:
-		pp = &p_ca;
+		/* likewise, the first ca worker is p_ca */
+		if (ca_nworkers == SMTPD_MAXWORKERS)
+			fatalx("too many ca workers");
+		pp = &p_cas[ca_nworkers++];
 		break;
 	default:
 		fatalx("unknown peer");
@@ -1040,6 +1120,8 @@ setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 	p->handler = imsg_dispatch;
 
 	*pp = p;
+	p_pony = p_ponies[0];
+	p_ca = p_cas[0];
 
 	return p;
 }
@@ -1079,6 +1161,7 @@ smtpd(void) {
 	struct event	 ev_sigchld;
 	struct event	 ev_sighup;
 	struct timeval	 tv;
+	size_t		 w;
 
 	imsg_callback = parent_imsg;
 
@@ -1088,8 +1171,10 @@ smtpd(void) {
 	child_add(p_control->pid, CHILD_DAEMON, proc_title(PROC_CONTROL));
 	child_add(p_lka->pid, CHILD_DAEMON, proc_title(PROC_LKA));
 	child_add(p_scheduler->pid, CHILD_DAEMON, proc_title(PROC_SCHEDULER));
-	child_add(p_pony->pid, CHILD_DAEMON, proc_title(PROC_PONY));
-	child_add(p_ca->pid, CHILD_DAEMON, proc_title(PROC_CA));
+	for (w = 0; w < pony_nworkers; w++)
+		child_add(p_ponies[w]->pid, CHILD_DAEMON, proc_title(PROC_PONY));
+	for (w = 0; w < ca_nworkers; w++)
+		child_add(p_cas[w]->pid, CHILD_DAEMON, proc_title(PROC_CA));
 
 	event_init();
 
@@ -1113,6 +1198,9 @@ smtpd(void) {
 	memset(&tv, 0, sizeof(tv));
 	evtimer_add(&config_ev, &tv);
 
+	evtimer_set(&ticket_ev, parent_send_ticket_key, NULL);
+	evtimer_add(&ticket_ev, &tv);
+
 	/* defer offline scanning for a second */
 	evtimer_set(&offline_ev, offline_scan, NULL);
 	offline_timeout.tv_sec = 1;
@@ -1968,6 +2056,7 @@ imsg_to_str(int type)
 
 	CASE(IMSG_SETUP_KEY);
 	CASE(IMSG_SETUP_PEER);
+	CASE(IMSG_SETUP_WORKER);
 	CASE(IMSG_SETUP_DONE);
 
 	CASE(IMSG_CONF_START);
@@ -1987,6 +2076,7 @@ imsg_to_str(int type)
 	CASE(IMSG_QUEUE_DELIVERY_TEMPFAIL);
 	CASE(IMSG_QUEUE_DELIVERY_PERMFAIL);
 	CASE(IMSG_QUEUE_DELIVERY_LOOP);
+	CASE(IMSG_QUEUE_DISCOVER);
 	CASE(IMSG_QUEUE_DISCOVER_EVPID);
 	CASE(IMSG_QUEUE_DISCOVER_MSGID);
 	CASE(IMSG_QUEUE_ENVELOPE_ACK);
@@ -2045,6 +2135,7 @@ imsg_to_str(int type)
 	CASE(IMSG_SMTP_CHECK_SENDER);
 	CASE(IMSG_SMTP_EXPAND_RCPT);
 	CASE(IMSG_SMTP_LOOKUP_HELO);
+	CASE(IMSG_SMTP_TLS_TICKET_KEY);
 
 	CASE(IMSG_SMTP_REQ_CONNECT);
 	CASE(IMSG_SMTP_REQ_HELO);
@@ -2079,6 +2170,7 @@ imsg_to_str(int type)
 
 	CASE(IMSG_CA_PRIVENC);
 	CASE(IMSG_CA_PRIVDEC);
+	CASE(IMSG_CA_ECDSA_SIGN);
 	default:
 		(void)snprintf(buf, sizeof(buf), "IMSG_??? (%d)", type);
 
@@ -76,6 +76,7 @@
 #define	SMTPD_VERSION		 "6.4.0-portable"
 #define SMTPD_SESSION_TIMEOUT	 300
 #define SMTPD_BACKLOG		 5
+#define SMTPD_MAXWORKERS	 32	/* power of two, see pony_uid() */
 
 #ifndef PATH_SMTPCTL
 #define	PATH_SMTPCTL		"/usr/sbin/smtpctl"
@@ -240,6 +241,7 @@ enum imsg_type {
 
 	IMSG_SETUP_KEY,
 	IMSG_SETUP_PEER,
+	IMSG_SETUP_WORKER,
 	IMSG_SETUP_DONE,
 
 	IMSG_CONF_START,
@@ -259,6 +261,7 @@ enum imsg_type {
 	IMSG_QUEUE_DELIVERY_TEMPFAIL,
 	IMSG_QUEUE_DELIVERY_PERMFAIL,
 	IMSG_QUEUE_DELIVERY_LOOP,
+	IMSG_QUEUE_DISCOVER,
 	IMSG_QUEUE_DISCOVER_EVPID,
 	IMSG_QUEUE_DISCOVER_MSGID,
 	IMSG_QUEUE_ENVELOPE_ACK,
@@ -317,6 +320,7 @@ enum imsg_type {
 	IMSG_SMTP_CHECK_SENDER,
 	IMSG_SMTP_EXPAND_RCPT,
 	IMSG_SMTP_LOOKUP_HELO,
+	IMSG_SMTP_TLS_TICKET_KEY,
 
 	IMSG_SMTP_REQ_CONNECT,
 	IMSG_SMTP_REQ_HELO,
@@ -354,7 +358,8 @@ enum imsg_type {
 	IMSG_FILTER_SMTP_DATA_END,
 
 	IMSG_CA_PRIVENC,
-	IMSG_CA_PRIVDEC
+	IMSG_CA_PRIVDEC,
+	IMSG_CA_ECDSA_SIGN
 };
 
 enum smtp_proc_type {
@@ -582,13 +587,18 @@ struct smtpd {
 #define QUEUE_COMPRESSION      		0x00000001
 #define QUEUE_ENCRYPTION      		0x00000002
 #define QUEUE_EVPCACHE			0x00000004
+#define QUEUE_GROUPCOMMIT		0x00000008
+#define QUEUE_BINARY			0x00000010
 	uint32_t			sc_queue_flags;
 	char			       *sc_queue_key;
 	size_t				sc_queue_evpcache_size;
+	size_t				sc_queue_commit_window;
 	char			       *sc_queue_directory;
 
 	size_t				sc_session_max_rcpt;
 	size_t				sc_session_max_mails;
+	size_t				sc_smtp_workers;
+	size_t				sc_ca_workers;
 
 	struct dict		       *sc_mda_wrappers;
 	size_t				sc_mda_max_session;
@@ -603,6 +613,8 @@ struct smtpd {
 	size_t				sc_scheduler_max_evp_batch_size;
 	size_t				sc_scheduler_max_msg_batch_size;
 	size_t				sc_scheduler_max_schedule;
+	char			       *sc_scheduler_backend;
+	struct dict		       *sc_scheduler_weights;
 
 	struct dict		       *sc_processors_dict;
 
@@ -793,6 +805,7 @@ struct mta_limits {
 	size_t	max_mail_per_session;
 	time_t	sessdelay_transaction;
 	time_t	sessdelay_keepalive;
+	size_t	maxidle_per_relay;
 
 	size_t	max_failures_per_session;
 
@@ -850,6 +863,8 @@ struct mta_relay {
 	size_t			 nconn;
 	size_t			 nconn_ready;
 	time_t			 lastconn;
+
+	struct tree		 idle;
 };
 
 struct mta_envelope {
@@ -891,6 +906,11 @@ struct compress_backend {
 	size_t	(*uncompress_chunk)(void *, size_t, void *, size_t);
 	int	(*compress_file)(FILE *, FILE *);
 	int	(*uncompress_file)(FILE *, FILE *);
+
+	void   *(*stream_open)(int, int (*)(void *, const void *, size_t), void *);
+	int	(*stream_write)(void *, const void *, size_t);
+	int	(*stream_close)(void *);
+	int	(*stream_size)(const void *, size_t, size_t *);
 };
 
 /* auth structures */
@@ -1019,6 +1039,11 @@ extern struct mproc *p_queue;
 extern struct mproc *p_scheduler;
 extern struct mproc *p_pony;
 extern struct mproc *p_ca;
+extern struct mproc *p_ponies[SMTPD_MAXWORKERS];
+extern size_t pony_nworkers;
+extern size_t pony_worker;
+extern struct mproc *p_cas[SMTPD_MAXWORKERS];
+extern size_t ca_nworkers;
 
 extern struct smtpd	*env;
 extern void (*imsg_callback)(struct mproc *, struct imsg *);
@@ -1281,6 +1306,11 @@ size_t	compress_chunk(void *, size_t, void *, size_t);
 size_t	uncompress_chunk(void *, size_t, void *, size_t);
 int	compress_file(FILE *, FILE *);
 int	uncompress_file(FILE *, FILE *);
+void   *compress_stream_open(int (*)(void *, const void *, size_t), void *);
+void   *uncompress_stream_open(int (*)(void *, const void *, size_t), void *);
+int	compress_stream_write(void *, const void *, size_t);
+int	compress_stream_close(void *);
+int	uncompress_stream_size(const void *, size_t, size_t *);
 
 /* config.c */
 #define PURGE_LISTENERS		0x01
@@ -1307,6 +1337,11 @@ int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
+void   *crypto_stream_open(int, int (*)(void *, const void *, size_t), void *);
+int	crypto_stream_write(void *, const void *, size_t);
+int	crypto_stream_close(void *);
+off_t	crypto_decrypted_size(off_t);
+int	crypto_decrypt_at(int, off_t, void *, size_t);
 
 
 /* dns.c */
@@ -1323,6 +1358,8 @@ void envelope_set_esc_class(struct envelope *, enum enhanced_status_class);
 void envelope_set_esc_code(struct envelope *, enum enhanced_status_code);
 int envelope_load_buffer(struct envelope *, const char *, size_t);
 int envelope_dump_buffer(const struct envelope *, char *, size_t);
+int envelope_dump_binary(const struct envelope *, char *, size_t);
+int envelope_is_binary(const char *, size_t);
 
 
 /* expand.c */
@@ -1443,6 +1480,8 @@ void mproc_clear(struct mproc *);
 void mproc_enable(struct mproc *);
 void mproc_disable(struct mproc *);
 void mproc_event_add(struct mproc *);
+void mproc_hold(void);
+void mproc_release(void);
 void m_compose(struct mproc *, uint32_t, uint32_t, pid_t, int, void *, size_t);
 void m_composev(struct mproc *, uint32_t, uint32_t, pid_t, int,
     const struct iovec *, int);
@@ -1505,6 +1544,7 @@ const char *mta_relay_to_text(struct mta_relay *);
 /* mta_session.c */
 void mta_session(struct mta_relay *, struct mta_route *);
 void mta_session_imsg(struct mproc *, struct imsg *);
+void mta_session_resume(struct mta_relay *);
 
 
 /* parse.y */
@@ -1525,10 +1565,12 @@ int queue_message_create(uint32_t *);
 int queue_message_delete(uint32_t);
 int queue_message_commit(uint32_t);
 int queue_message_fd_r(uint32_t);
+int queue_message_fd_r_stream(uint32_t, size_t *);
 int queue_message_fd_rw(uint32_t);
 int queue_envelope_create(struct envelope *);
 int queue_envelope_delete(uint64_t);
 int queue_envelope_load(uint64_t, struct envelope *);
+int queue_envelope_load_buffer(struct envelope *, char *, size_t);
 int queue_envelope_update(struct envelope *);
 int queue_envelope_walk(struct envelope *);
 int queue_message_walk(struct envelope *, uint32_t, int *, void **);
@@ -1564,11 +1606,14 @@ int scheduler(void);
 /* scheduler_bakend.c */
 struct scheduler_backend *scheduler_backend_lookup(const char *);
 void scheduler_info(struct scheduler_info *, struct envelope *);
+uint32_t scheduler_dest(const char *);
 
 
 /* pony.c */
 int pony(void);
 void pony_imsg(struct mproc *, struct imsg *);
+uint64_t pony_uid(void);
+struct mproc *pony_peer(uint64_t);
 
 
 /* resolver.c */
@@ -1701,6 +1746,10 @@ int rmtree(char *, int);
 int mvpurge(char *, char *);
 int mktmpfile(void);
 const char *parse_smtp_response(char *, size_t, char **, int *);
+size_t smtp_body_encoded_len(const char *, size_t, int, int);
+size_t smtp_body_encode(char *, const char *, size_t, int, int *);
+size_t smtp_body_iov(struct iovec *, int *, int, char *, size_t, size_t,
+    size_t *);
 int xasprintf(char **, const char *, ...);
 void *xmalloc(size_t);
 void *xcalloc(size_t, size_t);
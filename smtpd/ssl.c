@@ -41,12 +41,27 @@
 #include <openssl/engine.h>
 #include <openssl/err.h>
 #include <openssl/rsa.h>
+#include <openssl/ecdsa.h>
 #include <openssl/dh.h>
 #include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 #include "log.h"
 #include "ssl.h"
 
+static int ssl_ticket_key_cb(SSL *, unsigned char *, unsigned char *,
+    EVP_CIPHER_CTX *, HMAC_CTX *, int);
+
+/*
+ * Session tickets are protected with keys generated by the parent and
+ * handed to every pony worker, so a client may resume its session on
+ * any of them.  The previous key is kept to accept the tickets issued
+ * before the last rotation.
+ */
+static struct ssl_ticket_key	ticket_keys[2];
+static int			ticket_nkeys;
+
 void
 ssl_init(void)
 {
@@ -71,18 +86,34 @@ ssl_setup(SSL_CTX **ctxp, struct pki *pki,
     int (*sni_cb)(SSL *,int *,void *), const char *ciphers)
 {
 	SSL_CTX	*ctx;
+	struct ssl_ticket_key key;
 	uint8_t sid[SSL_MAX_SID_CTX_LENGTH];
+	unsigned int sidlen;
 
 	ctx = ssl_ctx_create(pki->pki_name, pki->pki_cert, pki->pki_cert_len, ciphers);
 
 	/*
-	 * Set session ID context to a random value.  We don't support
-	 * persistent caching of sessions so it is OK to set a temporary
-	 * session ID context that is valid during run time.
+	 * Derive the session ID context from the pki name: it must be
+	 * the same in all pony workers for a session established with
+	 * one of them to be resumed with another.
 	 */
-	arc4random_buf(sid, sizeof(sid));
-	if (!SSL_CTX_set_session_id_context(ctx, sid, sizeof(sid)))
+	if (!EVP_Digest(pki->pki_name, strlen(pki->pki_name), sid, &sidlen,
+	    EVP_sha256(), NULL))
 		goto err;
+	if (!SSL_CTX_set_session_id_context(ctx, sid, sidlen))
+		goto err;
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE_SIZE);
+
+	/* use a local key until the parent sends one */
+	if (ticket_nkeys == 0) {
+		arc4random_buf(&key, sizeof(key));
+		ssl_ticket_key_set(&key);
+		explicit_bzero(&key, sizeof(key));
+	}
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, ssl_ticket_key_cb);
 
 	if (sni_cb)
 		SSL_CTX_set_tlsext_servername_callback(ctx, sni_cb);
@@ -338,6 +369,54 @@ ssl_to_text(const SSL *ssl)
 	return (buf);
 }
 
+void
+ssl_ticket_key_set(const struct ssl_ticket_key *key)
+{
+	ticket_keys[1] = ticket_keys[0];
+	ticket_keys[0] = *key;
+	if (ticket_nkeys < 2)
+		ticket_nkeys++;
+}
+
+static int
+ssl_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	struct ssl_ticket_key	*key;
+	int			 i;
+
+	if (enc) {
+		key = &ticket_keys[0];
+		memcpy(name, key->name, sizeof(key->name));
+		arc4random_buf(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc()));
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+		    key->aes_key, iv) ||
+		    !HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+		    EVP_sha256(), NULL))
+			return (-1);
+		return (1);
+	}
+
+	for (i = 0; i < ticket_nkeys; i++)
+		if (memcmp(name, ticket_keys[i].name,
+		    sizeof(ticket_keys[i].name)) == 0)
+			break;
+
+	/* unknown or expired key, do a full handshake */
+	if (i == ticket_nkeys)
+		return (0);
+
+	key = &ticket_keys[i];
+	if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+	    EVP_sha256(), NULL) ||
+	    !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+	    key->aes_key, iv))
+		return (-1);
+
+	/* have the client renew a ticket made with the previous key */
+	return (i == 0 ? 1 : 2);
+}
+
 void
 ssl_error(const char *where)
 {
@@ -358,6 +437,9 @@ ssl_load_pkey(const void *data, size_t datalen, char *buf, off_t len,
 	X509		*x509 = NULL;
 	EVP_PKEY	*pkey = NULL;
 	RSA		*rsa = NULL;
+#ifdef HAVE_ECDSA_SET_EX_DATA
+	EC_KEY		*eckey = NULL;
+#endif
 	void		*exdata = NULL;
 
 	if ((in = BIO_new_mem_buf(buf, len)) == NULL) {
@@ -380,15 +462,40 @@ ssl_load_pkey(const void *data, size_t datalen, char *buf, off_t len,
 	in = NULL;
 
 	if (data != NULL && datalen) {
-		if ((rsa = EVP_PKEY_get1_RSA(pkey)) == NULL ||
-		    (exdata = malloc(datalen)) == NULL) {
+		if ((exdata = malloc(datalen)) == NULL) {
 			SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY, ERR_R_EVP_LIB);
 			goto fail;
 		}
-
 		memcpy(exdata, data, datalen);
-		RSA_set_ex_data(rsa, 0, exdata);
-		RSA_free(rsa); /* dereference, will be cleaned up with pkey */
+
+		/* tell the privsep engine which pki this key belongs to */
+		switch (EVP_PKEY_id(pkey)) {
+		case EVP_PKEY_RSA:
+			if ((rsa = EVP_PKEY_get1_RSA(pkey)) == NULL) {
+				SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY,
+				    ERR_R_EVP_LIB);
+				goto fail;
+			}
+			RSA_set_ex_data(rsa, 0, exdata);
+			/* dereference, will be cleaned up with pkey */
+			RSA_free(rsa);
+			break;
+#ifdef HAVE_ECDSA_SET_EX_DATA
+		case EVP_PKEY_EC:
+			if ((eckey = EVP_PKEY_get1_EC_KEY(pkey)) == NULL) {
+				SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY,
+				    ERR_R_EVP_LIB);
+				goto fail;
+			}
+			ECDSA_set_ex_data(eckey, 0, exdata);
+			EC_KEY_free(eckey);
+			break;
+#endif
+		default:
+			SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY,
+			    SSL_R_UNKNOWN_CERTIFICATE_TYPE);
+			goto fail;
+		}
 	}
 
 	*x509ptr = x509;
@@ -420,7 +527,7 @@ ssl_ctx_fake_private_key(SSL_CTX *ctx, const void *data, size_t datalen,
 	/*
 	 * Use the public key as the "private" key - the secret key
 	 * parameters are hidden in an extra process that will be
-	 * contacted by the RSA engine.  The SSL/TLS library needs at
+	 * contacted by the RSA or ECDSA engine.  The SSL/TLS library needs at
 	 * least the public key parameters in the current process.
 	 */
 	ret = SSL_CTX_use_PrivateKey(ctx, pkey);
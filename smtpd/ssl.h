@@ -17,6 +17,14 @@
 
 #define SSL_CIPHERS		"HIGH:!aNULL:!MD5"
 #define	SSL_SESSION_TIMEOUT	300
+#define	SSL_SESSION_CACHE_SIZE	10240
+#define	SSL_TICKET_KEY_ROTATE	SSL_SESSION_TIMEOUT
+
+struct ssl_ticket_key {
+	unsigned char		 name[16];
+	unsigned char		 aes_key[32];
+	unsigned char		 hmac_key[32];
+};
 
 struct pki {
 	char			 pki_name[HOST_NAME_MAX+1];
@@ -54,6 +62,7 @@ char	       *ssl_load_key(const char *, off_t *, char *, mode_t, const char *);
 
 const char     *ssl_to_text(const SSL *);
 void		ssl_error(const char *);
+void		ssl_ticket_key_set(const struct ssl_ticket_key *);
 
 int		ssl_load_certificate(struct pki *, const char *);
 int		ssl_load_keyfile(struct pki *, const char *, const char *);
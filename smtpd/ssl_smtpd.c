@@ -58,6 +58,8 @@ ssl_mta_init(void *pkiname, char *cert, off_t cert_len, const char *ciphers)
 		goto err;
 	if (!SSL_set_ssl_method(ssl, SSLv23_client_method()))
 		goto err;
+	/* let servers hand out tickets, the mta caches sessions itself */
+	SSL_clear_options(ssl, SSL_OP_NO_TICKET);
 
 	SSL_CTX_free(ctx);
 	return (void *)(ssl);
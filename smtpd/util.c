@@ -27,6 +27,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -736,6 +737,125 @@ parse_smtp_response(char *line, size_t len, char **msg, int *cont)
 	return NULL;
 }
 
+/*
+ * Encode a block of spooled message for the wire: LF becomes CRLF and,
+ * if dotstuff is set, a '.' starting a line is doubled.  bol tells if
+ * the block starts a line; smtp_body_encode() updates it for the next
+ * block.  Lines are located with memchr(3) so that the copy is done a
+ * segment at a time rather than a byte at a time.
+ */
+size_t
+smtp_body_encoded_len(const char *src, size_t len, int dotstuff, int bol)
+{
+	const char	*p, *end, *lf;
+	size_t		 n;
+
+	n = len;
+	end = src + len;
+	if (dotstuff && bol && len && src[0] == '.')
+		n++;
+	for (p = src; (lf = memchr(p, '\n', end - p)) != NULL; p = lf + 1) {
+		n++;
+		if (dotstuff && lf + 1 < end && lf[1] == '.')
+			n++;
+	}
+
+	return n;
+}
+
+size_t
+smtp_body_encode(char *dst, const char *src, size_t len, int dotstuff,
+    int *bol)
+{
+	const char	*p, *end, *lf;
+	char		*d;
+	size_t		 n;
+
+	d = dst;
+	end = src + len;
+	for (p = src; p < end; p = lf + 1) {
+		if (dotstuff && *bol && *p == '.')
+			*d++ = '.';
+		if ((lf = memchr(p, '\n', end - p)) == NULL) {
+			memcpy(d, p, end - p);
+			d += end - p;
+			*bol = 0;
+			break;
+		}
+		n = lf - p;
+		memcpy(d, p, n);
+		d += n;
+		*d++ = '\r';
+		*d++ = '\n';
+		*bol = 1;
+	}
+
+	return d - dst;
+}
+
+static void
+body_iov_add(struct iovec *iov, int *iovcnt, size_t *olen, char *from,
+    char *to)
+{
+	if (to == from)
+		return;
+	iov[*iovcnt].iov_base = from;
+	iov[*iovcnt].iov_len = to - from;
+	*iovcnt += 1;
+	*olen += to - from;
+}
+
+/*
+ * The reverse of smtp_body_encode() for a DATA body received from a
+ * client, without copying: the complete lines at the start of buf are
+ * described by at most iovmax iovecs pointing into it, which leave out
+ * the CR of each CRLF and the '.' added by the client at the start of a
+ * line.  The terminating "." line and any line of linemax octets or
+ * more stop the scan and are left for the caller to handle, as is an
+ * incomplete line.  Returns the number of octets consumed and sets olen
+ * to the number of octets described.
+ */
+size_t
+smtp_body_iov(struct iovec *iov, int *iovcnt, int iovmax, char *buf,
+    size_t len, size_t linemax, size_t *olen)
+{
+	char	*p, *end, *lf, *seg;
+	size_t	 n;
+	int	 cr;
+
+	*iovcnt = 0;
+	*olen = 0;
+	if (iovmax < 3)
+		return 0;
+
+	seg = buf;
+	end = buf + len;
+	for (p = buf; (lf = memchr(p, '\n', end - p)) != NULL; p = lf + 1) {
+		/* a line cuts the segment at most twice */
+		if (*iovcnt + 3 > iovmax)
+			break;
+		n = lf - p;
+		cr = (n && lf[-1] == '\r');
+		if (cr)
+			n--;
+		if (n >= linemax)
+			break;
+		if (n && p[0] == '.') {
+			if (n == 1)
+				break;
+			body_iov_add(iov, iovcnt, olen, seg, p);
+			seg = p + 1;
+		}
+		if (cr) {
+			body_iov_add(iov, iovcnt, olen, seg, lf - 1);
+			seg = lf;
+		}
+	}
+	body_iov_add(iov, iovcnt, olen, seg, p);
+
+	return p - buf;
+}
+
 static int
 parse_mailname_file(char *hostname, size_t len)
 {